@@ -0,0 +1,599 @@
+/*
+ * sockem - socket-level network emulation
+ *
+ * Copyright (c) 2016, Magnus Edenhill, Andreas Smas
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * sockem benchmarks
+ *
+ * Measures the overhead sockem adds over plain loopback TCP using the
+ * sockem_connect() API against an in-process echo/sink server:
+ *   setup   - connection setup rate
+ *   rtt     - added round-trip time at the default config
+ *   thruput - passthrough throughput and CPU time per GB forwarded
+ *   scale   - setup rate and RTT at 1, 100 and 10000 concurrent sockems,
+ *             clamped to what the process' fd limit allows
+ *
+ * Results are written as one JSON object per line to stdout (or -o file),
+ * progress and errors to stderr.
+ *
+ * Usage: sockem_bench [-q] [-o file] [-c conf] [-w workers] [benchmark..]
+ *   -q          quick run with smaller counts
+ *   -o file     write results to file
+ *   -c conf     sockem config CSV for all sockems, e.g. "splice=0"
+ *   -w workers  sockem forwarder pool size (default 4, 0 = dedicated)
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "sockem.h"
+
+
+static FILE *out;
+static const char *conf = "true";
+static int quick;
+static int failed;    /* a benchmark failed: exit status 1 */
+
+#define BENCH_DRAIN_TIMEOUT_MS 10000 /* forwarding stall to give up on */
+
+/* Connection modes */
+enum {
+        MODE_PLAIN,       /* plain loopback TCP, the baseline */
+        MODE_SOCKEM,      /* through sockem, loopback TCP app socket */
+        MODE_SOCKETPAIR,  /* through sockem, socketpair() app socket */
+        MODE__CNT
+};
+
+static const char *mode_names[] = { "plain", "sockem", "socketpair" };
+
+/* In-process server */
+static struct sockaddr_in echo_addr;   /* echoes everything back */
+static struct sockaddr_in sink_addr;   /* discards everything */
+
+
+static int64_t bench_clock (void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ((int64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+
+/**
+ * @returns user+system CPU time of the process in microseconds.
+ */
+static int64_t bench_cpu (void) {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        return ((int64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000) +
+                ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+
+/**
+ * Single-threaded epoll echo/sink server.
+ * Listen sockets have epoll data.u64 of (fd << 2) | 1 for echo or
+ * | 2 for sink, connections (fd << 2) | 0 for echo or | 3 for sink.
+ */
+static void *server_run (void *arg) {
+        int epfd = (int)(intptr_t)arg;
+        static char buf[256*1024];
+
+        while (1) {
+                struct epoll_event evs[256];
+                int r, i;
+
+                r = epoll_wait(epfd, evs, 256, -1);
+                for (i = 0 ; i < r ; i++) {
+                        int fd = (int)(evs[i].data.u64 >> 2);
+                        int type = (int)(evs[i].data.u64 & 3);
+                        ssize_t n;
+
+                        if (type == 1 || type == 2) {
+                                struct epoll_event ev = { .events = EPOLLIN };
+                                int s = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+                                int one = 1;
+
+                                if (s == -1)
+                                        continue;
+                                setsockopt(s, IPPROTO_TCP, TCP_NODELAY,
+                                           &one, sizeof(one));
+                                ev.data.u64 = ((uint64_t)s << 2) |
+                                        (type == 1 ? 0 : 3);
+                                epoll_ctl(epfd, EPOLL_CTL_ADD, s, &ev);
+                                continue;
+                        }
+
+                        n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+                        if (n == 0 || (n == -1 && errno != EAGAIN)) {
+                                close(fd);
+                                continue;
+                        } else if (n > 0 && type == 0) {
+                                ssize_t of = 0;
+                                /* Blocking echo, clients read what
+                                 * they write. */
+                                while (of < n) {
+                                        ssize_t w = send(fd, buf + of, n - of,
+                                                         MSG_NOSIGNAL);
+                                        if (w <= 0)
+                                                break;
+                                        of += w;
+                                }
+                        }
+                }
+        }
+
+        return NULL;
+}
+
+
+static int server_listen (int epfd, struct sockaddr_in *sin, int type) {
+        struct epoll_event ev = { .events = EPOLLIN };
+        socklen_t sl = sizeof(*sin);
+        int one = 1;
+        int s;
+
+        memset(sin, 0, sizeof(*sin));
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        s = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(s, (struct sockaddr *)sin, sizeof(*sin)) == -1 ||
+            getsockname(s, (struct sockaddr *)sin, &sl) == -1 ||
+            listen(s, 4096) == -1) {
+                perror("server listen");
+                exit(1);
+        }
+
+        ev.data.u64 = ((uint64_t)s << 2) | type;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, s, &ev);
+
+        return s;
+}
+
+
+static void server_start (void) {
+        pthread_t thrd;
+        int epfd = epoll_create1(EPOLL_CLOEXEC);
+
+        server_listen(epfd, &echo_addr, 1);
+        server_listen(epfd, &sink_addr, 2);
+
+        pthread_create(&thrd, NULL, server_run, (void *)(intptr_t)epfd);
+        pthread_detach(thrd);
+}
+
+
+/**
+ * Client connection, plain or through sockem.
+ */
+struct conn {
+        int fd;
+        sockem_t *skm;
+};
+
+
+static int conn_open (struct conn *c, const struct sockaddr_in *addr,
+                      int mode) {
+        int one = 1;
+
+        c->skm = NULL;
+        c->fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        if (c->fd == -1)
+                return -1;
+
+        if (mode == MODE_PLAIN) {
+                if (connect(c->fd, (const struct sockaddr *)addr,
+                            sizeof(*addr)) == -1) {
+                        close(c->fd);
+                        return -1;
+                }
+        } else {
+                c->skm = sockem_connect(c->fd, (const struct sockaddr *)addr,
+                                        sizeof(*addr), conf, 0,
+                                        "socketpair",
+                                        mode == MODE_SOCKETPAIR, NULL);
+                if (!c->skm) {
+                        close(c->fd);
+                        return -1;
+                }
+        }
+
+        if (mode != MODE_SOCKETPAIR)
+                setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        return 0;
+}
+
+
+static void conn_close (struct conn *c) {
+        if (c->skm)
+                sockem_close(c->skm);
+        close(c->fd);
+}
+
+
+/**
+ * @brief Send \p len bytes and read them back.
+ * @returns the round-trip time in microseconds, or -1 on error.
+ */
+static int64_t conn_ping (struct conn *c, size_t len) {
+        char buf[1024];
+        size_t got = 0;
+        int64_t ts = bench_clock();
+
+        memset(buf, 'p', len);
+        if (send(c->fd, buf, len, MSG_NOSIGNAL) != (ssize_t)len)
+                return -1;
+
+        while (got < len) {
+                ssize_t r = recv(c->fd, buf, sizeof(buf), 0);
+                if (r <= 0)
+                        return -1;
+                got += r;
+        }
+
+        return bench_clock() - ts;
+}
+
+
+static int cmp_i64 (const void *a, const void *b) {
+        int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+        return x < y ? -1 : x > y;
+}
+
+
+/**
+ * @returns the maximum number of concurrent connections the fd limit
+ *          allows: each sockem connection uses the application socket,
+ *          the app- and peer-side sockem sockets and the server socket.
+ */
+static int max_conns (void) {
+        struct rlimit rl;
+
+        getrlimit(RLIMIT_NOFILE, &rl);
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+
+        return (int)((rl.rlim_cur - 64) / 4);
+}
+
+
+/**
+ * @brief Connection setup rate: open and close \p cnt connections.
+ */
+static void bench_setup (void) {
+        int cnt = quick ? 200 : 2000;
+        int mode;
+
+        for (mode = 0 ; mode < MODE__CNT ; mode++) {
+                int64_t ts = bench_clock();
+                int i, fails = 0;
+
+                for (i = 0 ; i < cnt ; i++) {
+                        struct conn c;
+                        if (conn_open(&c, &sink_addr, mode) == -1) {
+                                fails++;
+                                continue;
+                        }
+                        conn_close(&c);
+                }
+
+                ts = bench_clock() - ts;
+                fprintf(out, "{\"bench\":\"setup\",\"mode\":\"%s\","
+                        "\"conns\":%d,\"fails\":%d,\"us_per_conn\":%.1f,"
+                        "\"conns_per_s\":%.0f}\n",
+                        mode_names[mode], cnt, fails, (double)ts / cnt,
+                        (double)cnt * 1000000.0 / ts);
+        }
+}
+
+
+/**
+ * @brief Round-trip time of small messages over a single connection.
+ */
+static void bench_rtt (void) {
+        int cnt = quick ? 1000 : 10000;
+        int64_t *rtts = calloc(cnt, sizeof(*rtts));
+        int mode;
+
+        for (mode = 0 ; mode < MODE__CNT ; mode++) {
+                struct conn c;
+                int i;
+
+                if (conn_open(&c, &echo_addr, mode) == -1) {
+                        fprintf(stderr, "rtt: %s: connect failed: %s\n",
+                                mode_names[mode], strerror(errno));
+                        continue;
+                }
+
+                for (i = 0 ; i < cnt ; i++)
+                        if ((rtts[i] = conn_ping(&c, 64)) == -1)
+                                break;
+                conn_close(&c);
+
+                if (i < cnt) {
+                        fprintf(stderr, "rtt: %s: ping failed\n",
+                                mode_names[mode]);
+                        continue;
+                }
+
+                qsort(rtts, cnt, sizeof(*rtts), cmp_i64);
+                fprintf(out, "{\"bench\":\"rtt\",\"mode\":\"%s\","
+                        "\"pings\":%d,\"p50_us\":%"PRId64","
+                        "\"p99_us\":%"PRId64",\"max_us\":%"PRId64"}\n",
+                        mode_names[mode], cnt, rtts[cnt / 2],
+                        rtts[(cnt * 99) / 100], rtts[cnt - 1]);
+        }
+
+        free(rtts);
+}
+
+
+/**
+ * @brief Bulk throughput to the sink and CPU time spent per GB.
+ */
+static void bench_thruput (void) {
+        size_t total = (quick ? 256 : 2048) * (size_t)(1024*1024);
+        size_t bufsz = 128*1024;
+        char *buf = malloc(bufsz);
+        int mode;
+
+        memset(buf, 'x', bufsz);
+
+        for (mode = 0 ; mode < MODE__CNT ; mode++) {
+                struct conn c;
+                size_t sent = 0;
+                int64_t ts, cpu;
+                double gb = (double)total / (1024.0*1024.0*1024.0);
+
+                if (conn_open(&c, &sink_addr, mode) == -1) {
+                        fprintf(stderr, "thruput: %s: connect failed: %s\n",
+                                mode_names[mode], strerror(errno));
+                        continue;
+                }
+
+                ts = bench_clock();
+                cpu = bench_cpu();
+                while (sent < total) {
+                        ssize_t r = send(c.fd, buf, bufsz, MSG_NOSIGNAL);
+                        if (r <= 0)
+                                break;
+                        sent += r;
+                }
+
+                /* Wait for the sink to have read everything, giving up
+                 * if forwarding stalls or the sockem is torn down. */
+                if (c.skm) {
+                        struct sockem_stats st;
+                        uint64_t last = 0;
+                        int64_t deadline = bench_clock() +
+                                BENCH_DRAIN_TIMEOUT_MS * 1000;
+
+                        while (1) {
+                                usleep(1000);
+                                sockem_stats(c.skm, &st);
+                                if (st.tx.bytes >= sent)
+                                        break;
+                                if (st.tx.bytes > last) {
+                                        last = st.tx.bytes;
+                                        deadline = bench_clock() +
+                                                BENCH_DRAIN_TIMEOUT_MS * 1000;
+                                }
+                                if (st.closed || bench_clock() > deadline)
+                                        break;
+                        }
+
+                        if (st.tx.bytes < sent) {
+                                fprintf(stderr, "thruput: %s: only %"PRIu64
+                                        " of %zu bytes forwarded%s\n",
+                                        mode_names[mode], st.tx.bytes, sent,
+                                        st.closed ? ", sockem closed" :
+                                        ", timed out");
+                                failed = 1;
+                                conn_close(&c);
+                                continue;
+                        }
+                }
+
+                ts = bench_clock() - ts;
+                cpu = bench_cpu() - cpu;
+                conn_close(&c);
+
+                fprintf(out, "{\"bench\":\"thruput\",\"mode\":\"%s\","
+                        "\"bytes\":%zu,\"mb_per_s\":%.1f,"
+                        "\"cpu_s_per_gb\":%.3f}\n",
+                        mode_names[mode], sent,
+                        ((double)sent / (1024.0*1024.0)) /
+                        ((double)ts / 1000000.0),
+                        ((double)cpu / 1000000.0) / gb);
+        }
+
+        free(buf);
+}
+
+
+/**
+ * @brief Setup rate and RTT with \p cnt of \p req concurrent connections.
+ */
+static void bench_scale_n (int req, int cnt, int mode) {
+        struct conn *conns = calloc(cnt, sizeof(*conns));
+        int64_t *rtts = calloc(cnt, sizeof(*rtts));
+        int64_t ts;
+        int i, opened;
+
+        ts = bench_clock();
+        for (opened = 0 ; opened < cnt ; opened++)
+                if (conn_open(&conns[opened], &echo_addr, mode) == -1)
+                        break;
+        ts = bench_clock() - ts;
+
+        for (i = 0 ; i < opened ; i++)
+                if ((rtts[i] = conn_ping(&conns[i], 64)) == -1)
+                        break;
+
+        if (i < opened || opened < cnt)
+                fprintf(stderr, "scale: %s: %d/%d conns opened, "
+                        "%d pinged\n", mode_names[mode], opened, cnt, i);
+        if (i > 0)
+                qsort(rtts, i, sizeof(*rtts), cmp_i64);
+
+        fprintf(out, "{\"bench\":\"scale\",\"mode\":\"%s\","
+                "\"requested\":%d,\"conns\":%d,\"opened\":%d,"
+                "\"us_per_conn\":%.1f,"
+                "\"rtt_p50_us\":%"PRId64",\"rtt_p99_us\":%"PRId64"}\n",
+                mode_names[mode], req, cnt, opened,
+                opened ? (double)ts / opened : 0.0,
+                i ? rtts[i / 2] : 0, i ? rtts[(i * 99) / 100] : 0);
+
+        for (i = 0 ; i < opened ; i++)
+                conn_close(&conns[i]);
+
+        free(conns);
+        free(rtts);
+}
+
+
+static void bench_scale (void) {
+        int cnts[] = { 1, 100, 10000 };
+        int max = max_conns();
+        int i, mode;
+
+        for (i = 0 ; i < 3 ; i++) {
+                int cnt = cnts[i];
+
+                if (quick && cnt > 1000)
+                        cnt = 1000;
+                if (cnt > max) {
+                        fprintf(stderr, "scale: fd limit allows only %d "
+                                "connections, not %d\n", max, cnt);
+                        cnt = max;
+                }
+
+                for (mode = 0 ; mode < MODE__CNT ; mode++)
+                        bench_scale_n(cnts[i], cnt, mode);
+        }
+}
+
+
+static const struct {
+        const char *name;
+        void (*run) (void);
+} benchmarks[] = {
+        { "setup",   bench_setup },
+        { "rtt",     bench_rtt },
+        { "thruput", bench_thruput },
+        { "scale",   bench_scale },
+};
+
+#define BENCH_CNT (int)(sizeof(benchmarks) / sizeof(*benchmarks))
+
+
+static void usage (const char *argv0) {
+        int i;
+
+        fprintf(stderr,
+                "Usage: %s [-q] [-o file] [-c conf] [-w workers] "
+                "[benchmark..]\n"
+                "Benchmarks:", argv0);
+        for (i = 0 ; i < BENCH_CNT ; i++)
+                fprintf(stderr, " %s", benchmarks[i].name);
+        fprintf(stderr, "\n");
+        exit(1);
+}
+
+
+int main (int argc, char **argv) {
+        int workers = 4;
+        int opt;
+        int i;
+
+        out = stdout;
+
+        while ((opt = getopt(argc, argv, "qo:c:w:")) != -1) {
+                switch (opt)
+                {
+                case 'q':
+                        quick = 1;
+                        break;
+                case 'o':
+                        if (!(out = fopen(optarg, "w"))) {
+                                perror(optarg);
+                                return 1;
+                        }
+                        break;
+                case 'c':
+                        conf = optarg;
+                        break;
+                case 'w':
+                        workers = atoi(optarg);
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+
+        if (sockem_set(NULL, "workers", workers, NULL) == -1)
+                usage(argv[0]);
+
+        server_start();
+
+        for (i = 0 ; i < BENCH_CNT ; i++) {
+                int j, run = optind == argc;
+
+                for (j = optind ; !run && j < argc ; j++)
+                        run = !strcmp(argv[j], benchmarks[i].name);
+                if (!run)
+                        continue;
+
+                fprintf(stderr, "%% Running %s benchmark\n",
+                        benchmarks[i].name);
+                benchmarks[i].run();
+                fflush(out);
+        }
+
+        if (out != stdout)
+                fclose(out);
+
+        return failed ? 1 : 0;
+}
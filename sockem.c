@@ -28,15 +28,39 @@
 
 #define _GNU_SOURCE /* for strdupa() and RTLD_NEXT */
 #include <errno.h>
+#include <ctype.h>
+#include <sched.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <limits.h>
+#include <math.h>
+#include <inttypes.h>
 #include <poll.h>
 #include <assert.h>
+#include <signal.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#ifdef WITH_IO_URING
+#include <linux/io_uring.h>
+#endif
+#ifdef WITH_SDT
+#include <sys/sdt.h>
+#endif
 
 #include "sockem.h"
 
@@ -66,19 +90,69 @@ typedef pthread_mutex_t mtx_t;
 #define mtx_lock(M) pthread_mutex_lock(M)
 #define mtx_unlock(M) pthread_mutex_unlock(M)
 
+typedef pthread_cond_t cnd_t;
+#define cnd_init(C) pthread_cond_init(C, NULL)
+#define cnd_destroy(C) pthread_cond_destroy(C)
+#define cnd_wait(C,M) pthread_cond_wait(C, M)
+#define cnd_broadcast(C) pthread_cond_broadcast(C)
+
 typedef pthread_t thrd_t;
 #define thrd_create(THRD,START_ROUTINE,ARG) \
   pthread_create(THRD, NULL, START_ROUTINE, ARG)
 #define thrd_join(THRD,RETVAL) \
   pthread_join(THRD, NULL)
 
+#define SOCKEM_MIN(A,B) ((A) < (B) ? (A) : (B))
+#define SOCKEM_MAX(A,B) ((A) > (B) ? (A) : (B))
+
+/* Statistics counters have a single writer, the forwarder worker,
+ * and are read lock-free by sockem_stats(). */
+#define SOCKEM_STAT_ADD(V,N) \
+        __atomic_store_n(&(V), (V) + (uint64_t)(N), __ATOMIC_RELAXED)
+#define SOCKEM_STAT_GET(V) __atomic_load_n(&(V), __ATOMIC_RELAXED)
+
 
 #ifdef LIBSOCKEM_PRELOAD
 static mtx_t sockem_lock;
 #endif
 
+/**
+ * Application socket -> sockem table for sockem_find().
+ *
+ * Two-level so that sparse high fds do not need a huge flat array:
+ * pages are allocated on first use and never freed, which allows
+ * lookups without locking. Entries are only changed by sockem_connect()
+ * and sockem_close(). Sockems with fds beyond the table are kept on the
+ * sockems list.
+ */
+#define SOCKEM_FDTAB_PAGESZ 1024
+#define SOCKEM_FDTAB_PAGES  4096   /* 4M fds */
+struct sockem_fdent {
+        sockem_t *skm;
+        int       pins;   /* sockem_inproc_get() lookups in progress,
+                           * see sockem_close() */
+};
+static struct sockem_fdent *sockem_fdtab[SOCKEM_FDTAB_PAGES];
+
 static LIST_HEAD(, sockem_s) sockems;
 
+#ifdef LIBSOCKEM_PRELOAD
+/**
+ * Membership bitmap of the application sockets in sockem_fdtab, letting
+ * the close() overload pass through unmanaged fds without taking
+ * sockem_lock. Fds beyond the bitmap always take the slow path.
+ */
+#define SOCKEM_FDMAP_BITS (SOCKEM_FDTAB_PAGES * SOCKEM_FDTAB_PAGESZ)
+static unsigned long sockem_fdmap[SOCKEM_FDMAP_BITS / (8*sizeof(long))];
+
+/**
+ * Like sockem_fdmap, for the application sockets of in-process sockems,
+ * letting the send() overloads pass through all other fds.
+ * In-process sockems are limited to fds within the bitmap.
+ */
+static unsigned long sockem_inmap[SOCKEM_FDMAP_BITS / (8*sizeof(long))];
+#endif
+
 
 typedef int64_t sockem_ts_t;
 
@@ -86,65 +160,767 @@ typedef int64_t sockem_ts_t;
 static pthread_once_t sockem_once = PTHREAD_ONCE_INIT;
 static int (*sockem_orig_connect) (int, const struct sockaddr *, socklen_t);
 static int (*sockem_orig_close) (int);
-static char *sockem_conf_str = "";
+static int (*sockem_orig_accept4) (int, struct sockaddr *, socklen_t *, int);
+static int (*sockem_orig_shutdown) (int, int);
+static ssize_t (*sockem_orig_send) (int, const void *, size_t, int);
+static ssize_t (*sockem_orig_sendto) (int, const void *, size_t, int,
+                                      const struct sockaddr *, socklen_t);
+static ssize_t (*sockem_orig_sendmsg) (int, const struct msghdr *, int);
+static ssize_t (*sockem_orig_writev) (int, const struct iovec *, int);
+static ssize_t (*sockem_orig_sendfile) (int, int, off_t *, size_t);
+static ssize_t (*sockem_orig_write) (int, const void *, size_t);
+static int sockem_conf_invalid;  /* SOCKEM_CONF failed to parse */
+static FILE *sockem_stats_fp;    /* SOCKEM_STATS output */
+static int sockem_stats_intvl;   /* SOCKEM_STATS interval in ms */
 #endif
 
 
 #ifdef LIBSOCKEM_PRELOAD
 #define sockem_close0(S)        (sockem_orig_close(S))
 #define sockem_connect0(S,A,AL) (sockem_orig_connect(S,A,AL))
+#define sockem_accept0(S,A,AL,F) (sockem_orig_accept4(S,A,AL,F))
+#define sockem_shutdown0(S,H)   (sockem_orig_shutdown(S,H))
 #else
 #define sockem_close0(S)        close(S)
 #define sockem_connect0(S,A,AL) connect(S,A,AL)
+#define sockem_accept0(S,A,AL,F) accept4(S,A,AL,F)
+#define sockem_shutdown0(S,H)   shutdown(S,H)
 #endif
 
 
+struct sockem_trace;
+struct sockem_link;
+
+#define SOCKEM_STAGE_MAX 16  /* impairment stages, incl. built-in ones */
+
 struct sockem_conf {
-        /* FIXME: these needs to be implemented */
-        int tx_thruput;  /* app->peer bytes/second */
-        int rx_thruput;  /* peer->app bytes/second */
+        int tx_thruput;  /* app->peer bytes/second, 0 = unlimited */
+        int rx_thruput;  /* peer->app bytes/second, 0 = unlimited */
+        int tx_burst;    /* app->peer token bucket size, 0 = auto */
+        int rx_burst;    /* peer->app token bucket size, 0 = auto */
         int delay;       /* latency in ms */
         int jitter;      /* latency variation in ms */
+        int jitter_dist; /* sockem_dist_t */
+        int seed;        /* jitter PRNG seed, 0 = random */
+        int loss;        /* datagram loss probability in per mille */
+        int reorder;     /* per mille of datagrams sent without delay */
+        int segsz;       /* emulated segment size in bytes, 0 = off */
         int debug;       /* enable sockem printf debugging */
         size_t bufsz;    /* recv chunk/buffer size */
+        size_t qmax;     /* delay line capacity in bytes, per direction */
+        int splice;      /* use zero-copy splice() when not shaping */
+        int socketpair;  /* connect app socket through a socketpair()
+                          * rather than loopback TCP */
+        int accept;      /* preload: wrap accepted sockets */
+        int udp;         /* preload: proxy connected UDP sockets */
+        int inproc;      /* preload: shape TCP sends in-process */
+        const struct sockem_trace *trace; /* replayed link trace,
+                                           * overrides delay and
+                                           * thruputs */
+        struct sockem_link *link;  /* shared bottleneck link group */
+        int stage[SOCKEM_STAGE_MAX]; /* impairment stage key values,
+                                      * by sockem_stagetab index,
+                                      * 0 = off */
+};
+
+
+/**
+ * Config template copied by new sockems, set with sockem_set(NULL, ..)
+ * and, in preload mode, SOCKEM_CONF.
+ */
+static mtx_t sockem_defconf_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sockem_conf sockem_defconf = {
+        .bufsz = 1024*1024,
+        .qmax = 16*1024*1024,
+        .splice = 1,
+};
+
+
+/**
+ * Forwarding directions, also used as index of the direction's
+ * input socket in the forwarder.
+ */
+#define SOCKEM_TX 0  /* app->peer: cs -> ps */
+#define SOCKEM_RX 1  /* peer->app: ps -> cs */
+
+
+/**
+ * Chunk of forwarded data held on a direction's delay line until due.
+ */
+struct sockem_chunk {
+        TAILQ_ENTRY(sockem_chunk) link;
+        sockem_ts_t due;   /* release time, sockem_clock() based */
+        sockem_ts_t ts;    /* time read from the input socket */
+        size_t of;         /* bytes already sent */
+        size_t len;
+        int cls;           /* sockem_mem size class, -1 if malloc()ed */
+        int node;          /* sockem_mem free list node */
+        char data[];
+};
+
+
+/**
+ * Hierarchical timing wheel of a worker's release and connect deadlines,
+ * with microsecond resolution. Level N holds the timers whose due time
+ * first differs from the wheel time in the N:th 6-bit digit, in the
+ * slot of that digit. When the wheel time reaches a slot its timers
+ * move down a level, or expire from level 0, and a bitmap per level
+ * finds the next non-empty slot: adding, removing and expiring a timer
+ * are O(1) and idle time is skipped in one step per level.
+ */
+#define SOCKEM_WHEEL_BITS   6
+#define SOCKEM_WHEEL_SLOTS  (1 << SOCKEM_WHEEL_BITS)
+#define SOCKEM_WHEEL_LEVELS 5    /* 2^30 us, about 18 minutes */
+#define SOCKEM_WHEEL_FAR    SOCKEM_WHEEL_LEVELS       /* beyond the levels */
+#define SOCKEM_WHEEL_DUE    (SOCKEM_WHEEL_LEVELS + 1) /* expired */
+
+struct sockem_timer {
+        LIST_ENTRY(sockem_timer) link;
+        sockem_ts_t due;   /* sockem_clock() based */
+        int lvl;           /* wheel level, SOCKEM_WHEEL_FAR or
+                            * SOCKEM_WHEEL_DUE, -1 if not armed */
+        int slot;
+        enum {
+                SOCKEM_TMR_RELEASE,  /* .arg is a sockem_dir: release
+                                      * its delay line */
+                SOCKEM_TMR_CONNECT   /* .arg is a sockem_t: next peer
+                                      * connect step */
+        } kind;
+        void *arg;
+};
+
+LIST_HEAD(sockem_timer_list, sockem_timer);
+
+struct sockem_wheel {
+        sockem_ts_t now;   /* wheel time, earlier timers have expired */
+        uint64_t map[SOCKEM_WHEEL_LEVELS]; /* non-empty slots */
+        struct sockem_timer_list slots[SOCKEM_WHEEL_LEVELS]
+                                      [SOCKEM_WHEEL_SLOTS];
+        struct sockem_timer_list far;  /* due beyond the levels */
+        struct sockem_timer_list due;  /* expired, run by
+                                        * sockem_wrkr_timers() */
+};
+
+
+/**
+ * Log-linear (HDR-style) histogram of microsecond values up to 2^32 us,
+ * with 2^SOCKEM_HIST_SUB_BITS linear sub-buckets per power of two for
+ * about 6% precision in under 2 KB.
+ */
+#define SOCKEM_HIST_SUB_BITS 4
+#define SOCKEM_HIST_SUB      (1 << SOCKEM_HIST_SUB_BITS)
+#define SOCKEM_HIST_BUCKETS  ((32 - SOCKEM_HIST_SUB_BITS + 1) * SOCKEM_HIST_SUB)
+
+struct sockem_hist {
+        uint64_t cnt;
+        uint64_t sum;
+        uint64_t min;
+        uint64_t max;
+        uint32_t buckets[SOCKEM_HIST_BUCKETS];
+};
+
+/* Emulation accuracy histograms, per direction */
+enum {
+        SOCKEM_HIST_TARGET,   /* configured delay */
+        SOCKEM_HIST_ACHIEVED, /* read to last byte sent */
+        SOCKEM_HIST_LATE,     /* due to first byte sent, unthrottled only */
+        SOCKEM_HIST__CNT
+};
+
+
+/**
+ * Jitter distribution tables: the inverse CDFs of the normal distribution
+ * and of a pareto distribution with alpha 3, normalized to mean 0 and
+ * standard deviation 1, in SOCKEM_DIST_SCALE units.
+ * Sampling a jitter is a lookup at a random index.
+ */
+#define SOCKEM_DIST_BITS  12
+#define SOCKEM_DIST_SIZE  (1 << SOCKEM_DIST_BITS)
+#define SOCKEM_DIST_SCALE 8192
+
+static pthread_once_t sockem_dist_once = PTHREAD_ONCE_INIT;
+static int32_t sockem_dist_normal[SOCKEM_DIST_SIZE];
+static int32_t sockem_dist_pareto[SOCKEM_DIST_SIZE];
+
+static const char *sockem_dist_names[SOCKEM_DIST__CNT] = {
+        "uniform", "normal", "pareto", "paretonormal"
+};
+
+
+/**
+ * Link trace file format, see the trace key in sockem.h.
+ * Fields are in host byte order.
+ */
+#define SOCKEM_TRACE_MAGIC   "SOCKEMTR"
+#define SOCKEM_TRACE_VERSION 1
+
+struct sockem_trace_hdr {
+        char     magic[8];    /* SOCKEM_TRACE_MAGIC */
+        uint32_t version;     /* SOCKEM_TRACE_VERSION */
+        uint32_t cnt;         /* number of entries */
+        uint32_t duration;    /* ms after which the trace repeats,
+                               * 0 = hold the last entry */
+        uint32_t reserved;
+};
+
+struct sockem_trace_ent {
+        uint32_t ts;          /* ms since trace start, non-decreasing */
+        uint32_t delay;       /* ms */
+        uint32_t rx_thruput;  /* bytes/second, 0 = unlimited */
+        uint32_t tx_thruput;  /* bytes/second, 0 = unlimited */
+};
+
+/**
+ * Loaded trace, shared by all sockems replaying it.
+ * Traces are loaded once per path and stay mapped for the lifetime
+ * of the process so workers may use them without locking.
+ */
+struct sockem_trace {
+        LIST_ENTRY(sockem_trace) link;
+        char *path;
+        const struct sockem_trace_hdr *hdr;
+        const struct sockem_trace_ent *ents;
+        int64_t duration;     /* us, 0 = no repeat */
+};
+
+static struct {
+        mtx_t lock;
+        LIST_HEAD(, sockem_trace) traces;
+} sockem_traces = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+/**
+ * Link group: a bottleneck shared by the sockems joining it with
+ * the link key, such as a common uplink.
+ *
+ * Per direction the members share a token bucket and a queue limit.
+ * The bucket is kept as the GCRA theoretical arrival time of the next
+ * byte and updated with compare-and-swap, so members on different
+ * workers take from it without a lock.
+ *
+ * For fairness regardless of which worker serves them, each backlogged
+ * member is also limited by a local token bucket of an equal share of
+ * the link rate, holding at most SOCKEM_LINK_QUANTUM bytes, and
+ * members with input are limited to an equal share of the queue limit.
+ * Idle members' shares go to the others.
+ * Link groups are never destroyed.
+ */
+#define SOCKEM_LINK_QUANTUM (16*1024)
+
+struct sockem_link_dir {
+        int64_t tat;     /* theoretical arrival time in ns of sockem_clock()
+                          * based time, atomic */
+        int     rate;    /* bytes/second, 0 = unlimited, atomic */
+        size_t  qmax;    /* queue limit in bytes, 0 = unlimited, atomic */
+        size_t  qlen;    /* bytes on the members' delay lines, atomic */
+        int     members[2]; /* SOCKEM_LINK_BUSY and _WAIT members,
+                             * atomic */
+};
+
+/* Link group member states, see sockem_dir_link_mark() */
+#define SOCKEM_LINK_BUSY 0  /* delay line not empty */
+#define SOCKEM_LINK_WAIT 1  /* input paused on link group queue limit */
+
+struct sockem_link {
+        LIST_ENTRY(sockem_link) link;
+        char *name;
+        struct sockem_link_dir dir[2]; /* SOCKEM_TX and SOCKEM_RX */
+};
+
+static struct {
+        mtx_t lock;
+        LIST_HEAD(, sockem_link) links;
+} sockem_links = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+/**
+ * Forwarding buffer pool.
+ *
+ * Chunks are carved from slabs in a few size classes and recycled through
+ * per-class free lists shared by all workers, so idle connections hold no
+ * buffer memory. Slab memory is capped at mem.max bytes: a direction that
+ * cannot get a chunk stops reading its input socket until chunks are
+ * returned to the pool. Workers keep a few free chunks each, see
+ * struct sockem_mag.
+ */
+#define SOCKEM_SLAB_SIZE     (1024*1024)
+#define SOCKEM_CHUNK_CLASSES 3
+#define SOCKEM_CHUNK_MAX     (64*1024)  /* largest chunk, including header */
+#define SOCKEM_SEGSZ_MIN     64         /* smallest segsz key, but 0 */
+#define SOCKEM_STARVED_MS    10         /* retry interval for directions
+                                         * waiting for pool memory */
+#define SOCKEM_OUT_HWM       (1024*1024) /* input is paused while the
+                                          * output socket is full and
+                                          * this much is queued */
+#define SOCKEM_OUT_IOVS      64         /* chunks gathered per writev() */
+
+#define SOCKEM_MEM_NODES     8          /* NUMA nodes with own free lists */
+#define SOCKEM_MAG_SIZE      16         /* free chunks per class cached
+                                         * by each worker */
+
+static const size_t sockem_chunk_sizes[SOCKEM_CHUNK_CLASSES] = {
+        2*1024, 16*1024, SOCKEM_CHUNK_MAX
+};
+
+static struct {
+        mtx_t lock;
+        int inited;
+        /* Per NUMA node of the workers that carved the chunks */
+        TAILQ_HEAD(, sockem_chunk) free[SOCKEM_MEM_NODES]
+                                       [SOCKEM_CHUNK_CLASSES];
+        size_t size;     /* allocated slab bytes */
+        size_t max;      /* slab memory cap, 0 = unlimited */
+} sockem_mem = { .lock = PTHREAD_MUTEX_INITIALIZER,
+                 .max = 256*1024*1024 };
+
+/**
+ * NUMA node of a worker pinned with the cpus key, selecting its
+ * sockem_mem free lists. 0 for all other threads.
+ */
+static __thread int sockem_mem_node;
+
+/**
+ * A worker's cache of free chunks from its node's sockem_mem free
+ * lists, refilled and returned in batches so that sockem_mem.lock is
+ * taken once per batch rather than per chunk. The cache is emptied
+ * before the worker waits for events, so that idle workers keep no
+ * chunks from the directions of others waiting for pool memory.
+ */
+struct sockem_mag {
+        struct sockem_chunk *chunks[SOCKEM_CHUNK_CLASSES][SOCKEM_MAG_SIZE];
+        int cnt[SOCKEM_CHUNK_CLASSES];
+};
+
+/**
+ * The calling worker's cache, NULL for all other threads.
+ */
+static __thread struct sockem_mag *sockem_mem_mag;
+
+
+#ifdef WITH_IO_URING
+#define SOCKEM_URING_ENTRIES 256          /* SQ size */
+#define SOCKEM_URING_SLOTS   64           /* registered read buffers,
+                                           * one per epoll event */
+#define SOCKEM_URING_SLOTSZ  (64*1024)    /* .. size of each */
+#define SOCKEM_URING_IOVS    SOCKEM_OUT_IOVS /* gathered sends per
+                                              * direction */
+#endif
+
+
+/**
+ * Token bucket for throughput shaping.
+ * Tokens are kept in byte-microseconds to retain sub-millisecond
+ * refill accuracy with integer arithmetic.
+ */
+struct sockem_tb {
+        int64_t tokens;    /* available bytes * 1000000 */
+        sockem_ts_t ts;    /* last refill */
+};
+
+
+/**
+ * Per-direction forwarder state.
+ * The direction's input socket is registered with the worker's epoll
+ * set with a pointer to this struct as event data.
+ */
+struct sockem_dir {
+        sockem_t *skm;
+        int idx;       /* SOCKEM_TX or SOCKEM_RX */
+        int ifd;       /* input socket */
+        int ofd;       /* output socket */
+        uint32_t events; /* current input interest on ifd */
+        uint32_t epev; /* registered epoll interest on ifd: .events
+                        * plus EPOLLOUT for the opposite direction */
+        int owait;     /* output socket is full, waiting for EPOLLOUT */
+        int eof;       /* input socket closed, tear down once drained */
+
+        TAILQ_HEAD(sockem_chunk_q, sockem_chunk) q; /* delay line */
+        size_t qlen;   /* bytes on delay line */
+        struct sockem_link *link; /* link group .qlen is accounted to and
+                                   * shaping with, follows the config
+                                   * when the delay line is empty */
+        struct sockem_tb ltb; /* fair share of the link group rate */
+        int lmark[2];  /* counted in .link's members[] */
+
+        struct sockem_tb tb; /* throughput shaper */
+
+        int pfd[2];    /* splice() pipe, created on first use */
+        int nosplice;  /* splice() not supported for these sockets */
+
+        struct sockem_timer tmr; /* delay line release, see
+                                  * sockem_dir_sched() */
+
+        /* Impairment stages enabled by the config, see
+         * sockem_dir_impair() */
+        int nstages;
+        int stages[SOCKEM_STAGE_MAX];  /* sockem_stagetab indexes */
+        int64_t (*impair) (struct sockem_dir *dir, char *buf, size_t len,
+                           sockem_ts_t now, int64_t delay); /* specialized
+                                                             * on .nstages */
+        void *stage_state[SOCKEM_STAGE_MAX]; /* by sockem_stagetab index,
+                                              * allocated when first
+                                              * enabled */
+
+        TAILQ_ENTRY(sockem_dir) slink; /* wrkr->starved link */
+        int starved;   /* on wrkr->starved, waiting for pool memory */
+
+        struct sockem_dir_stats st; /* .queued is not used, see .qlen */
+        sockem_ts_t thr_ts;  /* throttled since, 0 if not throttled */
+        struct sockem_hist *hist; /* [SOCKEM_HIST__CNT], allocated when
+                                   * the delay line is first used */
+
+#ifdef WITH_IO_URING
+        struct iovec uiov[SOCKEM_URING_IOVS]; /* output gathered for
+                                               * sockem_uring_flush() */
+        int    uiovcnt;
+        size_t ulen;   /* .. total bytes */
+        struct msghdr umsg;
+        TAILQ_ENTRY(sockem_dir) olink; /* uring->out link */
+#endif
+};
+
+
+#ifdef WITH_IO_URING
+/**
+ * Per-worker io_uring instance, driven by raw syscalls.
+ *
+ * Input sockets are still monitored with epoll, but the reads of a worker
+ * iteration are submitted as one batch of READ_FIXEDs into registered
+ * buffers and the iteration's output is gathered per direction and
+ * submitted as one batch of SENDMSGs by sockem_uring_flush().
+ */
+struct sockem_uring {
+        int fd;
+
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+        unsigned sq_entries;
+        unsigned sq_ltail;           /* local SQ tail, published on submit */
+        struct io_uring_sqe *sqes;
+
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_cqe *cqes;
+
+        unsigned inflight;           /* submitted but not reaped */
+
+        void  *sq_ring, *cq_ring;    /* mappings, for munmap() */
+        size_t sq_ringsz, cq_ringsz, sqes_sz;
+
+        char  *slots;                /* registered read buffers */
+        int    slot_cnt;             /* slots used since last flush */
+        struct sockem_dir *slot_dir[SOCKEM_URING_SLOTS];
+        int    slot_res[SOCKEM_URING_SLOTS];
+
+        TAILQ_HEAD(, sockem_dir) out; /* directions with gathered output */
+        struct sockem_chunk_q done;   /* sent chunks, freed after flush */
+};
+#endif
+
+
+#define SOCKEM_DGRAM_BATCH 32         /* datagrams per recvmmsg()/sendmmsg() */
+#define SOCKEM_DGRAM_MAX   (64*1024)  /* largest datagram forwarded */
+
+/**
+ * Per-worker datagram batches, allocated for the worker's first
+ * datagram sockem.
+ */
+struct sockem_dgram {
+        struct mmsghdr in[SOCKEM_DGRAM_BATCH];  /* recvmmsg() batch */
+        struct iovec   iiov[SOCKEM_DGRAM_BATCH];
+        char          *bufs;                    /* .. into BATCH slots
+                                                 * of MAX bytes */
+        struct mmsghdr out[SOCKEM_DGRAM_BATCH]; /* sendmmsg() batch */
+        struct iovec   oiov[SOCKEM_DGRAM_BATCH];
+        struct sockem_chunk *ochunk[SOCKEM_DGRAM_BATCH]; /* .. delay line
+                                                          * chunks, freed
+                                                          * once sent */
+        int            ocnt;
+};
+
+
+/**
+ * Event trace file format, see the events key in sockem.h: a header
+ * followed by struct sockem_event records, in host byte order.
+ */
+#define SOCKEM_EVENTS_MAGIC   "SOCKEMEV"
+#define SOCKEM_EVENTS_VERSION 1
+
+struct sockem_events_hdr {
+        char     magic[8];    /* SOCKEM_EVENTS_MAGIC */
+        uint32_t version;     /* SOCKEM_EVENTS_VERSION */
+        uint32_t evsize;      /* sizeof(struct sockem_event) */
+};
+
+#define SOCKEM_EV_RING     8192 /* events per worker ring, power of 2 */
+#define SOCKEM_EV_DRAIN_MS 10   /* event rings drain interval */
+
+/**
+ * Per-worker event ring: single producer, the worker, and single
+ * consumer, sockem_events_drain(). Events are dropped while full.
+ */
+struct sockem_evring {
+        uint64_t head;     /* next event to write, atomic */
+        uint64_t tail;     /* next event to drain, atomic */
+        uint64_t lost;     /* events dropped on a full ring, atomic */
+        uint64_t lost_seen; /* .lost written to the file, local to the
+                             * consumer */
+        int pinned;        /* being drained, the following are
+                            * protected by sockem_gstats.lock */
+        int orphan;        /* dropped while pinned, freed by the drainer */
+        struct sockem_evring *next; /* pinned rings being drained */
+        struct sockem_event ev[SOCKEM_EV_RING];
+};
+
+
+/**
+ * Forwarder worker thread running an epoll loop over its sockems.
+ *
+ * With the default `workers=0` each sockem gets a dedicated worker,
+ * otherwise sockems are spread over a fixed pool of shared workers.
+ */
+struct sockem_wrkr {
+        thrd_t thrd;
+        int    epfd;       /* epoll set of sockem sockets */
+        int    wakefd;     /* eventfd for waking up the worker */
+        int    dedicated;  /* serves a single sockem, exits with it */
+        cpu_set_t cpus;    /* CPU affinity, see the cpus key */
+        int    pinned;     /* .cpus is set */
+
+        mtx_t  lock;       /* protects .pending and .cnt */
+        TAILQ_HEAD(, sockem_s) pending; /* sockems awaiting attach or
+                                         * detach by the worker. */
+        int    cnt;        /* number of sockems assigned to worker */
+
+        /* Local to worker thread */
+        LIST_HEAD(, sockem_s) sockems;  /* attached sockems */
+        struct sockem_wheel wheel; /* release and connect timers */
+        int    tfd;        /* timerfd for the wheel's next step, -1 to
+                            * use the epoll_wait() timeout instead */
+        sockem_ts_t tfd_due; /* .tfd expiry, 0 if not armed */
+        TAILQ_HEAD(, sockem_dir) starved; /* directions with input paused
+                                           * on pool memory */
+        char  *buf;        /* receive buffer for unshaped forwarding */
+        struct sockem_mag mag; /* free chunk cache, see sockem_mem_mag */
+        struct sockem_dgram *dgram; /* datagram batches, NULL until
+                                     * first used */
+
+        struct sockem_dir_stats st[2]; /* totals of all served sockems,
+                                        * per direction */
+        uint64_t closed;   /* sockems torn down on EOF or error */
+        struct sockem_hist *hist[2]; /* totals of all served sockems,
+                                      * see sockem_dir.hist */
+        LIST_ENTRY(sockem_wrkr) glink; /* sockem_gstats.wrkrs link */
+        LIST_HEAD(, sockem_s) dying;    /* sockems to detach, see
+                                         * sockem_term() */
+        LIST_HEAD(, sockem_s) dead;     /* detached sockems to hand back
+                                         * to sockem_close() */
+        int    term;       /* exit worker thread */
+#ifdef WITH_IO_URING
+        struct sockem_uring *uring; /* io_uring backend, NULL for plain
+                                     * recv()/send() */
+#endif
+        struct sockem_evring *ev;   /* event ring while the events key
+                                     * is set, written by the worker,
+                                     * read under sockem_gstats.lock */
 };
 
 
+/**
+ * Global forwarder worker pool.
+ */
+static struct {
+        mtx_t lock;
+        int workers;                /* configured pool size,
+                                     * 0 = dedicated worker per sockem */
+        int io_uring;               /* use io_uring backend if available,
+                                     * atomic */
+        struct sockem_wrkr **wrkrs; /* pool workers, started on first use */
+        int wrkr_cnt;
+        int next;                   /* first worker to consider on
+                                     * assignment, for spreading ties */
+        cpu_set_t cpus;             /* cpus key: forwarder CPUs */
+        int cpu_cnt;                /* .. CPU count, 0 = unset */
+} sockem_pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .io_uring = 1 };
+
+
+/**
+ * Process-wide statistics: the live workers' totals plus
+ * the totals of destroyed workers.
+ */
+static struct {
+        mtx_t lock;
+        LIST_HEAD(, sockem_wrkr) wrkrs; /* all live workers */
+        struct sockem_stats retired;    /* destroyed workers' totals */
+        struct sockem_hist *retired_hist[2]; /* .. histograms */
+        uint64_t connects;              /* atomic */
+        uint64_t forced;                /* atomic */
+} sockem_gstats = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+/**
+ * Event tracing, see the events key.
+ */
+static struct {
+        mtx_t lock;        /* protects the following and serializes
+                            * draining, taken before sockem_gstats.lock */
+        int   fd;          /* events file, -1 if not tracing */
+        int   on;          /* .fd is set: workers record events, atomic */
+        int   running;     /* drain thread started */
+        int   atexit;      /* sockem_events_flush() registered */
+} sockem_events = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+
+/**
+ * Traffic capture of the pcap key: the forwarded data as synthesized
+ * TCP/IP, or UDP/IP, packets in a memory-mapped pcap file.
+ *
+ * Workers append records by reserving space at .off with
+ * compare-and-swap and copying them to the mapping, never calling into
+ * the file system. The flush thread grows the file ahead of them and
+ * starts writeback of what was written. Records that do not fit the
+ * file, when the flush thread falls behind, are dropped.
+ */
+#define SOCKEM_PCAP_VMAX      (sizeof(size_t) > 4 ? (size_t)64 << 30 \
+                                                  : (size_t)1 << 30)
+                                     /* file mapping size, capture stops
+                                      * when it is full */
+#define SOCKEM_PCAP_GROW      (64*1024*1024) /* file headroom */
+#define SOCKEM_PCAP_FLUSH_MS  10     /* flush thread interval */
+#define SOCKEM_PCAP_SNAPLEN   65535  /* default pcap.snaplen */
+#define SOCKEM_PCAP_LINKTYPE  101    /* LINKTYPE_RAW: IPv4 or IPv6 */
+
+static struct {
+        mtx_t lock;        /* protects .fd and the following, written
+                            * while not .on */
+        int   fd;          /* pcap file, -1 if not capturing */
+        char *map;         /* SOCKEM_PCAP_VMAX bytes mapping of .fd */
+        size_t synced;     /* writeback started up to, flush thread */
+        unsigned int gen;  /* bumped for each file, see sockem.pcap */
+        int   snap;        /* snap length of the file */
+        int64_t t0;        /* wall clock time at sockem_clock() 0, us */
+        int   running;     /* flush thread started */
+        int   atexit;      /* sockem_pcap_stop() registered */
+        uint64_t dropped;  /* records that did not fit, atomic */
+
+        size_t off;        /* bytes written to .map, atomic */
+        size_t size;       /* file size, atomic */
+        int   on;          /* capturing to .map, atomic */
+        int   writers;     /* workers appending to .map, atomic */
+        int   snaplen;     /* pcap.snaplen key, 0 = default, atomic */
+} sockem_pcap = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
 
 
 struct sockem_s {
         LIST_ENTRY(sockem_s) link;
 
         enum {
-                /* Forwarder thread run states */
+                /* Forwarder run states */
                 SOCKEM_INIT,
                 SOCKEM_START,
                 SOCKEM_RUN,
-                SOCKEM_TERM
+                SOCKEM_TERM,
+                SOCKEM_DONE    /* Forwarder has released the sockem */
         } run;
 
         int as;        /* application's socket. */
         int ls;        /* internal application listen socket */
+        int cs;        /* internal socket accepted from ls */
         int ps;        /* internal peer socket connecting sockem to the peer.*/
+        int dgram;     /* SOCK_DGRAM: forward datagrams, see
+                        * sockem_dgram_fwd() */
 
-        void *buf;     /* Receive buffer */
-        size_t bufsz;  /* .. size */
+        int linked;    /* In sockem_fdtab or on sockems list */
 
-        int linked;    /* On sockems list */
+        struct sockem_dir dir[2]; /* SOCKEM_TX and SOCKEM_RX directions */
 
-        thrd_t thrd;   /* Forwarder thread */
+        struct sockem_wrkr *wrkr; /* Forwarder worker */
+        LIST_ENTRY(sockem_s) wlink;    /* wrkr->sockems or ->dead link */
+        int attached;  /* Seen by the worker, local to worker */
+        TAILQ_ENTRY(sockem_s) plink;   /* wrkr->pending link */
+        int pending;   /* On wrkr->pending, protected by wrkr->lock */
+        LIST_ENTRY(sockem_s) dlink;    /* wrkr->dying link */
+        int dying;     /* On wrkr->dying, local to worker */
 
         mtx_t  lock;
+        cnd_t  cnd;    /* signalled on SOCKEM_DONE and on peer
+                        * connect completion */
 
         struct sockem_conf conf;  /* application-set config.
                                    * protected by .lock */
 
+        unsigned int conf_gen;    /* bumped on each .conf change,
+                                   * written under .lock */
+
         struct sockem_conf use;   /* last copy of .conf
                                    * local to skm thread */
+        unsigned int use_gen;     /* .conf_gen of .use */
+
+        uint64_t rnd;  /* jitter PRNG state, local to worker */
+
+        /* Trace replay state, local to worker */
+        const struct sockem_trace *trace; /* trace being replayed */
+        uint32_t trace_pos;    /* current entry */
+        sockem_ts_t trace_t0;  /* start of current replay round */
+        sockem_ts_t trace_next; /* next entry due, 0 = re-apply */
+
+        /* Emulated peer connect handshake, local to worker */
+        enum {
+                SOCKEM_CONN_NONE,  /* Connected, or not a TCP connect */
+                SOCKEM_CONN_SYN,   /* SYN on its way: connect() when
+                                    * .ctmr expires */
+                SOCKEM_CONN_WAIT,  /* connect() in progress */
+                SOCKEM_CONN_ACK    /* Peer answered: connected, or failed
+                                    * with .conn_fail, when .ctmr
+                                    * expires */
+        } conn;
+        struct sockem_timer ctmr;      /* next connect step */
+        int conn_fail;                 /* peer's connect errno */
+        struct sockaddr_in6 paddr;     /* peer address */
+        socklen_t paddrlen;
+        int conn_err;  /* peer connect result: -1 while in progress,
+                        * else 0 or errno. Written under .lock */
+
+        /* In-process shaping, see the inproc key. The application
+         * socket is connected to the peer and .ps is a dup() of it. */
+        int inproc;
+        struct sockem_chunk_q inq; /* sent by the application, not yet
+                                    * on the delay line. Protected
+                                    * by .lock, as are the following */
+        size_t inqlen; /* bytes on .inq */
+        int ineof;     /* application shut down its sending side */
+        int insenders; /* send() overloads using the sockem, atomic */
+        int inwait;    /* .. of which waiting for delay line room, atomic */
+        int infull;    /* a non-blocking send was refused, atomic */
+
+        /* Synthesized flow of the pcap key, local to worker */
+        struct {
+                unsigned int gen;    /* sockem_pcap.gen written for,
+                                      * 0 = none */
+                int      v6;         /* IPv6 rather than IPv4 */
+                uint8_t  addr[2][16]; /* SOCKEM_TX (local) and SOCKEM_RX
+                                       * (peer) address */
+                uint8_t  port[2][2];  /* .. and port, network order */
+                uint32_t seq[2];      /* next sequence number, per
+                                       * direction */
+        } pcap;
+
+        int closed;    /* torn down by the forwarder on EOF or error */
+        int forced;    /* closed by sockem_close() with data pending */
 };
 
 
 static int sockem_vset (sockem_t *skm, va_list ap);
+static int sockem_attach_dirs (struct sockem_wrkr *wrkr, sockem_t *skm);
+static int sockem_inproc_attach (struct sockem_wrkr *wrkr, sockem_t *skm);
+static void sockem_conn_arm (struct sockem_wrkr *wrkr, sockem_t *skm,
+                             int64_t delay);
+static void sockem_term (struct sockem_wrkr *wrkr, sockem_t *skm);
+static void sockem_dir_stat_fwd (struct sockem_dir *dir, size_t len);
+static void sockem_dir_owait (struct sockem_dir *dir, int on);
+static int sockem_dir_unsent (struct sockem_dir *dir, const char *buf,
+                              size_t len, struct sockem_chunk **afterp);
+static void sockem_events_drain (struct sockem_wrkr *wrkr);
+static void sockem_evring_free (struct sockem_evring *ring);
 
 
 /**
@@ -168,458 +944,7583 @@ static __attribute__((unused)) __inline int64_t sockem_clock (void) {
 
 
 /**
- * @returns the maximum waittime in ms for poll()
- * @remark lock must be held
+ * @brief Append an event of \p type on \p dir to worker event ring
+ *        \p ring, see SOCKEM_EV().
  */
-static int sockem_calc_waittime (sockem_t *skm) {
-        if (skm->use.delay + skm->use.jitter == 0)
-                return 1000;
-        else
-                return skm->use.jitter < skm->use.delay ?
-                        skm->use.jitter : skm->use.delay;
+static void sockem_ev_put (struct sockem_evring *ring, int type,
+                           const struct sockem_dir *dir, uint64_t len,
+                           int64_t arg) {
+        uint64_t head = ring->head;
+        struct sockem_event *ev;
+
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+            SOCKEM_EV_RING) {
+                SOCKEM_STAT_ADD(ring->lost, 1);
+                return;
+        }
+
+        ev = &ring->ev[head & (SOCKEM_EV_RING - 1)];
+        ev->ts = sockem_clock();
+        ev->fd = dir->skm->as;
+        ev->type = (uint8_t)type;
+        ev->dir = (uint8_t)dir->idx;
+        ev->reserved = 0;
+        ev->len = len;
+        ev->arg = arg;
+
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
 }
 
+#ifdef WITH_SDT
+#define SOCKEM_PROBE(NAME,FD,DIR,LEN,ARG) \
+        DTRACE_PROBE4(sockem, NAME, FD, DIR, LEN, ARG)
+#else
+#define SOCKEM_PROBE(NAME,FD,DIR,LEN,ARG) do { } while (0)
+#endif
 
 /**
- * @brief read from \p ifd, write to \p ofd in a blocking fashion.
- *
- * @returns the number of bytes forwarded, or -1 on error.
+ * Trace event SOCKEM_EV_<TYPE> on direction \p DIR: fire USDT probe
+ * sockem:<NAME>(fd, dir, len, arg) and record it on the worker's event
+ * ring, if any. Costs a load and a predicted branch when not tracing.
  */
-static int sockem_recv_fwd (sockem_t *skm, int ifd, int ofd) {
-        ssize_t r, wr;
-        int64_t delay;
+#define SOCKEM_EV(TYPE,NAME,DIR,LEN,ARG) do {                            \
+                const struct sockem_dir *_d = (DIR);                    \
+                struct sockem_evring *_ring = _d->skm->wrkr->ev;        \
+                SOCKEM_PROBE(NAME, _d->skm->as, _d->idx,                \
+                             (uint64_t)(LEN), (int64_t)(ARG));          \
+                if (__builtin_expect(_ring != NULL, 0))                 \
+                        sockem_ev_put(_ring, SOCKEM_EV_ ## TYPE, _d,    \
+                                      (uint64_t)(LEN), (int64_t)(ARG)); \
+        } while (0)
 
-        r = recv(ifd, skm->buf, skm->bufsz, MSG_DONTWAIT);
-        if (r == -1) {
-                int serr = socket_errno();
-                if (serr == EAGAIN || serr == EWOULDBLOCK)
-                        return 0;
-                return -1;
 
-        } else if (r == 0) {
-                /* Socket closed */
-                return -1;
-        }
+#define SOCKEM_TCP_FIN 0x01
+#define SOCKEM_TCP_SYN 0x02
+#define SOCKEM_TCP_PSH 0x08
+#define SOCKEM_TCP_ACK 0x10
 
-        /* FIXME: proper */
-        delay = skm->use.delay + (skm->use.jitter / 2);
-        if (delay)
-                usleep(delay * 1000);
+/**
+ * @returns true while capturing with the pcap key.
+ */
+static __inline int sockem_pcap_on (void) {
+        return __builtin_expect(__atomic_load_n(&sockem_pcap.on,
+                                                __ATOMIC_RELAXED), 0);
+}
 
-        wr = send(ofd, skm->buf, r, 0);
-        if (wr < r)
-                return -1;
 
-        return wr;
+static void sockem_pcap_put16 (uint8_t *p, uint16_t v) {
+        v = htons(v);
+        memcpy(p, &v, 2);
+}
+
+static void sockem_pcap_put32 (uint8_t *p, uint32_t v) {
+        v = htonl(v);
+        memcpy(p, &v, 4);
 }
 
 
 /**
- * @brief Close all sockets and unsets ->run.
- * @remark Preserves caller's errno.
- * @remark lock must be held.
+ * @brief Set up \p skm's synthesized flow from the addresses of its
+ *        peer socket, which is connected to the peer.
  */
-static void sockem_close_all (sockem_t *skm) {
-        int serr = socket_errno();
+static void sockem_pcap_flow (sockem_t *skm) {
+        struct sockaddr_in6 sa[2];
+        socklen_t len;
+        int i;
 
-        if (skm->ls != -1) {
-                sockem_close0(skm->ls);
-                skm->ls = -1;
-        }
+        memset(sa, 0, sizeof(sa));
+        len = sizeof(sa[SOCKEM_TX]);
+        getsockname(skm->ps, (struct sockaddr *)&sa[SOCKEM_TX], &len);
+        len = sizeof(sa[SOCKEM_RX]);
+        getpeername(skm->ps, (struct sockaddr *)&sa[SOCKEM_RX], &len);
 
-        if (skm->ps != -1) {
-                sockem_close0(skm->ps);
-                skm->ps = -1;
-        }
+        skm->pcap.v6 = sa[SOCKEM_RX].sin6_family == AF_INET6 &&
+                !IN6_IS_ADDR_V4MAPPED(&sa[SOCKEM_RX].sin6_addr);
 
-        skm->run = SOCKEM_TERM;
+        memset(skm->pcap.addr, 0, sizeof(skm->pcap.addr));
+        for (i = 0 ; i < 2 ; i++) {
+                if (sa[i].sin6_family == AF_INET6) {
+                        const uint8_t *a = sa[i].sin6_addr.s6_addr;
 
-        errno = serr;
-}
+                        if (skm->pcap.v6)
+                                memcpy(skm->pcap.addr[i], a, 16);
+                        else
+                                memcpy(skm->pcap.addr[i], a + 12, 4);
+                } else if (sa[i].sin6_family == AF_INET) {
+                        const struct sockaddr_in *sin =
+                                (const struct sockaddr_in *)&sa[i];
+
+                        memcpy(skm->pcap.addr[i], &sin->sin_addr, 4);
+                }
+                /* sin_port and sin6_port are at the same offset */
+                memcpy(skm->pcap.port[i], &sa[i].sin6_port, 2);
+        }
 
+        skm->pcap.seq[SOCKEM_TX] = skm->pcap.seq[SOCKEM_RX] = 0;
+}
 
 
 /**
- * @brief sockem internal per-socket forwarder thread
+ * @brief Append a record of the packet sent on \p skm's direction \p dir
+ *        at \p now: TCP with \p flags, or UDP for datagram sockems,
+ *        carrying the \p len bytes at \p buf, cut to the snap length.
+ *
+ * @remark Must be called between sockem_pcap_enter() and _leave().
  */
-static void *sockem_run (void *arg) {
-        sockem_t *skm = arg;
-        int waittime;
-        int cs = -1;
-        int ls;
-        struct pollfd pfd[2];
+static void sockem_pcap_pkt (sockem_t *skm, int dir, int flags,
+                             const char *buf, size_t len, sockem_ts_t now) {
+        uint8_t hdr[16 + 40 + 20];  /* pcap record, IP and TCP headers */
+        uint8_t *ip = hdr + 16, *l4;
+        size_t iphl = skm->pcap.v6 ? 40 : 20;
+        size_t l4hl = skm->dgram ? 8 : 20;
+        size_t hl = iphl + l4hl;
+        size_t caplen = SOCKEM_MIN(hl + len, (size_t)sockem_pcap.snap);
+        size_t size = 16 + caplen;
+        int64_t ts = now + sockem_pcap.t0;
+        uint32_t v;
+        size_t off;
 
-        mtx_lock(&skm->lock);
-        if (skm->run == SOCKEM_START)
-                skm->run = SOCKEM_RUN;
-        skm->use = skm->conf;
-        ls = skm->ls;
-        mtx_unlock(&skm->lock);
+        off = __atomic_load_n(&sockem_pcap.off, __ATOMIC_RELAXED);
+        do {
+                if (off + size >
+                    __atomic_load_n(&sockem_pcap.size, __ATOMIC_ACQUIRE)) {
+                        __atomic_add_fetch(&sockem_pcap.dropped, 1,
+                                           __ATOMIC_RELAXED);
+                        return;
+                }
+        } while (!__atomic_compare_exchange_n(&sockem_pcap.off, &off,
+                                              off + size, 1,
+                                              __ATOMIC_RELAXED,
+                                              __ATOMIC_RELAXED));
 
-        skm->bufsz = skm->use.bufsz;
-        skm->buf = malloc(skm->bufsz);
+        /* Record header, in host byte order */
+        v = (uint32_t)(ts / 1000000);
+        memcpy(hdr, &v, 4);
+        v = (uint32_t)(ts % 1000000);
+        memcpy(hdr + 4, &v, 4);
+        v = (uint32_t)caplen;
+        memcpy(hdr + 8, &v, 4);
+        v = (uint32_t)(hl + len);
+        memcpy(hdr + 12, &v, 4);
 
-        /* Accept connection from sockfd in sockem_connect() */
-        cs = accept(ls, NULL, 0);
-        if (cs == -1) {
-                mtx_lock(&skm->lock);
-                if (skm->run == SOCKEM_TERM) {
-                        /* App socket was closed. */
-                        goto done;
-                }
-                fprintf(stderr, "%% sockem: accept(%d) failed: %s\n",
-                        ls, strerror(socket_errno()));
-                assert(cs != -1);
+        memset(ip, 0, hl);
+        if (skm->pcap.v6) {
+                ip[0] = 0x60;
+                sockem_pcap_put16(ip + 4, (uint16_t)(l4hl + len));
+                ip[6] = skm->dgram ? IPPROTO_UDP : IPPROTO_TCP;
+                ip[7] = 64;
+                memcpy(ip + 8, skm->pcap.addr[dir], 16);
+                memcpy(ip + 24, skm->pcap.addr[!dir], 16);
+        } else {
+                uint32_t sum = 0;
+                int i;
+
+                ip[0] = 0x45;
+                sockem_pcap_put16(ip + 2, (uint16_t)(hl + len));
+                sockem_pcap_put16(ip + 6, 0x4000); /* DF */
+                ip[8] = 64;
+                ip[9] = skm->dgram ? IPPROTO_UDP : IPPROTO_TCP;
+                memcpy(ip + 12, skm->pcap.addr[dir], 4);
+                memcpy(ip + 16, skm->pcap.addr[!dir], 4);
+                for (i = 0 ; i < 20 ; i += 2)
+                        sum += (uint32_t)(ip[i] << 8 | ip[i + 1]);
+                while (sum >> 16)
+                        sum = (sum & 0xffff) + (sum >> 16);
+                sockem_pcap_put16(ip + 10, (uint16_t)~sum);
         }
 
-        /* Set up poll (blocking IO) */
-        memset(pfd, 0, sizeof(pfd));
-        pfd[0].fd = cs;
-        pfd[0].events = POLLIN;
+        /* Transport checksums are left out */
+        l4 = ip + iphl;
+        memcpy(l4, skm->pcap.port[dir], 2);
+        memcpy(l4 + 2, skm->pcap.port[!dir], 2);
+        if (skm->dgram)
+                sockem_pcap_put16(l4 + 4, (uint16_t)(l4hl + len));
+        else {
+                sockem_pcap_put32(l4 + 4, skm->pcap.seq[dir]);
+                if (flags & SOCKEM_TCP_ACK)
+                        sockem_pcap_put32(l4 + 8, skm->pcap.seq[!dir]);
+                l4[12] = 5 << 4;
+                l4[13] = (uint8_t)flags;
+                sockem_pcap_put16(l4 + 14, 65535);
 
-        mtx_lock(&skm->lock);
-        pfd[1].fd = skm->ps;
-        mtx_unlock(&skm->lock);
-        pfd[1].events = POLLIN;
+                skm->pcap.seq[dir] += (uint32_t)len +
+                        !!(flags & (SOCKEM_TCP_SYN|SOCKEM_TCP_FIN));
+        }
 
-        waittime = sockem_calc_waittime(skm);
+        memcpy(sockem_pcap.map + off, hdr, SOCKEM_MIN(size, 16 + hl));
+        if (size > 16 + hl)
+                memcpy(sockem_pcap.map + off + 16 + hl, buf, size - 16 - hl);
+}
 
-        mtx_lock(&skm->lock);
-        while (skm->run == SOCKEM_RUN) {
-                int r;
-                int i;
 
+/**
+ * @brief Start appending to the pcap file, with \p skm's flow set up,
+ *        and its handshake written, for the current file.
+ *
+ * @returns true if capturing, in which case sockem_pcap_leave() must
+ *          be called.
+ */
+static int sockem_pcap_enter (sockem_t *skm, sockem_ts_t now) {
+        /* Pairs with sockem_pcap_stop0(): either it waits for
+         * this writer or the writer sees capture stopped. */
+        __atomic_add_fetch(&sockem_pcap.writers, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&sockem_pcap.on, __ATOMIC_SEQ_CST)) {
+                __atomic_sub_fetch(&sockem_pcap.writers, 1,
+                                   __ATOMIC_RELEASE);
+                return 0;
+        }
+
+        if (skm->pcap.gen != sockem_pcap.gen) {
+                skm->pcap.gen = sockem_pcap.gen;
+                sockem_pcap_flow(skm);
+                if (!skm->dgram) {
+                        sockem_pcap_pkt(skm, SOCKEM_TX, SOCKEM_TCP_SYN,
+                                        NULL, 0, now);
+                        sockem_pcap_pkt(skm, SOCKEM_RX,
+                                        SOCKEM_TCP_SYN|SOCKEM_TCP_ACK,
+                                        NULL, 0, now);
+                        sockem_pcap_pkt(skm, SOCKEM_TX, SOCKEM_TCP_ACK,
+                                        NULL, 0, now);
+                }
+        }
+
+        return 1;
+}
+
+static void sockem_pcap_leave (void) {
+        __atomic_sub_fetch(&sockem_pcap.writers, 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * @brief Capture the \p len bytes at \p buf sent on \p dir's output
+ *        socket at \p now, see sockem_pcap_on().
+ */
+static void sockem_dir_pcap (struct sockem_dir *dir, const char *buf,
+                             size_t len, sockem_ts_t now) {
+        sockem_t *skm = dir->skm;
+        /* Keep within the 16-bit IP length fields */
+        size_t max = 65535 - 40 - 20;
+
+        if (!sockem_pcap_enter(skm, now))
+                return;
+
+        do {
+                size_t n = SOCKEM_MIN(len, max);
+
+                sockem_pcap_pkt(skm, dir->idx,
+                                skm->dgram ? 0 :
+                                SOCKEM_TCP_PSH|SOCKEM_TCP_ACK,
+                                buf, n, now);
+                buf += n;
+                len -= n;
+        } while (len > 0);
+
+        sockem_pcap_leave();
+}
+
+
+/**
+ * @brief Capture the close of \p skm's flow as a FIN exchange, if any
+ *        of its data was captured.
+ */
+static void sockem_pcap_fin (sockem_t *skm) {
+        sockem_ts_t now = sockem_clock();
+
+        if (skm->dgram || !skm->pcap.gen || !sockem_pcap_enter(skm, now))
+                return;
+
+        sockem_pcap_pkt(skm, SOCKEM_TX, SOCKEM_TCP_FIN|SOCKEM_TCP_ACK,
+                        NULL, 0, now);
+        sockem_pcap_pkt(skm, SOCKEM_RX, SOCKEM_TCP_FIN|SOCKEM_TCP_ACK,
+                        NULL, 0, now);
+        sockem_pcap_pkt(skm, SOCKEM_TX, SOCKEM_TCP_ACK, NULL, 0, now);
+
+        sockem_pcap_leave();
+}
+
+
+/**
+ * @brief Initialize timing wheel \p w at time \p now.
+ */
+static void sockem_wheel_init (struct sockem_wheel *w, sockem_ts_t now) {
+        int i, j;
+
+        memset(w, 0, sizeof(*w));
+        w->now = now;
+        for (i = 0 ; i < SOCKEM_WHEEL_LEVELS ; i++)
+                for (j = 0 ; j < SOCKEM_WHEEL_SLOTS ; j++)
+                        LIST_INIT(&w->slots[i][j]);
+        LIST_INIT(&w->far);
+        LIST_INIT(&w->due);
+}
+
+
+/**
+ * @brief Initialize unarmed timer \p tmr of \p kind for \p arg.
+ */
+static void sockem_timer_init (struct sockem_timer *tmr, int kind,
+                               void *arg) {
+        tmr->lvl = -1;
+        tmr->kind = kind;
+        tmr->arg = arg;
+}
+
+
+/**
+ * @brief Put \p tmr in the slot for time \p at, or on the expired list
+ *        if \p at is not after the wheel time.
+ */
+static void sockem_wheel_put (struct sockem_wheel *w,
+                              struct sockem_timer *tmr, sockem_ts_t at) {
+        int lvl;
+
+        if (at <= w->now) {
+                tmr->lvl = SOCKEM_WHEEL_DUE;
+                LIST_INSERT_HEAD(&w->due, tmr, link);
+                return;
+        }
+
+        /* Highest digit that differs from the wheel time */
+        lvl = (63 - __builtin_clzll((uint64_t)at ^ (uint64_t)w->now)) /
+                SOCKEM_WHEEL_BITS;
+        if (lvl >= SOCKEM_WHEEL_LEVELS) {
+                tmr->lvl = SOCKEM_WHEEL_FAR;
+                LIST_INSERT_HEAD(&w->far, tmr, link);
+                return;
+        }
+
+        tmr->lvl = lvl;
+        tmr->slot = (int)(((uint64_t)at >> (lvl * SOCKEM_WHEEL_BITS)) &
+                          (SOCKEM_WHEEL_SLOTS - 1));
+        LIST_INSERT_HEAD(&w->slots[lvl][tmr->slot], tmr, link);
+        w->map[lvl] |= (uint64_t)1 << tmr->slot;
+}
+
+
+/**
+ * @brief Disarm \p tmr, if armed.
+ */
+static void sockem_timer_stop (struct sockem_wheel *w,
+                               struct sockem_timer *tmr) {
+        if (tmr->lvl == -1)
+                return;
+
+        LIST_REMOVE(tmr, link);
+        if (tmr->lvl < SOCKEM_WHEEL_LEVELS &&
+            LIST_EMPTY(&w->slots[tmr->lvl][tmr->slot]))
+                w->map[tmr->lvl] &= ~((uint64_t)1 << tmr->slot);
+        tmr->lvl = -1;
+}
+
+
+/**
+ * @brief (Re)arm \p tmr to expire at \p due.
+ *
+ * A timer that is due already expires on the wheel's next step,
+ * so timers re-armed while expired timers run are not run again
+ * by the same sockem_wrkr_timers().
+ */
+static void sockem_timer_start (struct sockem_wheel *w,
+                                struct sockem_timer *tmr, sockem_ts_t due) {
+        sockem_timer_stop(w, tmr);
+        tmr->due = due;
+        sockem_wheel_put(w, tmr, SOCKEM_MAX(due, w->now + 1));
+}
+
+
+/**
+ * @returns the time of the wheel's next step, when its earliest
+ *          non-empty slot is reached, or -1 if the wheel is empty.
+ *          The slot is returned in \p *lvlp (SOCKEM_WHEEL_FAR for the
+ *          far list) and \p *slotp.
+ */
+static sockem_ts_t sockem_wheel_next (const struct sockem_wheel *w,
+                                      int *lvlp, int *slotp) {
+        int lvl;
+
+        /* Lower level slots are all reached before higher ones */
+        for (lvl = 0 ; lvl < SOCKEM_WHEEL_LEVELS ; lvl++) {
+                int shift = lvl * SOCKEM_WHEEL_BITS;
+                int digit = (int)(((uint64_t)w->now >> shift) &
+                                  (SOCKEM_WHEEL_SLOTS - 1));
+                uint64_t map = w->map[lvl] & (~(uint64_t)0 << digit);
+                uint64_t base;
+
+                if (!map)
+                        continue;
+
+                *lvlp = lvl;
+                *slotp = __builtin_ctzll(map);
+                base = ((uint64_t)w->now >> (shift + SOCKEM_WHEEL_BITS)) <<
+                        (shift + SOCKEM_WHEEL_BITS);
+                return (sockem_ts_t)(base | ((uint64_t)*slotp << shift));
+        }
+
+        if (LIST_EMPTY(&w->far))
+                return -1;
+
+        *lvlp = SOCKEM_WHEEL_FAR;
+        *slotp = 0;
+        return (sockem_ts_t)((((uint64_t)w->now >>
+                               (SOCKEM_WHEEL_LEVELS * SOCKEM_WHEEL_BITS)) + 1) <<
+                             (SOCKEM_WHEEL_LEVELS * SOCKEM_WHEEL_BITS));
+}
+
+
+/**
+ * @brief Advance the wheel to \p now, moving the timers due by then to the
+ *        expired list.
+ */
+static void sockem_wheel_expire (struct sockem_wheel *w, sockem_ts_t now) {
+        struct sockem_timer_list tmp;
+        struct sockem_timer *tmr;
+        sockem_ts_t t;
+        int lvl, slot;
+
+        while ((t = sockem_wheel_next(w, &lvl, &slot)) != -1 && t <= now) {
+                struct sockem_timer_list *list = lvl == SOCKEM_WHEEL_FAR ?
+                        &w->far : &w->slots[lvl][slot];
+
+                LIST_INIT(&tmp);
+                while ((tmr = LIST_FIRST(list))) {
+                        LIST_REMOVE(tmr, link);
+                        LIST_INSERT_HEAD(&tmp, tmr, link);
+                }
+                if (lvl < SOCKEM_WHEEL_LEVELS)
+                        w->map[lvl] &= ~((uint64_t)1 << slot);
+
+                /* Move them down, level 0 timers are due */
+                w->now = t;
+                while ((tmr = LIST_FIRST(&tmp))) {
+                        LIST_REMOVE(tmr, link);
+                        sockem_wheel_put(w, tmr, tmr->due);
+                }
+        }
+
+        if (now > w->now)
+                w->now = now;
+}
+
+
+/**
+ * @returns the standard normal quantile of \p p, 0 < p < 1,
+ *          by Acklam's rational approximation (relative error < 1.2e-9).
+ */
+static double sockem_normal_icdf (double p) {
+        static const double a[] = {
+                -3.969683028665376e+01, 2.209460984245205e+02,
+                -2.759285104469687e+02, 1.383577518672690e+02,
+                -3.066479806614716e+01, 2.506628277459239e+00 };
+        static const double b[] = {
+                -5.447609879822406e+01, 1.615858368580409e+02,
+                -1.556989798598866e+02, 6.680131188771972e+01,
+                -1.328068155288572e+01 };
+        static const double c[] = {
+                -7.784894002430293e-03, -3.223964580411365e-01,
+                -2.400758277161838e+00, -2.549732539343734e+00,
+                4.374664141464968e+00, 2.938163982698783e+00 };
+        static const double d[] = {
+                7.784695709041462e-03, 3.224671290700398e-01,
+                2.445134137142996e+00, 3.754408661907416e+00 };
+        double q, r;
+
+        if (p < 0.02425) {
+                q = sqrt(-2 * log(p));
+                return (((((c[0]*q+c[1])*q+c[2])*q+c[3])*q+c[4])*q+c[5]) /
+                        ((((d[0]*q+d[1])*q+d[2])*q+d[3])*q+1);
+        } else if (p > 1 - 0.02425) {
+                return -sockem_normal_icdf(1 - p);
+        }
+
+        q = p - 0.5;
+        r = q * q;
+        return (((((a[0]*r+a[1])*r+a[2])*r+a[3])*r+a[4])*r+a[5])*q /
+                (((((b[0]*r+b[1])*r+b[2])*r+b[3])*r+b[4])*r+1);
+}
+
+
+/**
+ * @brief Compute the jitter distribution tables, once.
+ */
+static void sockem_dist_init (void) {
+        int i;
+
+        for (i = 0 ; i < SOCKEM_DIST_SIZE ; i++) {
+                double p = ((double)i + 0.5) / SOCKEM_DIST_SIZE;
+
+                sockem_dist_normal[i] = (int32_t)
+                        lrint(sockem_normal_icdf(p) * SOCKEM_DIST_SCALE);
+
+                /* Pareto with x_m 1 and alpha 3 has mean 1.5 and
+                 * variance 0.75 */
+                sockem_dist_pareto[i] = (int32_t)
+                        lrint(((pow(1.0 - p, -1.0 / 3.0) - 1.5) /
+                               sqrt(0.75)) * SOCKEM_DIST_SCALE);
+        }
+}
+
+
+/**
+ * @returns the id of distribution \p name, or -1 if unknown.
+ */
+static int sockem_dist_find (const char *name) {
+        int i;
+
+        for (i = 0 ; i < SOCKEM_DIST__CNT ; i++)
+                if (!strcmp(sockem_dist_names[i], name))
+                        return i;
+
+        return -1;
+}
+
+
+/**
+ * @brief Seed \p skm's jitter PRNG from its configured seed, or from
+ *        the clock if not set, through a splitmix64 round.
+ */
+static void sockem_rand_seed (sockem_t *skm) {
+        uint64_t z = skm->use.seed ? (uint64_t)skm->use.seed :
+                (uint64_t)sockem_clock() ^ (uint64_t)(uintptr_t)skm;
+
+        z += 0x9e3779b97f4a7c15ULL;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z ^= z >> 31;
+
+        skm->rnd = z ? z : 1; /* xorshift state must be non-zero */
+}
+
+
+/**
+ * @returns the next 64 random bits of \p skm's xorshift64* PRNG.
+ */
+static __inline uint64_t sockem_rand (sockem_t *skm) {
+        uint64_t x = skm->rnd;
+
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        skm->rnd = x;
+
+        return x * 0x2545f4914f6cdd1dULL;
+}
+
+
+/**
+ * @returns true with a probability of \p pm per mille.
+ */
+static __inline int sockem_rand_pm (sockem_t *skm, int pm) {
+        return pm > 0 &&
+                (int)(((sockem_rand(skm) >> 32) * 1000) >> 32) < pm;
+}
+
+
+/**
+ * @brief corrupt stage: flip a random bit in \p val per mille of chunks.
+ */
+static int sockem_stage_corrupt (sockem_t *skm, int dir, void *state,
+                                 int val, char *buf, size_t len,
+                                 int64_t now, int64_t *delayp) {
+        uint64_t r;
+
+        (void)dir, (void)state, (void)now, (void)delayp;
+
+        if (!sockem_rand_pm(skm, val))
+                return 0;
+
+        r = sockem_rand(skm);
+        buf[(r >> 3) % len] ^= (char)(1 << (r & 7));
+
+        return 0;
+}
+
+
+/**
+ * @brief stall stage: hold data read during the first \p val ms of every
+ *        second, counting from a random phase per connection and
+ *        direction, until the stall ends.
+ */
+static int sockem_stage_stall (sockem_t *skm, int dir, void *state,
+                               int val, char *buf, size_t len,
+                               int64_t now, int64_t *delayp) {
+        int64_t *phase = state; /* 1..1000000, 0 until drawn */
+        int64_t in;
+
+        (void)dir, (void)buf, (void)len;
+
+        if (!*phase)
+                *phase = (int64_t)(sockem_rand(skm) % 1000000) + 1;
+
+        in = (now + *phase) % 1000000; /* time into the current second */
+        if (in < (int64_t)val * 1000)
+                *delayp += (int64_t)val * 1000 - in;
+
+        return 0;
+}
+
+static const sockem_stage_t sockem_stage_corrupt_def = {
+        .name = "corrupt",
+        .chunk = sockem_stage_corrupt,
+};
+
+static const sockem_stage_t sockem_stage_stall_def = {
+        .name = "stall",
+        .size = sizeof(int64_t),
+        .chunk = sockem_stage_stall,
+};
+
+
+/**
+ * Impairment stages: the built-in ones, at the indexes of their
+ * SOCKEM_K_STAGE based key ids, followed by those added with
+ * sockem_stage_register(). Entries below .cnt are immutable
+ * and read lock-free.
+ */
+static struct {
+        mtx_t lock;                 /* serializes registration */
+        const sockem_stage_t *stages[SOCKEM_STAGE_MAX];
+        int cnt;                    /* atomic */
+} sockem_stagetab = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .stages = { &sockem_stage_corrupt_def, &sockem_stage_stall_def },
+        .cnt = 2,
+};
+
+
+/**
+ * @returns true if \p size bytes at \p hdr are a valid trace.
+ */
+static int sockem_trace_valid (const struct sockem_trace_hdr *hdr,
+                               size_t size) {
+        const struct sockem_trace_ent *ents =
+                (const struct sockem_trace_ent *)(hdr + 1);
+        uint32_t i;
+
+        if (size < sizeof(*hdr) ||
+            memcmp(hdr->magic, SOCKEM_TRACE_MAGIC, sizeof(hdr->magic)) ||
+            hdr->version != SOCKEM_TRACE_VERSION || !hdr->cnt ||
+            (size - sizeof(*hdr)) / sizeof(*ents) < hdr->cnt)
+                return 0;
+
+        for (i = 1 ; i < hdr->cnt ; i++)
+                if (ents[i].ts < ents[i-1].ts)
+                        return 0;
+
+        return !hdr->duration || hdr->duration > ents[hdr->cnt-1].ts;
+}
+
+
+/**
+ * @brief Convert a text trace of "<ts_ms> <delay_ms> <rx_thruput>
+ *        <tx_thruput>" lines in \p str to the binary format.
+ *
+ * The trace repeats after the last entry plus the interval between the
+ * last two entries, i.e., the sampling interval.
+ *
+ * @returns the malloc()ed trace and its \p sizep, or NULL on
+ *          parse error.
+ */
+static struct sockem_trace_hdr *sockem_trace_parse (char *str,
+                                                    size_t *sizep) {
+        struct sockem_trace_hdr *hdr;
+        struct sockem_trace_ent *ents;
+        size_t size = 0;
+        uint32_t cnt = 0;
+        char *s, *t;
+
+        hdr = calloc(1, sizeof(*hdr));
+
+        for (s = str ; s ; s = t) {
+                uint32_t v[4];
+                char *end;
+                int i;
+
+                if ((t = strchr(s, '\n')))
+                        *(t++) = '\0';
+
+                while (*s == ' ' || *s == '\t' || *s == '\r')
+                        s++;
+                if (!*s || *s == '#')
+                        continue;
+
+                for (i = 0 ; i < 4 ; i++) {
+                        unsigned long val = strtoul(s, &end, 0);
+                        if (end == s || val > UINT32_MAX)
+                                break;
+                        v[i] = (uint32_t)val;
+                        s = end;
+                }
+                while (*s == ' ' || *s == '\t' || *s == '\r')
+                        s++;
+                if (i < 4 || *s)
+                        goto fail;
+
+                size = sizeof(*hdr) + (cnt + 1) * sizeof(*ents);
+                hdr = realloc(hdr, size);
+                ents = (struct sockem_trace_ent *)(hdr + 1);
+                ents[cnt].ts         = v[0];
+                ents[cnt].delay      = v[1];
+                ents[cnt].rx_thruput = v[2];
+                ents[cnt].tx_thruput = v[3];
+                cnt++;
+        }
+
+        if (!cnt)
+                goto fail;
+
+        memcpy(hdr->magic, SOCKEM_TRACE_MAGIC, sizeof(hdr->magic));
+        hdr->version = SOCKEM_TRACE_VERSION;
+        hdr->cnt = cnt;
+        ents = (struct sockem_trace_ent *)(hdr + 1);
+        if (cnt > 1)
+                hdr->duration = ents[cnt-1].ts +
+                        (ents[cnt-1].ts - ents[cnt-2].ts);
+
+        *sizep = size;
+        return hdr;
+
+ fail:
+        free(hdr);
+        return NULL;
+}
+
+
+/**
+ * @brief Map the binary trace file at \p path, or convert a text one.
+ * @returns the trace, or NULL on error.
+ */
+static struct sockem_trace *sockem_trace_load (const char *path) {
+        struct sockem_trace *trace;
+        struct sockem_trace_hdr *hdr = NULL;
+        struct stat st;
+        size_t size;
+        char *map;
+        int fd;
+
+        if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1)
+                return NULL;
+
+        if (fstat(fd, &st) == -1 || !st.st_size ||
+            (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+                        fd, 0)) == MAP_FAILED) {
+                sockem_close0(fd);
+                return NULL;
+        }
+        sockem_close0(fd);
+        size = st.st_size;
+
+        if (size >= sizeof(*hdr) &&
+            !memcmp(map, SOCKEM_TRACE_MAGIC, sizeof(hdr->magic))) {
+                /* Binary trace: use the mapping */
+                hdr = (struct sockem_trace_hdr *)map;
+        } else {
+                /* Text trace: convert to binary in memory */
+                char *str = malloc(size + 1);
+
+                memcpy(str, map, size);
+                str[size] = '\0';
+                munmap(map, st.st_size);
+
+                hdr = sockem_trace_parse(str, &size);
+                free(str);
+                if (!hdr)
+                        return NULL;
+        }
+
+        if (!sockem_trace_valid(hdr, size)) {
+                if ((char *)hdr == map)
+                        munmap(map, st.st_size);
+                else
+                        free(hdr);
+                return NULL;
+        }
+
+        trace = calloc(1, sizeof(*trace));
+        trace->path = strdup(path);
+        trace->hdr = hdr;
+        trace->ents = (const struct sockem_trace_ent *)(hdr + 1);
+        trace->duration = (int64_t)hdr->duration * 1000;
+
+        return trace;
+}
+
+
+/**
+ * @returns the trace for \p path, loading it on first use if \p load
+ *          is true, or NULL on error or if not loaded.
+ */
+static const struct sockem_trace *sockem_trace_get (const char *path,
+                                                    int load) {
+        struct sockem_trace *trace;
+
+        mtx_lock(&sockem_traces.lock);
+        LIST_FOREACH(trace, &sockem_traces.traces, link)
+                if (!strcmp(trace->path, path))
+                        break;
+
+        if (!trace && load && (trace = sockem_trace_load(path)))
+                LIST_INSERT_HEAD(&sockem_traces.traces, trace, link);
+        mtx_unlock(&sockem_traces.lock);
+
+        if (!trace && load)
+                fprintf(stderr, "%% sockem: invalid trace file %s\n", path);
+
+        return trace;
+}
+
+
+/**
+ * @brief Advance \p skm's trace position to \p now and apply the
+ *        current entry's delay and throughput to its .use config.
+ *        A single comparison unless the next entry is due.
+ *
+ * @remark Worker thread only.
+ */
+static void sockem_trace_step (sockem_t *skm, sockem_ts_t now) {
+        const struct sockem_trace *trace = skm->use.trace;
+        const struct sockem_trace_ent *ent;
+        uint32_t cnt;
+        int64_t t;
+
+        if (!trace || now < skm->trace_next)
+                return;
+
+        if (trace != skm->trace) {
+                /* (Re)start replay */
+                skm->trace = trace;
+                skm->trace_t0 = now;
+                skm->trace_pos = 0;
+        }
+
+        cnt = trace->hdr->cnt;
+        t = now - skm->trace_t0;
+        if (trace->duration && t >= trace->duration) {
+                /* Wrap around */
+                skm->trace_t0 += (t / trace->duration) * trace->duration;
+                t = now - skm->trace_t0;
+                skm->trace_pos = 0;
+        }
+
+        while (skm->trace_pos + 1 < cnt &&
+               (int64_t)trace->ents[skm->trace_pos + 1].ts * 1000 <= t)
+                skm->trace_pos++;
+
+        ent = &trace->ents[skm->trace_pos];
+        skm->use.delay = (int)SOCKEM_MIN(ent->delay, INT_MAX);
+        skm->use.rx_thruput = (int)SOCKEM_MIN(ent->rx_thruput, INT_MAX);
+        skm->use.tx_thruput = (int)SOCKEM_MIN(ent->tx_thruput, INT_MAX);
+
+        if (skm->trace_pos + 1 < cnt)
+                skm->trace_next = skm->trace_t0 +
+                        (int64_t)trace->ents[skm->trace_pos + 1].ts * 1000;
+        else if (trace->duration)
+                skm->trace_next = skm->trace_t0 + trace->duration;
+        else
+                skm->trace_next = INT64_MAX;
+}
+
+
+/**
+ * @brief Set or, if \p path is empty, unset \p conf's trace, loaded
+ *        ahead by sockem_conf_prep().
+ * @returns 0 on success or -1 if the trace is not loaded.
+ */
+static int sockem_conf_set_trace (struct sockem_conf *conf,
+                                  const char *path) {
+        const struct sockem_trace *trace = NULL;
+
+        if (*path && !(trace = sockem_trace_get(path, 0)))
+                return -1;
+
+        conf->trace = trace;
+        return 0;
+}
+
+
+/**
+ * @brief Set or, if \p name is empty, unset \p conf's link group,
+ *        creating the group on first use.
+ * @returns 0.
+ */
+static int sockem_conf_set_link (struct sockem_conf *conf,
+                                 const char *name) {
+        struct sockem_link *lnk = NULL;
+
+        if (*name) {
+                mtx_lock(&sockem_links.lock);
+                LIST_FOREACH(lnk, &sockem_links.links, link)
+                        if (!strcmp(lnk->name, name))
+                                break;
+
+                if (!lnk) {
+                        lnk = calloc(1, sizeof(*lnk));
+                        lnk->name = strdup(name);
+                        LIST_INSERT_HEAD(&sockem_links.links, lnk, link);
+                }
+                mtx_unlock(&sockem_links.lock);
+        }
+
+        conf->link = lnk;
+        return 0;
+}
+
+
+/**
+ * @returns the payload capacity of size class \p cls.
+ */
+static size_t sockem_chunk_cap (int cls) {
+        return sockem_chunk_sizes[cls] - sizeof(struct sockem_chunk);
+}
+
+
+/**
+ * @brief Carve a new slab into chunks of size class \p cls for the
+ *        calling thread's node, which first touches their pages.
+ * @returns 0 on success or -1 if the memory cap is reached.
+ * @remark sockem_mem.lock must be held.
+ */
+static int sockem_mem_grow (int cls) {
+        size_t sz = sockem_chunk_sizes[cls];
+        char *slab;
+        size_t of;
+
+        if (sockem_mem.max &&
+            sockem_mem.size + SOCKEM_SLAB_SIZE > sockem_mem.max)
+                return -1;
+
+        if (!(slab = malloc(SOCKEM_SLAB_SIZE)))
+                return -1;
+
+        /* Slabs are kept for the lifetime of the process,
+         * their chunks are recycled through the free lists. */
+        for (of = 0 ; of + sz <= SOCKEM_SLAB_SIZE ; of += sz) {
+                struct sockem_chunk *chunk = (struct sockem_chunk *)
+                        (slab + of);
+                chunk->cls = cls;
+                chunk->node = sockem_mem_node;
+                TAILQ_INSERT_TAIL(&sockem_mem.free[sockem_mem_node][cls],
+                                  chunk, link);
+        }
+
+        sockem_mem.size += SOCKEM_SLAB_SIZE;
+
+        return 0;
+}
+
+
+/**
+ * @remark sockem_mem.lock must be held.
+ */
+static void sockem_mem_init (void) {
+        int n, i;
+
+        if (sockem_mem.inited)
+                return;
+
+        for (n = 0 ; n < SOCKEM_MEM_NODES ; n++)
+                for (i = 0 ; i < SOCKEM_CHUNK_CLASSES ; i++)
+                        TAILQ_INIT(&sockem_mem.free[n][i]);
+        sockem_mem.inited = 1;
+}
+
+
+/**
+ * @brief Take a free chunk of size class \p cls, preferably from the
+ *        calling thread's node, growing it if the cap permits, else
+ *        from another node if \p any is true.
+ * @returns the chunk, or NULL if there is none.
+ * @remark sockem_mem.lock must be held.
+ */
+static struct sockem_chunk *sockem_mem_take (int cls, int any) {
+        struct sockem_chunk *chunk;
+        int node = sockem_mem_node;
+        int n;
+
+        if (TAILQ_EMPTY(&sockem_mem.free[node][cls]) &&
+            sockem_mem_grow(cls) == -1) {
+                for (n = 0 ; any && n < SOCKEM_MEM_NODES ; n++)
+                        if (!TAILQ_EMPTY(&sockem_mem.free[n][cls]))
+                                break;
+                if (!any || n == SOCKEM_MEM_NODES)
+                        return NULL;
+                node = n;
+        }
+
+        chunk = TAILQ_FIRST(&sockem_mem.free[node][cls]);
+        TAILQ_REMOVE(&sockem_mem.free[node][cls], chunk, link);
+
+        return chunk;
+}
+
+
+/**
+ * @brief Get a chunk from the pool for at least \p len bytes, capped at
+ *        the largest size class. If the memory cap is reached a chunk from
+ *        a smaller size class may be returned.
+ *
+ * If \p force is true and the pool is exhausted the chunk is
+ * allocated with malloc() past the cap, for data that has already
+ * been read.
+ *
+ * @returns the chunk, or NULL if the pool is exhausted, or with
+ *          \p force if malloc() failed.
+ */
+static struct sockem_chunk *sockem_chunk_new (size_t len, int force) {
+        struct sockem_mag *mag = sockem_mem_mag;
+        struct sockem_chunk *chunk = NULL;
+        int cls;
+
+        for (cls = 0 ; cls < SOCKEM_CHUNK_CLASSES - 1 ; cls++)
+                if (len <= sockem_chunk_cap(cls))
+                        break;
+
+        if (mag && mag->cnt[cls] > 0)
+                return mag->chunks[cls][--mag->cnt[cls]];
+
+        mtx_lock(&sockem_mem.lock);
+        sockem_mem_init();
+        if (mag) {
+                /* Refill the worker's cache with half a batch along */
+                struct sockem_chunk *c;
+
+                while (mag->cnt[cls] < SOCKEM_MAG_SIZE / 2 &&
+                       (c = sockem_mem_take(cls, 0)))
+                        mag->chunks[cls][mag->cnt[cls]++] = c;
+                if (mag->cnt[cls] > 0)
+                        chunk = mag->chunks[cls][--mag->cnt[cls]];
+        }
+        for ( ; cls >= 0 && !chunk ; cls--)
+                chunk = sockem_mem_take(cls, 1);
+        mtx_unlock(&sockem_mem.lock);
+
+        if (!chunk && force &&
+            (chunk = malloc(sizeof(*chunk) + len)))
+                chunk->cls = -1;
+
+        return chunk;
+}
+
+
+/**
+ * @brief Return the \p cnt oldest chunks of size class \p cls in
+ *        cache \p mag to the pool.
+ * @remark sockem_mem.lock must be held.
+ */
+static void sockem_mag_drain0 (struct sockem_mag *mag, int cls, int cnt) {
+        int i;
+
+        for (i = 0 ; i < cnt ; i++) {
+                struct sockem_chunk *chunk = mag->chunks[cls][i];
+
+                TAILQ_INSERT_HEAD(&sockem_mem.free[chunk->node][cls],
+                                  chunk, link);
+        }
+
+        mag->cnt[cls] -= cnt;
+        memmove(mag->chunks[cls], mag->chunks[cls] + cnt,
+                (size_t)mag->cnt[cls] * sizeof(*mag->chunks[cls]));
+}
+
+
+/**
+ * @brief Return all chunks in cache \p mag to the pool.
+ */
+static void sockem_mag_flush (struct sockem_mag *mag) {
+        int cls;
+
+        for (cls = 0 ; cls < SOCKEM_CHUNK_CLASSES ; cls++)
+                if (mag->cnt[cls] > 0)
+                        break;
+        if (cls == SOCKEM_CHUNK_CLASSES)
+                return;
+
+        mtx_lock(&sockem_mem.lock);
+        for ( ; cls < SOCKEM_CHUNK_CLASSES ; cls++)
+                sockem_mag_drain0(mag, cls, mag->cnt[cls]);
+        mtx_unlock(&sockem_mem.lock);
+}
+
+
+/**
+ * @brief Return \p chunk to the pool, through the calling worker's
+ *        cache if it is from the worker's node.
+ */
+static void sockem_chunk_free (struct sockem_chunk *chunk) {
+        struct sockem_mag *mag = sockem_mem_mag;
+
+        if (chunk->cls == -1) {
+                free(chunk);
+                return;
+        }
+
+        if (mag && chunk->node == sockem_mem_node) {
+                /* LIFO to reuse cache-warm chunks */
+                if (mag->cnt[chunk->cls] == SOCKEM_MAG_SIZE) {
+                        mtx_lock(&sockem_mem.lock);
+                        sockem_mag_drain0(mag, chunk->cls,
+                                          SOCKEM_MAG_SIZE / 2);
+                        mtx_unlock(&sockem_mem.lock);
+                }
+                mag->chunks[chunk->cls][mag->cnt[chunk->cls]++] = chunk;
+                return;
+        }
+
+        mtx_lock(&sockem_mem.lock);
+        /* LIFO to reuse cache-warm chunks */
+        TAILQ_INSERT_HEAD(&sockem_mem.free[chunk->node][chunk->cls],
+                          chunk, link);
+        mtx_unlock(&sockem_mem.lock);
+}
+
+
+/**
+ * @returns true if a chunk of any size may be had from the pool.
+ */
+static int sockem_mem_avail (void) {
+        struct sockem_mag *mag = sockem_mem_mag;
+        int avail;
+        int n, i;
+
+        for (i = 0 ; mag && i < SOCKEM_CHUNK_CLASSES ; i++)
+                if (mag->cnt[i] > 0)
+                        return 1;
+
+        mtx_lock(&sockem_mem.lock);
+        sockem_mem_init();
+        avail = !sockem_mem.max ||
+                sockem_mem.size + SOCKEM_SLAB_SIZE <= sockem_mem.max;
+        for (n = 0 ; !avail && n < SOCKEM_MEM_NODES ; n++)
+                for (i = 0 ; !avail && i < SOCKEM_CHUNK_CLASSES ; i++)
+                        avail = !TAILQ_EMPTY(&sockem_mem.free[n][i]);
+        mtx_unlock(&sockem_mem.lock);
+
+        return avail;
+}
+
+
+/**
+ * @returns the histogram bucket for \p v.
+ */
+static int sockem_hist_idx (uint64_t v) {
+        int shift;
+
+        if (v < SOCKEM_HIST_SUB)
+                return (int)v;
+
+        shift = (63 - __builtin_clzll(v)) - SOCKEM_HIST_SUB_BITS;
+        return ((shift + 1) << SOCKEM_HIST_SUB_BITS) +
+                (int)((v >> shift) - SOCKEM_HIST_SUB);
+}
+
+
+/**
+ * @returns the midpoint value of histogram bucket \p idx.
+ */
+static uint64_t sockem_hist_value (int idx) {
+        int shift;
+
+        if (idx < SOCKEM_HIST_SUB)
+                return (uint64_t)idx;
+
+        shift = (idx >> SOCKEM_HIST_SUB_BITS) - 1;
+        return ((uint64_t)((idx & (SOCKEM_HIST_SUB - 1)) + SOCKEM_HIST_SUB)
+                << shift) + ((1ULL << shift) / 2);
+}
+
+
+/**
+ * @brief Record value \p v (microseconds) in \p h.
+ * @remark Single writer, see SOCKEM_STAT_ADD().
+ */
+static void sockem_hist_record (struct sockem_hist *h, int64_t v) {
+        uint64_t u = v < 0 ? 0 : (uint64_t)v;
+
+        if (u > UINT32_MAX)
+                u = UINT32_MAX;
+
+        if (!h->cnt || u < h->min)
+                __atomic_store_n(&h->min, u, __ATOMIC_RELAXED);
+        if (u > h->max)
+                __atomic_store_n(&h->max, u, __ATOMIC_RELAXED);
+        SOCKEM_STAT_ADD(h->buckets[sockem_hist_idx(u)], 1);
+        SOCKEM_STAT_ADD(h->sum, u);
+        SOCKEM_STAT_ADD(h->cnt, 1);
+}
+
+
+/**
+ * @brief Add \p src to \p dst, \p dst must not be concurrently updated.
+ */
+static void sockem_hist_merge (struct sockem_hist *dst,
+                               const struct sockem_hist *src) {
+        uint64_t cnt = SOCKEM_STAT_GET(src->cnt);
+        uint64_t min = SOCKEM_STAT_GET(src->min);
+        uint64_t max = SOCKEM_STAT_GET(src->max);
+        int i;
+
+        if (!cnt)
+                return;
+
+        if (!dst->cnt || min < dst->min)
+                dst->min = min;
+        if (max > dst->max)
+                dst->max = max;
+        dst->cnt += cnt;
+        dst->sum += SOCKEM_STAT_GET(src->sum);
+        for (i = 0 ; i < SOCKEM_HIST_BUCKETS ; i++)
+                dst->buckets[i] += SOCKEM_STAT_GET(src->buckets[i]);
+}
+
+
+/**
+ * @brief Summarize \p h into percentiles.
+ */
+static void sockem_hist_summary (const struct sockem_hist *h,
+                                 struct sockem_hist_stats *hs) {
+        static const double pcts[] = { 0.50, 0.90, 0.99, 0.999 };
+        uint64_t *outs[] = { &hs->p50, &hs->p90, &hs->p99, &hs->p999 };
+        uint64_t seen = 0;
+        int i, p = 0;
+
+        memset(hs, 0, sizeof(*hs));
+        if (!(hs->cnt = h->cnt))
+                return;
+
+        hs->min = h->min;
+        hs->max = h->max;
+        hs->avg = h->sum / h->cnt;
+
+        for (i = 0 ; i < SOCKEM_HIST_BUCKETS && p < 4 ; i++) {
+                seen += h->buckets[i];
+                while (p < 4 && seen >= (uint64_t)(pcts[p] * hs->cnt + 0.5)) {
+                        uint64_t v = sockem_hist_value(i);
+                        /* Stay within the exact bounds */
+                        *outs[p++] = v < hs->min ? hs->min :
+                                v > hs->max ? hs->max : v;
+                }
+        }
+}
+
+
+/**
+ * @returns per-direction histograms \p *histp, allocating them if needed.
+ */
+static struct sockem_hist *sockem_hist_get (struct sockem_hist **histp) {
+        struct sockem_hist *hist = *histp;
+
+        if (!hist) {
+                hist = calloc(SOCKEM_HIST__CNT, sizeof(*hist));
+                __atomic_store_n(histp, hist, __ATOMIC_RELEASE);
+        }
+
+        return hist;
+}
+
+
+#ifdef WITH_IO_URING
+/**
+ * @brief Destroy io_uring instance \p ur.
+ */
+static void sockem_uring_destroy (struct sockem_uring *ur) {
+        if (ur->slots)
+                munmap(ur->slots, SOCKEM_URING_SLOTS * SOCKEM_URING_SLOTSZ);
+        if (ur->sqes)
+                munmap(ur->sqes, ur->sqes_sz);
+        if (ur->cq_ring && ur->cq_ring != ur->sq_ring)
+                munmap(ur->cq_ring, ur->cq_ringsz);
+        if (ur->sq_ring)
+                munmap(ur->sq_ring, ur->sq_ringsz);
+        if (ur->fd != -1)
+                sockem_close0(ur->fd);
+        free(ur);
+}
+
+
+/**
+ * @brief Map \p len bytes of io_uring \p fd at \p offset.
+ * @returns the mapping or NULL on failure.
+ */
+static void *sockem_uring_mmap (int fd, size_t len, off_t offset) {
+        void *p = mmap(NULL, len, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, fd, offset);
+        return p == MAP_FAILED ? NULL : p;
+}
+
+
+/**
+ * @brief Set up an io_uring instance with registered read buffers.
+ * @returns the new instance, or NULL if io_uring is not available
+ *          in which case the worker falls back on recv()/send().
+ */
+static struct sockem_uring *sockem_uring_new (void) {
+        struct sockem_uring *ur;
+        struct io_uring_params p;
+        struct iovec iov[SOCKEM_URING_SLOTS];
+        unsigned i;
+
+        ur = calloc(1, sizeof(*ur));
+        TAILQ_INIT(&ur->out);
+        TAILQ_INIT(&ur->done);
+
+        memset(&p, 0, sizeof(p));
+        ur->fd = (int)syscall(__NR_io_uring_setup, SOCKEM_URING_ENTRIES, &p);
+        if (ur->fd == -1)
+                goto fail;
+
+        ur->sq_ringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        ur->cq_ringsz = p.cq_off.cqes +
+                p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (ur->cq_ringsz > ur->sq_ringsz)
+                        ur->sq_ringsz = ur->cq_ringsz;
+                ur->cq_ringsz = ur->sq_ringsz;
+        }
+
+        if (!(ur->sq_ring = sockem_uring_mmap(ur->fd, ur->sq_ringsz,
+                                              IORING_OFF_SQ_RING)))
+                goto fail;
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+                ur->cq_ring = ur->sq_ring;
+        else if (!(ur->cq_ring = sockem_uring_mmap(ur->fd, ur->cq_ringsz,
+                                                   IORING_OFF_CQ_RING)))
+                goto fail;
+
+        ur->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+        if (!(ur->sqes = sockem_uring_mmap(ur->fd, ur->sqes_sz,
+                                           IORING_OFF_SQES)))
+                goto fail;
+
+        ur->sq_head  = (unsigned *)((char *)ur->sq_ring + p.sq_off.head);
+        ur->sq_tail  = (unsigned *)((char *)ur->sq_ring + p.sq_off.tail);
+        ur->sq_mask  = (unsigned *)((char *)ur->sq_ring +
+                                    p.sq_off.ring_mask);
+        ur->sq_array = (unsigned *)((char *)ur->sq_ring + p.sq_off.array);
+        ur->sq_entries = p.sq_entries;
+        ur->cq_head  = (unsigned *)((char *)ur->cq_ring + p.cq_off.head);
+        ur->cq_tail  = (unsigned *)((char *)ur->cq_ring + p.cq_off.tail);
+        ur->cq_mask  = (unsigned *)((char *)ur->cq_ring +
+                                    p.cq_off.ring_mask);
+        ur->cqes     = (struct io_uring_cqe *)((char *)ur->cq_ring +
+                                               p.cq_off.cqes);
+
+        /* SQEs are always submitted in ring order */
+        for (i = 0 ; i < ur->sq_entries ; i++)
+                ur->sq_array[i] = i;
+        ur->sq_ltail = *ur->sq_tail;
+
+        ur->slots = mmap(NULL, SOCKEM_URING_SLOTS * SOCKEM_URING_SLOTSZ,
+                         PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+                         -1, 0);
+        if (ur->slots == MAP_FAILED) {
+                ur->slots = NULL;
+                goto fail;
+        }
+
+        for (i = 0 ; i < SOCKEM_URING_SLOTS ; i++) {
+                iov[i].iov_base = ur->slots + (i * SOCKEM_URING_SLOTSZ);
+                iov[i].iov_len = SOCKEM_URING_SLOTSZ;
+        }
+
+        if (syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_BUFFERS,
+                    iov, SOCKEM_URING_SLOTS) == -1)
+                goto fail;
+
+        return ur;
+
+ fail:
+        sockem_uring_destroy(ur);
+        return NULL;
+}
+
+
+/**
+ * @returns a cleared SQE to prepare, or NULL if the SQ is full.
+ */
+static struct io_uring_sqe *sockem_uring_sqe (struct sockem_uring *ur) {
+        unsigned head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+        struct io_uring_sqe *sqe;
+
+        if (ur->sq_ltail - head >= ur->sq_entries)
+                return NULL;
+
+        sqe = &ur->sqes[ur->sq_ltail & *ur->sq_mask];
+        ur->sq_ltail++;
+        memset(sqe, 0, sizeof(*sqe));
+
+        return sqe;
+}
+
+
+/**
+ * @brief Submit all prepared SQEs and, if \p wait is true, wait for
+ *        all in-flight requests to complete.
+ * @returns 0 on success or -1 on error.
+ */
+static int sockem_uring_submit (struct sockem_uring *ur, int wait) {
+
+        __atomic_store_n(ur->sq_tail, ur->sq_ltail, __ATOMIC_RELEASE);
+
+        while (1) {
+                unsigned submit = ur->sq_ltail -
+                        __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+                unsigned ready = __atomic_load_n(ur->cq_tail,
+                                                 __ATOMIC_ACQUIRE) -
+                        *ur->cq_head;
+                unsigned want = wait ? ur->inflight + submit - ready : 0;
+                long r;
+
+                if (!submit && !want)
+                        return 0;
+
+                r = syscall(__NR_io_uring_enter, ur->fd, submit, want,
+                            want ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+                if (r == -1) {
+                        if (errno == EINTR || errno == EAGAIN)
+                                continue;
+                        return -1;
+                }
+
+                ur->inflight += (unsigned)r;
+        }
+}
+
+
+/**
+ * @brief Reap a single completion.
+ * @returns 1 if a completion was reaped into \p user_datap and \p resp,
+ *          else 0.
+ */
+static int sockem_uring_cqe (struct sockem_uring *ur, uint64_t *user_datap,
+                             int *resp) {
+        unsigned head = *ur->cq_head;
+        struct io_uring_cqe *cqe;
+
+        if (head == __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE))
+                return 0;
+
+        cqe = &ur->cqes[head & *ur->cq_mask];
+        *user_datap = cqe->user_data;
+        *resp = cqe->res;
+
+        __atomic_store_n(ur->cq_head, head + 1, __ATOMIC_RELEASE);
+        ur->inflight--;
+
+        return 1;
+}
+
+
+/**
+ * @brief Put the output gathered on \p dir that a SENDMSG did not send,
+ *        beyond its first \p sent bytes, back on the delay line and
+ *        wait for the output socket to become writable.
+ * @returns 0 on success or -1 if out of memory, see sockem_dir_unsent().
+ */
+static int sockem_uring_unsent (struct sockem_dir *dir, size_t sent) {
+        struct sockem_chunk *after = NULL;
+        int i;
+
+        for (i = 0 ; i < dir->uiovcnt ; i++) {
+                const struct iovec *iov = &dir->uiov[i];
+
+                if (sent >= iov->iov_len) {
+                        sent -= iov->iov_len;
+                        continue;
+                }
+
+                if (sockem_dir_unsent(dir,
+                                      (const char *)iov->iov_base + sent,
+                                      iov->iov_len - sent, &after) == -1)
+                        return -1;
+                sent = 0;
+        }
+
+        sockem_dir_owait(dir, 1);
+
+        return 0;
+}
+
+
+/**
+ * @brief Submit all gathered output as one SENDMSG per direction, wait for
+ *        completion and tear down sockems whose send failed.
+ *        Unsent output is put back on the delay lines, sent chunks are
+ *        freed and the read buffers may be reused.
+ */
+static void sockem_uring_flush (struct sockem_wrkr *wrkr) {
+        struct sockem_uring *ur = wrkr->uring;
+        struct sockem_dir *dir;
+        struct sockem_chunk *chunk;
+        uint64_t ud;
+        int res;
+
+        while ((dir = TAILQ_FIRST(&ur->out))) {
+                struct io_uring_sqe *sqe = sockem_uring_sqe(ur);
+
+                if (!sqe) {
+                        /* SQ is full: submit what we have */
+                        if (sockem_uring_submit(ur, 0) == -1)
+                                break;
+                        continue;
+                }
+
+                TAILQ_REMOVE(&ur->out, dir, olink);
+
+                memset(&dir->umsg, 0, sizeof(dir->umsg));
+                dir->umsg.msg_iov = dir->uiov;
+                dir->umsg.msg_iovlen = dir->uiovcnt;
+
+                sqe->opcode = IORING_OP_SENDMSG;
+                sqe->fd = dir->ofd;
+                sqe->addr = (uint64_t)(uintptr_t)&dir->umsg;
+                sqe->len = 1;
+                /* Complete short instead of waiting for the socket,
+                 * the rest is put back on the delay line below. */
+                sqe->msg_flags = MSG_DONTWAIT;
+                sqe->user_data = (uint64_t)(uintptr_t)dir;
+        }
+
+        if (sockem_uring_submit(ur, 1) == -1)
+                fprintf(stderr, "%% sockem: io_uring_enter() failed: %s\n",
+                        strerror(errno));
+
+        while (sockem_uring_cqe(ur, &ud, &res)) {
+                dir = (struct sockem_dir *)(uintptr_t)ud;
+                if (res == -EAGAIN)
+                        res = 0;
+                if (res < 0)
+                        sockem_term(wrkr, dir->skm);
+                else {
+                        if (res > 0)
+                                sockem_dir_stat_fwd(dir, res);
+                        if ((size_t)res < dir->ulen &&
+                            sockem_uring_unsent(dir, res) == -1)
+                                sockem_term(wrkr, dir->skm);
+                }
+                dir->uiovcnt = 0;
+                dir->ulen = 0;
+        }
+
+        while ((chunk = TAILQ_FIRST(&ur->done))) {
+                TAILQ_REMOVE(&ur->done, chunk, link);
+                sockem_chunk_free(chunk);
+        }
+
+        ur->slot_cnt = 0;
+}
+
+
+/**
+ * @brief Gather the \p iovcnt buffers, \p len bytes in total, at \p iov
+ *        for sending to \p dir's output socket on the next
+ *        sockem_uring_flush().
+ * @returns \p len, or 0 if the output socket is full
+ *          (send failures are handled by the flush).
+ */
+static ssize_t sockem_uring_sendv (struct sockem_wrkr *wrkr,
+                                   struct sockem_dir *dir,
+                                   const struct iovec *iov, int iovcnt,
+                                   size_t len) {
+        struct sockem_uring *ur = wrkr->uring;
+
+        /* Flush first rather than half-way through \p iov, the flush
+         * may put unsent output back ahead of it. */
+        if (dir->uiovcnt + iovcnt > SOCKEM_URING_IOVS)
+                sockem_uring_flush(wrkr);
+
+        if (dir->owait)
+                return 0;
+
+        if (dir->uiovcnt == 0)
+                TAILQ_INSERT_TAIL(&ur->out, dir, olink);
+
+        memcpy(&dir->uiov[dir->uiovcnt], iov, iovcnt * sizeof(*iov));
+        dir->uiovcnt += iovcnt;
+        dir->ulen += len;
+
+        return (ssize_t)len;
+}
+#endif
+
+
+/**
+ * @returns the token bucket size for \p rate: \p burst if set,
+ *          else 10 ms worth of data but at least one full-sized segment.
+ */
+static int64_t sockem_tb_burst (int rate, int burst) {
+        if (burst > 0)
+                return burst;
+        return rate / 100 > 1460 ? rate / 100 : 1460;
+}
+
+
+/**
+ * @brief Refill token bucket \p tb at \p rate bytes/second up to
+ *        \p burst bytes.
+ * @returns the number of bytes that may be sent at \p now.
+ */
+static size_t sockem_tb_refill (struct sockem_tb *tb, int rate, int burst,
+                                sockem_ts_t now) {
+        int64_t max = sockem_tb_burst(rate, burst) * 1000000;
+        int64_t elapsed = now - tb->ts;
+
+        tb->ts = now;
+
+        /* Compare by division to not overflow on long idle periods */
+        if (tb->tokens >= max || elapsed >= (max - tb->tokens) / rate)
+                tb->tokens = max;
+        else
+                tb->tokens += elapsed * rate;
+
+        /* Overdrawn by a datagram */
+        if (tb->tokens < 0)
+                return 0;
+
+        return (size_t)(tb->tokens / 1000000);
+}
+
+
+/**
+ * @brief Consume \p bytes tokens from \p tb.
+ */
+static void sockem_tb_consume (struct sockem_tb *tb, size_t bytes) {
+        tb->tokens -= (int64_t)bytes * 1000000;
+}
+
+
+/**
+ * @brief Return \p bytes tokens consumed but not used to \p tb.
+ */
+static void sockem_tb_refund (struct sockem_tb *tb, size_t bytes) {
+        tb->tokens += (int64_t)bytes * 1000000;
+}
+
+
+/**
+ * @returns the time at which \p bytes (capped to the bucket size)
+ *          may be sent from \p tb, refilled at \p now.
+ */
+static sockem_ts_t sockem_tb_due (const struct sockem_tb *tb, int rate,
+                                  int burst, size_t bytes, sockem_ts_t now) {
+        int64_t want = sockem_tb_burst(rate, burst);
+
+        if ((int64_t)bytes < want)
+                want = bytes;
+        want *= 1000000;
+
+        if (tb->tokens >= want)
+                return now;
+
+        /* Round up to not wake up before the tokens are available */
+        return now + (want - tb->tokens + rate - 1) / rate;
+}
+
+
+/**
+ * @returns \p dir's configured throughput in bytes/second, 0 if unlimited.
+ */
+static int sockem_dir_rate (const struct sockem_dir *dir) {
+        const struct sockem_conf *conf = &dir->skm->use;
+        return dir->idx == SOCKEM_TX ? conf->tx_thruput : conf->rx_thruput;
+}
+
+
+/**
+ * @returns \p dir's configured token bucket size, 0 for auto.
+ */
+static int sockem_dir_burst (const struct sockem_dir *dir) {
+        const struct sockem_conf *conf = &dir->skm->use;
+        return dir->idx == SOCKEM_TX ? conf->tx_burst : conf->rx_burst;
+}
+
+
+/**
+ * @brief Take up to \p want bytes from link group direction \p ld's
+ *        shared token bucket at \p now, or all of \p want if \p whole
+ *        is true, overdrawing the bucket.
+ *
+ * @returns the number of bytes taken, or 0 if the link is saturated,
+ *          in which case \p duep is set to when it may be retried.
+ */
+static size_t sockem_link_take (struct sockem_link_dir *ld, size_t want,
+                                int whole, sockem_ts_t now,
+                                sockem_ts_t *duep) {
+        int rate = __atomic_load_n(&ld->rate, __ATOMIC_RELAXED);
+        int64_t burst, now_ns = now * 1000;
+        int64_t tat, base, avail, take, ntat;
+
+        if (!rate)
+                return want;
+
+        /* Time it takes to fill the bucket */
+        burst = sockem_tb_burst(rate, 0) * 1000000000 / rate;
+
+        tat = __atomic_load_n(&ld->tat, __ATOMIC_RELAXED);
+        do {
+                /* Credit beyond a full bucket is lost */
+                base = tat < now_ns - burst ? now_ns - burst : tat;
+                avail = (now_ns - base) * rate / 1000000000;
+                if (avail <= 0) {
+                        take = SOCKEM_MIN((int64_t)want,
+                                          sockem_tb_burst(rate, 0));
+                        /* Round up to not retry too early */
+                        *duep = (base + take * 1000000000 / rate +
+                                 999) / 1000;
+                        return 0;
+                }
+
+                take = whole ? (int64_t)want : SOCKEM_MIN((int64_t)want, avail);
+                ntat = base + take * 1000000000 / rate;
+        } while (!__atomic_compare_exchange_n(&ld->tat, &tat, ntat, 0,
+                                              __ATOMIC_RELAXED,
+                                              __ATOMIC_RELAXED));
+
+        return (size_t)take;
+}
+
+
+/**
+ * @returns true if \p dir's link group queue, or \p dir's share of it,
+ *          is full.
+ */
+static int sockem_dir_link_full (const struct sockem_dir *dir) {
+        const struct sockem_link_dir *ld;
+        size_t qmax;
+        int cnt;
+
+        if (!dir->skm->use.link)
+                return 0;
+
+        ld = &dir->skm->use.link->dir[dir->idx];
+        qmax = __atomic_load_n(&ld->qmax, __ATOMIC_RELAXED);
+        if (!qmax)
+                return 0;
+
+        cnt = __atomic_load_n(&ld->members[SOCKEM_LINK_BUSY],
+                              __ATOMIC_RELAXED) +
+                __atomic_load_n(&ld->members[SOCKEM_LINK_WAIT],
+                                __ATOMIC_RELAXED);
+
+        return __atomic_load_n(&ld->qlen, __ATOMIC_RELAXED) >= qmax ||
+                (cnt > 1 && dir->qlen >= qmax / cnt);
+}
+
+
+/**
+ * @brief Start (\p on) or stop counting \p dir as a member in state
+ *        \p state of its link group.
+ */
+static void sockem_dir_link_mark (struct sockem_dir *dir, int state, int on) {
+        if (!dir->link || dir->lmark[state] == on)
+                return;
+
+        dir->lmark[state] = on;
+        __atomic_add_fetch(&dir->link->dir[dir->idx].members[state],
+                           on ? 1 : -1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * @brief Account \p dir's empty delay line to its configured link
+ *        group, if it changed.
+ */
+static void sockem_dir_link_update (struct sockem_dir *dir) {
+        if (dir->link == dir->skm->use.link)
+                return;
+
+        sockem_dir_link_mark(dir, SOCKEM_LINK_BUSY, 0);
+        sockem_dir_link_mark(dir, SOCKEM_LINK_WAIT, 0);
+        dir->link = dir->skm->use.link;
+}
+
+
+/**
+ * @brief Update the epoll interest on \p dir's input socket, which is
+ *        also the opposite direction's output socket.
+ *        In-process sockems have no tx input socket.
+ */
+static void sockem_dir_epoll (struct sockem_dir *dir) {
+        struct epoll_event ev = { .data.ptr = dir };
+
+        if (dir->ifd == -1)
+                return;
+
+        ev.events = dir->events |
+                (dir->skm->dir[!dir->idx].owait ? EPOLLOUT : 0);
+        if (dir->epev == ev.events)
+                return;
+
+        dir->epev = ev.events;
+        epoll_ctl(dir->skm->wrkr->epfd, EPOLL_CTL_MOD, dir->ifd, &ev);
+}
+
+
+/**
+ * @brief Set epoll input interest on \p dir's input socket to \p events.
+ */
+static void sockem_dir_set_events (struct sockem_dir *dir, uint32_t events) {
+        if (dir->events == events)
+                return;
+
+        dir->events = events;
+        sockem_dir_epoll(dir);
+}
+
+
+/**
+ * @brief Release \p dir's delay line by sockem_wrkr_timers() at \p due,
+ *        or earlier if already scheduled so.
+ */
+static void sockem_dir_sched (struct sockem_dir *dir, sockem_ts_t due) {
+        if (dir->tmr.lvl != -1 && dir->tmr.due <= due)
+                return;
+
+        sockem_timer_start(&dir->skm->wrkr->wheel, &dir->tmr, due);
+}
+
+
+/**
+ * @brief Start (\p on) or stop waiting for \p dir's output socket to
+ *        become writable, see sockem_serve().
+ */
+static void sockem_dir_owait (struct sockem_dir *dir, int on) {
+        if (dir->owait == on)
+                return;
+
+        dir->owait = on;
+        sockem_dir_epoll(&dir->skm->dir[!dir->idx]);
+
+        if (!on)
+                sockem_dir_sched(dir, dir->skm->wrkr->wheel.now);
+}
+
+
+/**
+ * @returns true if \p dir's delay line holds qmax bytes, 0 = unlimited.
+ */
+static int sockem_dir_qfull (const struct sockem_dir *dir) {
+        size_t qmax = dir->skm->use.qmax;
+
+        return qmax && dir->qlen >= qmax;
+}
+
+
+/**
+ * @returns true if \p dir's input must be paused: its delay line or its
+ *          link group's queue is full, or its output socket is full with
+ *          more than SOCKEM_OUT_HWM bytes queued.
+ */
+static int sockem_dir_input_full (const struct sockem_dir *dir) {
+        return sockem_dir_qfull(dir) ||
+                (dir->owait && dir->qlen >= SOCKEM_OUT_HWM) ||
+                sockem_dir_link_full(dir);
+}
+
+
+/**
+ * @brief Account \p len bytes forwarded by one write on \p dir.
+ */
+static void sockem_dir_stat_fwd (struct sockem_dir *dir, size_t len) {
+        struct sockem_dir_stats *wst = &dir->skm->wrkr->st[dir->idx];
+
+        SOCKEM_STAT_ADD(dir->st.bytes, len);
+        SOCKEM_STAT_ADD(dir->st.chunks, 1);
+        SOCKEM_STAT_ADD(wst->bytes, len);
+        SOCKEM_STAT_ADD(wst->chunks, 1);
+
+        SOCKEM_EV(SEND, send, dir, len, 0);
+}
+
+
+/**
+ * @brief Account \p delta bytes put on (or, if negative, removed from)
+ *        \p dir's delay line.
+ */
+static void sockem_dir_stat_queued (struct sockem_dir *dir, int64_t delta) {
+        SOCKEM_STAT_ADD(dir->skm->wrkr->st[dir->idx].queued, delta);
+
+        if (dir->link)
+                __atomic_add_fetch(&dir->link->dir[dir->idx].qlen,
+                                   (size_t)delta, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * @brief Record \p v in \p dir's and its worker's histogram \p which.
+ */
+static void sockem_dir_hist_record (struct sockem_dir *dir, int which,
+                                    int64_t v) {
+        sockem_hist_record(&sockem_hist_get(&dir->hist)[which], v);
+        sockem_hist_record(&sockem_hist_get(&dir->skm->wrkr->
+                                            hist[dir->idx])[which], v);
+}
+
+
+/**
+ * @brief Put \p chunk read at \p now on \p dir's delay line, to be
+ *        released after \p delay microseconds.
+ *        Input is paused while the delay line is full.
+ */
+static void sockem_dir_enq (struct sockem_dir *dir,
+                            struct sockem_chunk *chunk, sockem_ts_t now,
+                            int64_t delay) {
+        struct sockem_chunk *last;
+        sockem_ts_t due = now + delay;
+
+        sockem_dir_hist_record(dir, SOCKEM_HIST_TARGET, delay);
+
+        /* Never reorder the byte stream, e.g., when delay is lowered
+         * or a shorter jitter is sampled: clamp to the last chunk.
+         * Datagrams are released in due order instead. */
+        last = TAILQ_LAST(&dir->q, sockem_chunk_q);
+        if (last && last->due > due && !dir->skm->dgram)
+                due = last->due;
+
+        chunk->due = due;
+        chunk->ts = now;
+        chunk->of = 0;
+
+        if (!last) {
+                sockem_dir_link_update(dir);
+                sockem_dir_link_mark(dir, SOCKEM_LINK_BUSY, 1);
+        }
+
+        if (last && last->due > due) {
+                struct sockem_chunk *prev = last;
+
+                while (prev && prev->due > due)
+                        prev = TAILQ_PREV(prev, sockem_chunk_q, link);
+                if (prev)
+                        TAILQ_INSERT_AFTER(&dir->q, prev, chunk, link);
+                else
+                        TAILQ_INSERT_HEAD(&dir->q, chunk, link);
+        } else
+                TAILQ_INSERT_TAIL(&dir->q, chunk, link);
+        __atomic_store_n(&dir->qlen, dir->qlen + chunk->len,
+                         __ATOMIC_RELAXED);
+        sockem_dir_stat_queued(dir, (int64_t)chunk->len);
+
+        SOCKEM_EV(ENQUEUE, enqueue, dir, chunk->len, due);
+
+        sockem_dir_sched(dir, chunk->due);
+
+        if (sockem_dir_input_full(dir))
+                sockem_dir_set_events(dir, 0);
+}
+
+
+/**
+ * @brief Count \p len bytes read on \p dir as dropped.
+ */
+static void sockem_dir_stat_dropped (struct sockem_dir *dir, size_t len) {
+        SOCKEM_STAT_ADD(dir->st.dropped, len);
+        SOCKEM_STAT_ADD(dir->skm->wrkr->st[dir->idx].dropped, len);
+}
+
+
+/**
+ * @brief Put \p len bytes at \p buf that \p dir's output socket did not
+ *        take back on the delay line, due right away: after \p *afterp,
+ *        or at the head if NULL, which is updated to the last chunk.
+ *
+ * The data has already been read so this may allocate past the
+ * pool's memory cap.
+ *
+ * @returns 0 on success or -1 if out of memory, the rest of the data
+ *          is dropped and the stream broken.
+ */
+static int sockem_dir_unsent (struct sockem_dir *dir, const char *buf,
+                              size_t len, struct sockem_chunk **afterp) {
+        sockem_ts_t now = sockem_clock();
+
+        while (len > 0) {
+                struct sockem_chunk *chunk = sockem_chunk_new(len, 1);
+                size_t n = len;
+
+                if (!chunk) {
+                        sockem_dir_stat_dropped(dir, len);
+                        return -1;
+                }
+
+                if (chunk->cls != -1 && n > sockem_chunk_cap(chunk->cls))
+                        n = sockem_chunk_cap(chunk->cls);
+
+                memcpy(chunk->data, buf, n);
+                chunk->len = n;
+                chunk->due = chunk->ts = now;
+                chunk->of = 0;
+
+                if (TAILQ_EMPTY(&dir->q)) {
+                        sockem_dir_link_update(dir);
+                        sockem_dir_link_mark(dir, SOCKEM_LINK_BUSY, 1);
+                }
+
+                if (*afterp)
+                        TAILQ_INSERT_AFTER(&dir->q, *afterp, chunk, link);
+                else
+                        TAILQ_INSERT_HEAD(&dir->q, chunk, link);
+                *afterp = chunk;
+
+                __atomic_store_n(&dir->qlen, dir->qlen + n,
+                                 __ATOMIC_RELAXED);
+                sockem_dir_stat_queued(dir, (int64_t)n);
+
+                buf += n;
+                len -= n;
+        }
+
+        sockem_dir_sched(dir, now);
+
+        if (sockem_dir_input_full(dir))
+                sockem_dir_set_events(dir, 0);
+
+        return 0;
+}
+
+
+/**
+ * @brief Copy \p len bytes from \p buf to \p dir's delay line,
+ *        see sockem_dir_enq().
+ *
+ * The data has already been read so this may allocate past the
+ * pool's memory cap.
+ *
+ * @returns 0 on success or -1 if out of memory, see sockem_dir_unsent().
+ */
+static int sockem_dir_enq_copy (struct sockem_dir *dir, const char *buf,
+                                size_t len, sockem_ts_t now,
+                                int64_t delay) {
+        while (len > 0) {
+                struct sockem_chunk *chunk = sockem_chunk_new(len, 1);
+                size_t n = len;
+
+                if (!chunk) {
+                        sockem_dir_stat_dropped(dir, len);
+                        return -1;
+                }
+
+                if (chunk->cls != -1 && n > sockem_chunk_cap(chunk->cls))
+                        n = sockem_chunk_cap(chunk->cls);
+
+                memcpy(chunk->data, buf, n);
+                chunk->len = n;
+                sockem_dir_enq(dir, chunk, now, delay);
+
+                buf += n;
+                len -= n;
+        }
+
+        return 0;
+}
+
+
+/**
+ * @brief Pause \p dir's input until the pool has memory again,
+ *        see sockem_wrkr_unstarve().
+ */
+static void sockem_dir_starve (struct sockem_dir *dir) {
+        sockem_dir_set_events(dir, 0);
+
+        if (!dir->starved) {
+                TAILQ_INSERT_TAIL(&dir->skm->wrkr->starved, dir, slink);
+                dir->starved = 1;
+        }
+}
+
+
+/**
+ * @brief Drop all chunks on \p dir's delay line.
+ */
+static void sockem_dir_purge (struct sockem_dir *dir) {
+        struct sockem_chunk *chunk;
+
+        sockem_dir_link_mark(dir, SOCKEM_LINK_BUSY, 0);
+        sockem_dir_link_mark(dir, SOCKEM_LINK_WAIT, 0);
+
+        while ((chunk = TAILQ_FIRST(&dir->q))) {
+                TAILQ_REMOVE(&dir->q, chunk, link);
+                sockem_chunk_free(chunk);
+        }
+
+        if (dir->qlen > 0) {
+                SOCKEM_STAT_ADD(dir->st.dropped, dir->qlen);
+                SOCKEM_STAT_ADD(dir->skm->wrkr->st[dir->idx].dropped,
+                                dir->qlen);
+                sockem_dir_stat_queued(dir, -(int64_t)dir->qlen);
+        }
+        __atomic_store_n(&dir->qlen, 0, __ATOMIC_RELAXED);
+
+        sockem_timer_stop(&dir->skm->wrkr->wheel, &dir->tmr);
+
+        if (dir->starved) {
+                TAILQ_REMOVE(&dir->skm->wrkr->starved, dir, slink);
+                dir->starved = 0;
+        }
+}
+
+
+/**
+ * @brief Send up to \p len bytes gathered from the \p iovcnt buffers at
+ *        \p iov to \p dir's non-blocking output socket with a single
+ *        writev(), or gather them for sending on the worker's io_uring,
+ *        in which case the buffers must remain valid until
+ *        sockem_uring_flush().
+ *
+ * If the socket is full the direction waits for it to become writable,
+ * see sockem_dir_owait().
+ *
+ * @returns the number of bytes sent or gathered, or -1 on error.
+ */
+static ssize_t sockem_dir_outputv (struct sockem_dir *dir,
+                                   const struct iovec *iov, int iovcnt,
+                                   size_t len) {
+        ssize_t r;
+
+#ifdef WITH_IO_URING
+        /* Captured sends must not come up short after the fact */
+        if (dir->skm->wrkr->uring && !dir->skm->inproc && !sockem_pcap_on())
+                return sockem_uring_sendv(dir->skm->wrkr, dir, iov, iovcnt,
+                                          len);
+#endif
+        if (dir->skm->inproc) {
+                /* The dup() of the application socket shares its
+                 * O_NONBLOCK flag. */
+                struct msghdr msg = { .msg_iov = (struct iovec *)iov,
+                                      .msg_iovlen = (size_t)iovcnt };
+                r = sendmsg(dir->ofd, &msg, MSG_DONTWAIT|MSG_NOSIGNAL);
+        } else
+                r = writev(dir->ofd, iov, iovcnt);
+        if (r == -1) {
+                int serr = socket_errno();
+                if (serr != EAGAIN && serr != EWOULDBLOCK)
+                        return -1;
+                r = 0;
+        }
+
+        if (r > 0)
+                sockem_dir_stat_fwd(dir, r);
+        if ((size_t)r < len)
+                sockem_dir_owait(dir, 1);
+
+        return r;
+}
+
+
+/**
+ * @brief Send up to \p len bytes from \p buf, see sockem_dir_outputv().
+ */
+static ssize_t sockem_dir_output (struct sockem_dir *dir, const void *buf,
+                                  size_t len) {
+        struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+        return sockem_dir_outputv(dir, &iov, 1, len);
+}
+
+
+/**
+ * @brief Free a chunk removed from a delay line, deferred till after the
+ *        next sockem_uring_flush() if it may be referenced by a pending
+ *        io_uring send.
+ */
+static void sockem_chunk_destroy (struct sockem_wrkr *wrkr,
+                                  struct sockem_chunk *chunk) {
+#ifdef WITH_IO_URING
+        if (wrkr->uring) {
+                TAILQ_INSERT_TAIL(&wrkr->uring->done, chunk, link);
+                return;
+        }
+#else
+        (void)wrkr;
+#endif
+        sockem_chunk_free(chunk);
+}
+
+
+/**
+ * @brief Account a datagram on \p dir dropped by loss emulation or
+ *        rejected by the output socket.
+ */
+static void sockem_dir_stat_lost (struct sockem_dir *dir) {
+        SOCKEM_STAT_ADD(dir->st.lost, 1);
+        SOCKEM_STAT_ADD(dir->skm->wrkr->st[dir->idx].lost, 1);
+}
+
+
+/**
+ * @brief Send the worker's batch of gathered datagrams to \p dir's
+ *        output socket with sendmmsg() and free their chunks.
+ *
+ * Sends do not block: as on a congested network, datagrams that do not
+ * fit the receiver, or are rejected by it, e.g., with ECONNREFUSED
+ * following an ICMP port unreachable, are lost.
+ *
+ * @returns 0 on success or -1 on error.
+ */
+static int sockem_dgram_flush (struct sockem_dir *dir) {
+        struct sockem_dgram *dg = dir->skm->wrkr->dgram;
+        int i = 0, j;
+        int r = 0;
+
+        while (i < dg->ocnt) {
+                int n = sendmmsg(dir->ofd, dg->out + i, dg->ocnt - i,
+                                 MSG_DONTWAIT);
+                if (n == -1) {
+                        int serr = socket_errno();
+                        if (serr == EINTR)
+                                continue;
+                        if (serr == EBADF || serr == ENOTSOCK ||
+                            serr == ENOTCONN || serr == EPIPE) {
+                                r = -1;
+                                break;
+                        }
+                        /* Skip the failed datagram */
+                        sockem_dir_stat_lost(dir);
+                        n = 1;
+                } else {
+                        for (j = i ; j < i + n ; j++)
+                                sockem_dir_stat_fwd(dir, dg->out[j].msg_len);
+                        if (sockem_pcap_on()) {
+                                sockem_ts_t now = sockem_clock();
+
+                                for (j = i ; j < i + n ; j++)
+                                        sockem_dir_pcap(
+                                                dir,
+                                                dg->oiov[j].iov_base,
+                                                dg->out[j].msg_len, now);
+                        }
+                }
+                i += n;
+        }
+
+        for (i = 0 ; i < dg->ocnt ; i++)
+                if (dg->ochunk[i])
+                        sockem_chunk_free(dg->ochunk[i]);
+        dg->ocnt = 0;
+
+        return r;
+}
+
+
+/**
+ * @brief Gather datagram \p buf of \p len bytes for sending to \p dir's
+ *        output socket by sockem_dgram_flush(), which frees its \p chunk,
+ *        if not NULL. The batch is sent right away when full.
+ *
+ * @returns 0 on success or -1 on error.
+ */
+static int sockem_dgram_out (struct sockem_dir *dir,
+                             struct sockem_chunk *chunk,
+                             void *buf, size_t len) {
+        struct sockem_dgram *dg = dir->skm->wrkr->dgram;
+        int i = dg->ocnt++;
+
+        dg->oiov[i].iov_base = buf;
+        dg->oiov[i].iov_len = len;
+        dg->ochunk[i] = chunk;
+
+        if (dg->ocnt == SOCKEM_DGRAM_BATCH)
+                return sockem_dgram_flush(dir);
+
+        return 0;
+}
+
+
+/**
+ * @returns how many of the \p len bytes at the head of a delay line chunk
+ *          may be sent with \p avail tokens from \p dir's shaper of
+ *          \p max bytes, 0 if throttled.
+ *
+ * Datagrams are sent whole once a bucket's worth of tokens is available,
+ * overdrawing the shaper, and streams are released in whole segments of
+ * the segsz key, unless a segment does not fit the bucket.
+ */
+static size_t sockem_dir_grant (const struct sockem_dir *dir, size_t len,
+                                size_t avail, size_t max) {
+        size_t segsz = (size_t)dir->skm->use.segsz;
+
+        if (dir->skm->dgram)
+                return avail >= SOCKEM_MIN(len, max) ? len : 0;
+
+        if (len <= avail)
+                return len;
+
+        if (segsz > 1 && segsz <= max)
+                return avail - avail % segsz;
+
+        return avail;
+}
+
+
+/**
+ * @brief Remove \p chunk, which has been sent, from the head of
+ *        \p dir's delay line.
+ */
+static void sockem_dir_deq (struct sockem_dir *dir,
+                            struct sockem_chunk *chunk, sockem_ts_t now) {
+        sockem_dir_hist_record(dir, SOCKEM_HIST_ACHIEVED, now - chunk->ts);
+        SOCKEM_EV(RELEASE, release, dir, chunk->len, now - chunk->ts);
+
+        TAILQ_REMOVE(&dir->q, chunk, link);
+        __atomic_store_n(&dir->qlen, dir->qlen - chunk->len,
+                         __ATOMIC_RELAXED);
+        sockem_dir_stat_queued(dir, -(int64_t)chunk->len);
+
+        if (TAILQ_EMPTY(&dir->q))
+                sockem_dir_link_mark(dir, SOCKEM_LINK_BUSY, 0);
+}
+
+
+/**
+ * @brief Send all chunks on \p dir's delay line that are due at \p now,
+ *        as far as the throughput shaper and the output socket permit.
+ *
+ * Chunks due together are sent with a single writev() of up to
+ * SOCKEM_OUT_IOVS chunks, datagrams in one sendmmsg() batch.
+ *
+ * @returns the time at which the next chunk is due or the shaper
+ *          permits sending more, 0 if the delay line is empty,
+ *          or -1 on error.
+ */
+static sockem_ts_t sockem_dir_release (struct sockem_dir *dir,
+                                       sockem_ts_t now) {
+        struct sockem_chunk *chunk;
+        sockem_ts_t next = 0;
+        int rate = sockem_dir_rate(dir);
+        int burst = sockem_dir_burst(dir);
+        struct sockem_link_dir *ld =
+                dir->link ? &dir->link->dir[dir->idx] : NULL;
+        int lrate = ld ? __atomic_load_n(&ld->rate, __ATOMIC_RELAXED) : 0;
+        int fair = 0;
+        int dgram = dir->skm->dgram;
+        int whole = dgram || dir->skm->use.segsz > 1;
+        int stop = 0;
+
+        if (lrate > 0) {
+                /* Equal share among the link's backlogged members */
+                int busy = __atomic_load_n(&ld->members[SOCKEM_LINK_BUSY],
+                                           __ATOMIC_RELAXED);
+                fair = busy > 1 ? SOCKEM_MAX(lrate / busy, 1) : lrate;
+        }
+
+        while (!stop && (chunk = TAILQ_FIRST(&dir->q))) {
+                struct iovec iov[SOCKEM_OUT_IOVS];
+                int iovcnt = 0;
+                size_t total = 0;
+                ssize_t r;
+
+                /* Gather what may be sent now */
+                while (chunk && iovcnt < SOCKEM_OUT_IOVS) {
+                        struct sockem_chunk *nxt = TAILQ_NEXT(chunk, link);
+                        size_t len = chunk->len - chunk->of;
+
+                        if (chunk->due > now) {
+                                next = chunk->due;
+                                stop = 1;
+                                break;
+                        }
+
+                        if (rate > 0) {
+                                size_t avail = sockem_tb_refill(&dir->tb, rate,
+                                                                burst, now);
+                                size_t grant = sockem_dir_grant(
+                                        dir, len, avail,
+                                        (size_t)sockem_tb_burst(rate, burst));
+                                if (!grant) {
+                                        /* Throttled */
+                                        next = sockem_tb_due(&dir->tb, rate,
+                                                             burst, len, now);
+                                        if (!dir->thr_ts) {
+                                                dir->thr_ts = now;
+                                                SOCKEM_EV(THROTTLE, throttle,
+                                                          dir, len, next);
+                                        }
+                                        stop = 1;
+                                        break;
+                                }
+                                len = grant;
+                        }
+
+                        if (fair > 0) {
+                                sockem_ts_t due = 0;
+                                size_t avail = sockem_tb_refill(
+                                        &dir->ltb, fair, SOCKEM_LINK_QUANTUM,
+                                        now);
+                                size_t grant = sockem_dir_grant(
+                                        dir, len, avail, SOCKEM_LINK_QUANTUM);
+                                size_t take = 0;
+
+                                if (grant)
+                                        take = sockem_link_take(ld, grant,
+                                                                whole, now,
+                                                                &due);
+                                else
+                                        due = sockem_tb_due(&dir->ltb, fair,
+                                                            SOCKEM_LINK_QUANTUM,
+                                                            len, now);
+                                if (!take) {
+                                        /* Share used up or link saturated */
+                                        if (!dir->thr_ts) {
+                                                dir->thr_ts = now;
+                                                SOCKEM_EV(THROTTLE, throttle,
+                                                          dir, len, due);
+                                        }
+                                        next = due;
+                                        stop = 1;
+                                        break;
+                                }
+                                len = take;
+                        }
+
+                        if (dir->thr_ts) {
+                                SOCKEM_STAT_ADD(dir->st.throttled_us,
+                                                now - dir->thr_ts);
+                                SOCKEM_STAT_ADD(dir->skm->wrkr->
+                                                st[dir->idx].throttled_us,
+                                                now - dir->thr_ts);
+                                dir->thr_ts = 0;
+                        }
+
+                        /* Charged up front, what is not sent is
+                         * refunded below. */
+                        if (rate > 0)
+                                sockem_tb_consume(&dir->tb, len);
+                        if (fair > 0)
+                                sockem_tb_consume(&dir->ltb, len);
+
+                        if (dgram) {
+                                if (!rate && !ld)
+                                        sockem_dir_hist_record(
+                                                dir, SOCKEM_HIST_LATE,
+                                                now - chunk->due);
+                                sockem_dir_deq(dir, chunk, now);
+                                if (sockem_dgram_out(dir, chunk, chunk->data,
+                                                     chunk->len) == -1)
+                                        return -1;
+                                chunk = nxt;
+                                continue;
+                        }
+
+                        iov[iovcnt].iov_base = chunk->data + chunk->of;
+                        iov[iovcnt].iov_len = len;
+                        iovcnt++;
+                        total += len;
+
+                        if (chunk->of + len < chunk->len)
+                                break; /* The rest is throttled */
+                        chunk = nxt;
+                }
+
+                if (!iovcnt)
+                        break;
+
+                if ((r = sockem_dir_outputv(dir, iov, iovcnt, total)) == -1)
+                        return -1;
+
+                if ((size_t)r < total) {
+                        if (rate > 0)
+                                sockem_tb_refund(&dir->tb, total - r);
+                        if (fair > 0)
+                                sockem_tb_refund(&dir->ltb, total - r);
+                }
+
+                /* Advance the delay line by what was sent */
+                while (r > 0) {
+                        size_t n;
+
+                        chunk = TAILQ_FIRST(&dir->q);
+                        n = SOCKEM_MIN((size_t)r, chunk->len - chunk->of);
+
+                        if (!chunk->of && !rate && !ld)
+                                sockem_dir_hist_record(dir, SOCKEM_HIST_LATE,
+                                                       now - chunk->due);
+                        if (sockem_pcap_on())
+                                sockem_dir_pcap(dir, chunk->data + chunk->of,
+                                                n, now);
+
+                        chunk->of += n;
+                        r -= (ssize_t)n;
+                        if (chunk->of < chunk->len)
+                                break;
+
+                        sockem_dir_deq(dir, chunk, now);
+                        sockem_chunk_destroy(dir->skm->wrkr, chunk);
+                }
+
+                if (dir->owait)
+                        break; /* Resumed on EPOLLOUT */
+        }
+
+        if (dgram && sockem_dgram_flush(dir) == -1)
+                return -1;
+
+        /* Resume input when there is room on the delay line again */
+        if (!dir->eof && !dir->events && !dir->starved &&
+            !sockem_dir_qfull(dir) &&
+            !(dir->owait && dir->qlen >= SOCKEM_OUT_HWM)) {
+                if (!sockem_dir_link_full(dir))
+                        sockem_dir_set_events(dir, EPOLLIN);
+                else if (TAILQ_EMPTY(&dir->q)) {
+                        /* Retry once the link group has room,
+                         * claiming a share of it meanwhile. */
+                        sockem_dir_link_update(dir);
+                        sockem_dir_link_mark(dir, SOCKEM_LINK_WAIT, 1);
+                        sockem_dir_starve(dir);
+                }
+        }
+
+        return next;
+}
+
+
+/**
+ * @returns true if \p dir may forward with zero-copy splice():
+ *          no shaping is configured and the delay line is empty.
+ */
+static int sockem_dir_passthru (const struct sockem_dir *dir) {
+        const struct sockem_conf *conf = &dir->skm->use;
+
+        return conf->splice && !dir->nosplice &&
+                !conf->delay && !conf->jitter && !sockem_dir_rate(dir) &&
+                !conf->link && !dir->nstages && TAILQ_EMPTY(&dir->q) &&
+                !sockem_pcap_on();
+}
+
+
+/**
+ * @brief Close \p dir's splice() pipe, if any.
+ */
+static void sockem_dir_pipe_close (struct sockem_dir *dir) {
+        if (dir->pfd[0] == -1)
+                return;
+
+        sockem_close0(dir->pfd[0]);
+        sockem_close0(dir->pfd[1]);
+        dir->pfd[0] = dir->pfd[1] = -1;
+}
+
+
+/**
+ * @brief Move data from \p dir's input socket to its output socket
+ *        through the direction's pipe, without copying it to user space.
+ *
+ * The pipe is drained before returning so forwarding may switch back
+ * to the delay line at any time.
+ *
+ * @returns the number of bytes forwarded, 0 if there was nothing to read
+ *          or splice() is not supported (dir->nosplice is then set),
+ *          or -1 on error or when the sockem should be torn down.
+ */
+static int sockem_splice_fwd (sockem_t *skm, struct sockem_dir *dir) {
+        ssize_t r, wr;
+        size_t left;
+
+        if (dir->pfd[0] == -1) {
+                if (pipe2(dir->pfd, O_CLOEXEC) == -1) {
+                        dir->nosplice = 1;
+                        return 0;
+                }
+                /* Best effort: fit a full recv chunk in the pipe */
+                fcntl(dir->pfd[1], F_SETPIPE_SZ, (int)skm->use.bufsz);
+        }
+
+        r = splice(dir->ifd, NULL, dir->pfd[1], NULL, skm->use.bufsz,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        if (r == -1) {
+                int serr = errno;
+                if (serr == EAGAIN || serr == EWOULDBLOCK)
+                        return 0;
+                if (serr == EINVAL) {
+                        /* Not supported, fall back on recv()/send() */
+                        sockem_dir_pipe_close(dir);
+                        dir->nosplice = 1;
+                        return 0;
+                }
+                return -1;
+
+        } else if (r == 0) {
+                /* Socket closed */
+                return -1;
+        }
+
+        SOCKEM_EV(RECV, recv, dir, r, 0);
+
+        for (left = r ; left > 0 ; left -= wr) {
+                wr = splice(dir->pfd[0], NULL, dir->ofd, NULL, left,
+                            SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+                if (wr == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        break;
+                if (wr <= 0)
+                        return -1;
+        }
+
+        if ((size_t)r > left)
+                sockem_dir_stat_fwd(dir, r - left);
+
+        if (left > 0) {
+                /* Output socket is full: move the rest of the pipe
+                 * to the delay line. */
+                struct sockem_chunk *after = NULL;
+
+                while (left > 0) {
+                        ssize_t n = read(dir->pfd[0], skm->wrkr->buf,
+                                         SOCKEM_MIN(left, SOCKEM_CHUNK_MAX));
+                        if (n <= 0)
+                                return -1;
+                        if (sockem_dir_unsent(dir, skm->wrkr->buf, n,
+                                              &after) == -1)
+                                return -1;
+                        left -= n;
+                }
+                sockem_dir_owait(dir, 1);
+        }
+
+        return r;
+}
+
+
+/**
+ * @brief Handle end of input on \p dir: tear down once the delay line
+ *        is drained.
+ *
+ * @returns 0, or -1 if the sockem should be torn down right away.
+ */
+static int sockem_dir_eof (struct sockem_dir *dir) {
+        if (TAILQ_EMPTY(&dir->q))
+                return -1;
+        dir->eof = 1;
+        sockem_dir_set_events(dir, 0);
+        return 0;
+}
+
+
+/**
+ * @returns the delay in microseconds to apply to data read now:
+ *          the configured delay plus a jitter sampled from the
+ *          configured distribution.
+ */
+static int64_t sockem_dir_delay (struct sockem_dir *dir) {
+        sockem_t *skm = dir->skm;
+        const struct sockem_conf *conf = &skm->use;
+        /* In-process the peer's data is not delayed: the sends
+         * take the round-trip instead. */
+        int64_t delay = (int64_t)conf->delay * 1000 * (skm->inproc ? 2 : 1);
+        uint64_t r;
+        int64_t v;   /* jitter in SOCKEM_DIST_SCALE units */
+
+        if (!conf->jitter)
+                return delay;
+
+        r = sockem_rand(skm);
+
+        switch (conf->jitter_dist)
+        {
+        case SOCKEM_DIST_NORMAL:
+                v = sockem_dist_normal[r >> (64 - SOCKEM_DIST_BITS)];
+                break;
+        case SOCKEM_DIST_PARETO:
+                v = sockem_dist_pareto[r >> (64 - SOCKEM_DIST_BITS)];
+                break;
+        case SOCKEM_DIST_PARETONORMAL:
+                /* Weighted sum of independent draws, rescaled to
+                 * unit variance: (n + 3p) / sqrt(1 + 9) */
+                v = (sockem_dist_normal[r >> (64 - SOCKEM_DIST_BITS)] +
+                     3 * (int64_t)sockem_dist_pareto[(r >> 20) &
+                                                     (SOCKEM_DIST_SIZE - 1)])
+                        * 1000 / 3162;
+                break;
+        default:
+                /* Uniform in [-SCALE, SCALE) */
+                v = (int64_t)(r >> (64 - 14)) - SOCKEM_DIST_SCALE;
+                break;
+        }
+
+        delay += (int64_t)conf->jitter * 1000 * v / SOCKEM_DIST_SCALE;
+
+        return delay > 0 ? delay : 0;
+}
+
+
+/**
+ * @brief Run \p dir's single impairment stage, see sockem_dir_impair().
+ */
+static int64_t sockem_dir_impair1 (struct sockem_dir *dir, char *buf,
+                                   size_t len, sockem_ts_t now,
+                                   int64_t delay) {
+        sockem_t *skm = dir->skm;
+        int i = dir->stages[0];
+
+        if (sockem_stagetab.stages[i]->chunk(skm, dir->idx,
+                                             dir->stage_state[i],
+                                             skm->use.stage[i], buf, len,
+                                             now, &delay) == -1 &&
+            skm->dgram)
+                return -1;
+
+        return delay > 0 ? delay : 0;
+}
+
+
+/**
+ * @brief Run \p dir's impairment stages in order, see sockem_dir_impair().
+ */
+static int64_t sockem_dir_impairn (struct sockem_dir *dir, char *buf,
+                                   size_t len, sockem_ts_t now,
+                                   int64_t delay) {
+        sockem_t *skm = dir->skm;
+        int j;
+
+        for (j = 0 ; j < dir->nstages ; j++) {
+                int i = dir->stages[j];
+
+                if (sockem_stagetab.stages[i]->chunk(skm, dir->idx,
+                                                     dir->stage_state[i],
+                                                     skm->use.stage[i],
+                                                     buf, len, now,
+                                                     &delay) == -1 &&
+                    skm->dgram)
+                        return -1;
+        }
+
+        return delay > 0 ? delay : 0;
+}
+
+
+/**
+ * @brief Apply \p dir's impairment stages to the \p len bytes at \p buf
+ *        read at \p now, which are to be released after \p delay
+ *        microseconds. Free of cost while no stage is enabled.
+ *
+ * @returns the delay to apply, or -1 if the datagram is to be dropped.
+ */
+static __inline int64_t sockem_dir_impair (struct sockem_dir *dir,
+                                           char *buf, size_t len,
+                                           sockem_ts_t now, int64_t delay) {
+        if (!dir->nstages)
+                return delay;
+
+        return dir->impair(dir, buf, len, now, delay);
+}
+
+
+/**
+ * @brief Select the impairment stages that \p skm's config enables,
+ *        and the routine running them, for both directions.
+ *        Stages that fail to allocate their state are skipped.
+ */
+static void sockem_dir_stages (sockem_t *skm) {
+        int cnt = __atomic_load_n(&sockem_stagetab.cnt, __ATOMIC_ACQUIRE);
+        int d, i;
+
+        for (d = 0 ; d < 2 ; d++) {
+                struct sockem_dir *dir = &skm->dir[d];
+
+                dir->nstages = 0;
+                for (i = 0 ; i < cnt ; i++) {
+                        const sockem_stage_t *stage =
+                                sockem_stagetab.stages[i];
+
+                        if (!skm->use.stage[i])
+                                continue;
+                        if (stage->size && !dir->stage_state[i] &&
+                            !(dir->stage_state[i] = calloc(1, stage->size)))
+                                continue;
+                        dir->stages[dir->nstages++] = i;
+                }
+
+                dir->impair = dir->nstages == 1 ?
+                        sockem_dir_impair1 : sockem_dir_impairn;
+        }
+}
+
+
+/**
+ * @returns true if data read on \p dir must go through the delay line.
+ */
+static int sockem_dir_shaped (const struct sockem_dir *dir) {
+        const struct sockem_conf *conf = &dir->skm->use;
+
+        return conf->delay || conf->jitter || sockem_dir_rate(dir) ||
+                conf->link || dir->nstages || !TAILQ_EMPTY(&dir->q);
+}
+
+
+/**
+ * @returns true if data read on \p dir is put on the delay line as
+ *          segments of the segsz key, each with its own delay.
+ *          Without jitter all segments of a read would be due together.
+ */
+static int sockem_dir_segmented (const struct sockem_dir *dir) {
+        const struct sockem_conf *conf = &dir->skm->use;
+
+        return conf->segsz > 0 && conf->jitter && !dir->skm->dgram;
+}
+
+
+/**
+ * @brief Copy \p len bytes read at \p now from \p buf to \p dir's
+ *        delay line as segments of the segsz key, sampling the delay
+ *        of each, see sockem_dir_enq().
+ * @returns 0 on success or -1 if out of memory, see sockem_dir_unsent().
+ */
+static int sockem_dir_enq_segs (struct sockem_dir *dir, char *buf,
+                                size_t len, sockem_ts_t now) {
+        size_t segsz = (size_t)dir->skm->use.segsz;
+
+        while (len > 0) {
+                size_t n = SOCKEM_MIN(len, segsz);
+
+                if (sockem_dir_enq_copy(dir, buf, n, now,
+                                        sockem_dir_impair(
+                                                dir, buf, n, now,
+                                                sockem_dir_delay(dir))) == -1) {
+                        sockem_dir_stat_dropped(dir, len - n);
+                        return -1;
+                }
+
+                buf += n;
+                len -= n;
+        }
+
+        return 0;
+}
+
+
+/**
+ * @brief Forward \p len bytes read from \p dir's input socket to its
+ *        output socket, directly if there is no shaping, else through
+ *        the delay line.
+ *
+ * @returns the number of bytes forwarded, or -1 on error.
+ */
+static int sockem_dir_input (struct sockem_dir *dir, void *buf, size_t len) {
+        sockem_ts_t now;
+
+        SOCKEM_EV(RECV, recv, dir, len, 0);
+
+        if (!sockem_dir_shaped(dir)) {
+                struct sockem_chunk *after = NULL;
+                ssize_t r = sockem_dir_output(dir, buf, len);
+
+                if (r == -1)
+                        return -1;
+                if (r > 0 && sockem_pcap_on())
+                        sockem_dir_pcap(dir, buf, r, sockem_clock());
+                if ((size_t)r < len &&
+                    sockem_dir_unsent(dir, (const char *)buf + r,
+                                      len - r, &after) == -1)
+                        return -1;
+                return (int)len;
+        }
+
+        now = sockem_clock();
+        if (sockem_dir_segmented(dir)) {
+                if (sockem_dir_enq_segs(dir, buf, len, now) == -1)
+                        return -1;
+        } else if (sockem_dir_enq_copy(dir, buf, len, now,
+                                       sockem_dir_impair(
+                                               dir, buf, len, now,
+                                               sockem_dir_delay(dir))) == -1)
+                return -1;
+
+        return (int)len;
+}
+
+
+/**
+ * @brief Read from \p dir's input socket directly into a pool chunk
+ *        and put it on the delay line.
+ *
+ * @returns the number of bytes read, or -1 on error or when the
+ *          sockem should be torn down.
+ */
+static int sockem_recv_enq (sockem_t *skm, struct sockem_dir *dir) {
+        struct sockem_chunk *chunk, *small;
+        sockem_ts_t now;
+        ssize_t r;
+
+        if (!(chunk = sockem_chunk_new(skm->use.bufsz, 0))) {
+                sockem_dir_starve(dir);
+                return 0;
+        }
+
+        r = recv(dir->ifd, chunk->data,
+                 SOCKEM_MIN(skm->use.bufsz, sockem_chunk_cap(chunk->cls)),
+                 MSG_DONTWAIT);
+        if (r <= 0) {
+                int serr = socket_errno();
+
+                sockem_chunk_free(chunk);
+
+                if (r == 0)
+                        return sockem_dir_eof(dir); /* Socket closed */
+                else if (serr == EAGAIN || serr == EWOULDBLOCK)
+                        return 0;
+                return -1;
+        }
+
+        SOCKEM_EV(RECV, recv, dir, r, 0);
+
+        now = sockem_clock();
+
+        if (sockem_dir_segmented(dir) && (size_t)r > (size_t)skm->use.segsz) {
+                int err = sockem_dir_enq_segs(dir, chunk->data, r, now);
+                sockem_chunk_free(chunk);
+                return err == -1 ? -1 : (int)r;
+        }
+
+        /* Right-size the chunk, e.g., for small request traffic.
+         * If the smaller chunk cannot be had keep the large one. */
+        if (chunk->cls > 0 && (size_t)r <= sockem_chunk_cap(chunk->cls - 1) &&
+            (small = sockem_chunk_new(r, 0))) {
+                if ((size_t)r <= sockem_chunk_cap(small->cls)) {
+                        memcpy(small->data, chunk->data, r);
+                        sockem_chunk_free(chunk);
+                        chunk = small;
+                } else
+                        sockem_chunk_free(small);
+        }
+
+        chunk->len = r;
+        sockem_dir_enq(dir, chunk, now,
+                       sockem_dir_impair(dir, chunk->data, r, now,
+                                         sockem_dir_delay(dir)));
+
+        return (int)r;
+}
+
+
+/**
+ * @brief Read a batch of datagrams from \p dir's input socket with
+ *        recvmmsg() and forward them, directly with sendmmsg() if there
+ *        is no shaping, else as one delay line chunk per datagram.
+ *
+ * @returns the number of datagrams read, or -1 on error.
+ */
+static int sockem_dgram_fwd (struct sockem_wrkr *wrkr, sockem_t *skm,
+                             struct sockem_dir *dir) {
+        struct sockem_dgram *dg = wrkr->dgram;
+        int shaped = sockem_dir_shaped(dir);
+        sockem_ts_t now;
+        int n, i;
+
+        if (shaped && !sockem_mem_avail()) {
+                sockem_dir_starve(dir);
+                return 0;
+        }
+
+        n = recvmmsg(dir->ifd, dg->in, SOCKEM_DGRAM_BATCH, MSG_DONTWAIT,
+                     NULL);
+        if (n == -1) {
+                int serr = socket_errno();
+                /* ECONNREFUSED: pending ICMP error, cleared by the read */
+                if (serr == EAGAIN || serr == EWOULDBLOCK ||
+                    serr == EINTR || serr == ECONNREFUSED)
+                        return 0;
+                return -1;
+        }
+
+        now = sockem_clock();
+
+        for (i = 0 ; i < n ; i++) {
+                char *buf = dg->bufs + ((size_t)i * SOCKEM_DGRAM_MAX);
+                size_t len = dg->in[i].msg_len;
+                struct sockem_chunk *chunk;
+                int64_t delay;
+
+                SOCKEM_EV(RECV, recv, dir, len, 0);
+
+                if (sockem_rand_pm(skm, skm->use.loss)) {
+                        sockem_dir_stat_lost(dir);
+                        continue;
+                }
+
+                if (!shaped) {
+                        if (sockem_dgram_out(dir, NULL, buf, len) == -1)
+                                return -1;
+                        continue;
+                }
+
+                /* Reordered datagrams skip the delay, overtaking the
+                 * datagrams on the delay line. */
+                delay = sockem_dir_impair(dir, buf, len, now,
+                                          sockem_rand_pm(skm,
+                                                         skm->use.reorder) ?
+                                          0 : sockem_dir_delay(dir));
+                if (delay == -1) {
+                        sockem_dir_stat_lost(dir);
+                        continue;
+                }
+
+                /* Keep datagrams whole, past the pool's chunk sizes
+                 * and memory cap if need be: they have been read. */
+                chunk = sockem_chunk_new(len, 1);
+                if (chunk && chunk->cls != -1 &&
+                    len > sockem_chunk_cap(chunk->cls)) {
+                        sockem_chunk_free(chunk);
+                        if ((chunk = malloc(sizeof(*chunk) + len)))
+                                chunk->cls = -1;
+                }
+                if (!chunk) {
+                        sockem_dir_stat_lost(dir);
+                        continue;
+                }
+                memcpy(chunk->data, buf, len);
+                chunk->len = len;
+
+                sockem_dir_enq(dir, chunk, now, delay);
+        }
+
+        if (!shaped && sockem_dgram_flush(dir) == -1)
+                return -1;
+
+        return n;
+}
+
+
+/**
+ * @brief Serve socket events \p events on datagram direction \p dir.
+ *
+ * @returns 0 on success or -1 if the sockem should be torn down.
+ */
+static int sockem_dgram_serve (struct sockem_wrkr *wrkr, sockem_t *skm,
+                               struct sockem_dir *dir, uint32_t events) {
+        if (events & EPOLLHUP)
+                return -1;
+
+        if (events & EPOLLERR) {
+                /* Pending ICMP error, e.g., port unreachable:
+                 * the datagram was lost, but the socket remains usable. */
+                int err;
+                socklen_t len = sizeof(err);
+                getsockopt(dir->ifd, SOL_SOCKET, SO_ERROR, &err, &len);
+        }
+
+        if (!(events & EPOLLIN))
+                return 0;
+
+        return sockem_dgram_fwd(wrkr, skm, dir) == -1 ? -1 : 0;
+}
+
+
+/**
+ * @brief Read from \p dir's input socket and forward to its output socket.
+ *
+ * @returns the number of bytes read, or -1 on error or when the
+ *          sockem should be torn down.
+ */
+static int sockem_recv_fwd (struct sockem_wrkr *wrkr, sockem_t *skm,
+                            struct sockem_dir *dir) {
+        ssize_t r;
+
+        if (sockem_dir_passthru(dir)) {
+                r = sockem_splice_fwd(skm, dir);
+                if (r != 0 || !dir->nosplice)
+                        return r;
+        }
+
+        if (sockem_dir_shaped(dir))
+                return sockem_recv_enq(skm, dir);
+
+        r = recv(dir->ifd, wrkr->buf,
+                 SOCKEM_MIN(skm->use.bufsz, SOCKEM_CHUNK_MAX), MSG_DONTWAIT);
+        if (r == -1) {
+                int serr = socket_errno();
+                if (serr == EAGAIN || serr == EWOULDBLOCK)
+                        return 0;
+                return -1;
+
+        } else if (r == 0) {
+                /* Socket closed */
+                return sockem_dir_eof(dir);
+        }
+
+        return sockem_dir_input(dir, wrkr->buf, r);
+}
+
+
+/**
+ * @brief Close all sockets and unsets ->run.
+ * @remark Preserves caller's errno.
+ * @remark lock must be held.
+ */
+static void sockem_close_all (sockem_t *skm) {
+        int serr = socket_errno();
+
+        if (skm->ls != -1) {
+                sockem_close0(skm->ls);
+                skm->ls = -1;
+        }
+
+        if (skm->cs != -1) {
+                sockem_close0(skm->cs);
+                skm->cs = -1;
+        }
+
+        if (skm->ps != -1) {
+                sockem_close0(skm->ps);
+                skm->ps = -1;
+        }
+
+        skm->run = SOCKEM_TERM;
+
+        errno = serr;
+}
+
+
+
+/**
+ * @brief Allocate a worker's datagram batches.
+ * @returns the batches, or NULL on failure.
+ */
+static struct sockem_dgram *sockem_dgram_new (void) {
+        struct sockem_dgram *dg;
+        int i;
+
+        if (!(dg = calloc(1, sizeof(*dg))))
+                return NULL;
+
+        /* Slot pages are only touched as large datagrams arrive */
+        if (!(dg->bufs = malloc((size_t)SOCKEM_DGRAM_BATCH *
+                                SOCKEM_DGRAM_MAX))) {
+                free(dg);
+                return NULL;
+        }
+
+        for (i = 0 ; i < SOCKEM_DGRAM_BATCH ; i++) {
+                dg->iiov[i].iov_base = dg->bufs +
+                        ((size_t)i * SOCKEM_DGRAM_MAX);
+                dg->iiov[i].iov_len = SOCKEM_DGRAM_MAX;
+                dg->in[i].msg_hdr.msg_iov = &dg->iiov[i];
+                dg->in[i].msg_hdr.msg_iovlen = 1;
+                dg->out[i].msg_hdr.msg_iov = &dg->oiov[i];
+                dg->out[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        return dg;
+}
+
+
+/**
+ * @brief Queue \p skm for attention by its worker and wake the worker up.
+ * @remark skm lock must be held.
+ */
+static void sockem_wrkr_post (sockem_t *skm) {
+        struct sockem_wrkr *wrkr = skm->wrkr;
+        uint64_t one = 1;
+
+        mtx_lock(&wrkr->lock);
+        if (!skm->pending) {
+                TAILQ_INSERT_TAIL(&wrkr->pending, skm, plink);
+                skm->pending = 1;
+        }
+        mtx_unlock(&wrkr->lock);
+
+        /* EAGAIN means the counter is saturated and the worker is
+         * bound to wake up anyway. */
+        while (write(wrkr->wakefd, &one, sizeof(one)) == -1 &&
+               errno == EINTR)
+                ;
+}
+
+
+/**
+ * @brief Start serving \p skm: register its listen socket with the
+ *        worker's epoll set, the app connection is accepted
+ *        by sockem_serve() once it arrives. A TCP peer is connected
+ *        first, see sockem_conn_timer().
+ * @remark skm lock must be held.
+ */
+static void sockem_attach (struct sockem_wrkr *wrkr, sockem_t *skm) {
+        struct epoll_event ev = { .events = EPOLLIN,
+                                  .data.ptr = &skm->dir[SOCKEM_TX] };
+
+        skm->run = SOCKEM_RUN;
+        skm->attached = 1;
+        skm->use = skm->conf;
+        skm->use_gen = skm->conf_gen;
+        sockem_rand_seed(skm);
+        sockem_dir_stages(skm);
+
+        if (skm->dgram && !wrkr->dgram &&
+            !(wrkr->dgram = sockem_dgram_new())) {
+                skm->run = SOCKEM_TERM;
+
+        } else if (skm->conn) {
+                /* Forwarding starts once the peer is connected */
+                if (skm->cs == -1 &&
+                    epoll_ctl(wrkr->epfd, EPOLL_CTL_ADD, skm->ls,
+                              &ev) == -1) {
+                        fprintf(stderr,
+                                "%% sockem: epoll_ctl(%d) failed: %s\n",
+                                skm->ls, strerror(errno));
+                        skm->run = SOCKEM_TERM;
+                } else
+                        sockem_conn_arm(wrkr, skm,
+                                        sockem_dir_delay(&skm->dir[
+                                                         SOCKEM_TX]));
+
+        } else if (skm->inproc) {
+                if (sockem_inproc_attach(wrkr, skm) == -1)
+                        skm->run = SOCKEM_TERM;
+
+        } else if (skm->cs != -1) {
+                /* socketpair(): app-side socket is already connected */
+                if (sockem_attach_dirs(wrkr, skm) == -1)
+                        skm->run = SOCKEM_TERM;
+
+        } else if (epoll_ctl(wrkr->epfd, EPOLL_CTL_ADD, skm->ls, &ev) == -1) {
+                fprintf(stderr, "%% sockem: epoll_ctl(%d) failed: %s\n",
+                        skm->ls, strerror(errno));
+                skm->run = SOCKEM_TERM;
+        }
+
+        LIST_INSERT_HEAD(&wrkr->sockems, skm, wlink);
+}
+
+
+/**
+ * @brief Stop serving \p skm and close its sockets.
+ *
+ * The sockem is handed back to sockem_close() by sockem_wrkr_reap()
+ * once the worker no longer references it.
+ *
+ * @remark skm lock must be held.
+ */
+static void sockem_detach (struct sockem_wrkr *wrkr, sockem_t *skm) {
+        int fds[] = { skm->ls, skm->cs, skm->ps };
+        struct sockem_chunk *chunk;
+        int i;
+
+        SOCKEM_EV(CLOSE, close, &skm->dir[SOCKEM_TX], 0,
+                  __atomic_load_n(&skm->closed, __ATOMIC_RELAXED));
+
+        if (sockem_pcap_on())
+                sockem_pcap_fin(skm);
+
+        /* Explicitly remove the sockets from the epoll set since
+         * forked children may keep them open. */
+        for (i = 0 ; i < 3 ; i++)
+                if (fds[i] != -1)
+                        epoll_ctl(wrkr->epfd, EPOLL_CTL_DEL, fds[i], NULL);
+
+        sockem_close_all(skm);
+
+        for (i = 0 ; i < 2 ; i++) {
+                sockem_dir_purge(&skm->dir[i]);
+                sockem_dir_pipe_close(&skm->dir[i]);
+        }
+
+        /* In-process sends not yet on the delay line */
+        while ((chunk = TAILQ_FIRST(&skm->inq))) {
+                TAILQ_REMOVE(&skm->inq, chunk, link);
+                SOCKEM_STAT_ADD(skm->dir[SOCKEM_TX].st.dropped, chunk->len);
+                SOCKEM_STAT_ADD(wrkr->st[SOCKEM_TX].dropped, chunk->len);
+                sockem_chunk_free(chunk);
+        }
+        skm->inqlen = 0;
+
+        LIST_REMOVE(skm, wlink);
+        LIST_INSERT_HEAD(&wrkr->dead, skm, wlink);
+
+        sockem_timer_stop(&wrkr->wheel, &skm->ctmr);
+
+        if (skm->dying) {
+                LIST_REMOVE(skm, dlink);
+                skm->dying = 0;
+        }
+
+        mtx_lock(&wrkr->lock);
+        if (skm->pending) {
+                TAILQ_REMOVE(&wrkr->pending, skm, plink);
+                skm->pending = 0;
+        }
+        wrkr->cnt--;
+        mtx_unlock(&wrkr->lock);
+
+        /* A dedicated worker exits with its sockem. */
+        if (wrkr->dedicated)
+                wrkr->term = 1;
+}
+
+
+/**
+ * @brief Detach \p skm following a forwarding failure or socket close.
+ *
+ * Detaching is deferred to sockem_wrkr_terms() at the end of the worker
+ * iteration since events and I/O for the sockem may still be pending.
+ */
+static void sockem_term (struct sockem_wrkr *wrkr, sockem_t *skm) {
+        if (skm->dying)
+                return;
+
+        skm->dying = 1;
+        LIST_INSERT_HEAD(&wrkr->dying, skm, dlink);
+}
+
+
+/**
+ * @brief Detach sockems scheduled for termination by sockem_term().
+ */
+static void sockem_wrkr_terms (struct sockem_wrkr *wrkr) {
+        sockem_t *skm;
+
+        while ((skm = LIST_FIRST(&wrkr->dying))) {
+                __atomic_store_n(&skm->closed, 1, __ATOMIC_RELAXED);
+                SOCKEM_STAT_ADD(wrkr->closed, 1);
+                mtx_lock(&skm->lock);
+                sockem_detach(wrkr, skm);
+                mtx_unlock(&skm->lock);
+        }
+}
+
+
+/**
+ * @brief Hand back detached sockems to sockem_close().
+ */
+static void sockem_wrkr_reap (struct sockem_wrkr *wrkr) {
+        sockem_t *skm;
+
+        while ((skm = LIST_FIRST(&wrkr->dead))) {
+                LIST_REMOVE(skm, wlink);
+                mtx_lock(&skm->lock);
+                skm->run = SOCKEM_DONE;
+                cnd_broadcast(&skm->cnd);
+                mtx_unlock(&skm->lock);
+        }
+}
+
+
+/**
+ * @brief Accept the application's connection on the listen socket
+ *        and start forwarding between \c cs and \c ps.
+ * @returns 0 on success or -1 on failure.
+ * @remark skm lock must be held.
+ */
+static int sockem_accept_app (struct sockem_wrkr *wrkr, sockem_t *skm) {
+
+        /* Accept connection from the application socket */
+        skm->cs = sockem_accept0(skm->ls, NULL, NULL, SOCK_NONBLOCK);
+        if (skm->cs == -1) {
+                int serr = socket_errno();
+                if (serr == EAGAIN || serr == EWOULDBLOCK)
+                        return 0;
+                fprintf(stderr, "%% sockem: accept(%d) failed: %s\n",
+                        skm->ls, strerror(serr));
+                return -1;
+        }
+
+        /* Listen socket is no longer needed */
+        epoll_ctl(wrkr->epfd, EPOLL_CTL_DEL, skm->ls, NULL);
+        sockem_close0(skm->ls);
+        skm->ls = -1;
+
+        if (skm->conn)
+                return 0; /* Attached by sockem_conn_done() */
+
+        return sockem_attach_dirs(wrkr, skm);
+}
+
+
+/**
+ * @brief Start forwarding between the app-side socket and the peer socket.
+ * @returns 0 on success or -1 on error.
+ */
+static int sockem_attach_dirs (struct sockem_wrkr *wrkr, sockem_t *skm) {
+        struct epoll_event ev = { .events = EPOLLIN };
+        int i;
+
+        skm->dir[SOCKEM_TX].ifd = skm->dir[SOCKEM_RX].ofd = skm->cs;
+        skm->dir[SOCKEM_RX].ifd = skm->dir[SOCKEM_TX].ofd = skm->ps;
+
+        for (i = 0 ; i < 2 ; i++) {
+                ev.data.ptr = &skm->dir[i];
+                skm->dir[i].events = skm->dir[i].epev = ev.events;
+                if (epoll_ctl(wrkr->epfd, EPOLL_CTL_ADD,
+                              skm->dir[i].ifd, &ev) == -1) {
+                        fprintf(stderr,
+                                "%% sockem: epoll_ctl(%d) failed: %s\n",
+                                skm->dir[i].ifd, strerror(errno));
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+
+/**
+ * @brief Start forwarding the sends of in-process \p skm to its dup()
+ *        of the application socket, which is monitored for errors only
+ *        and, while the tx direction waits for it, for writability.
+ * @returns 0 on success or -1 on error.
+ */
+static int sockem_inproc_attach (struct sockem_wrkr *wrkr, sockem_t *skm) {
+        struct epoll_event ev = { .events = 0,
+                                  .data.ptr = &skm->dir[SOCKEM_RX] };
+
+        skm->dir[SOCKEM_TX].ifd = skm->dir[SOCKEM_RX].ofd = -1;
+        skm->dir[SOCKEM_RX].ifd = skm->dir[SOCKEM_TX].ofd = skm->ps;
+
+        /* Input is taken from .inq by sockem_inproc_drain() */
+        skm->dir[SOCKEM_TX].events = EPOLLIN;
+
+        if (epoll_ctl(wrkr->epfd, EPOLL_CTL_ADD, skm->ps, &ev) == -1) {
+                fprintf(stderr, "%% sockem: epoll_ctl(%d) failed: %s\n",
+                        skm->ps, strerror(errno));
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/**
+ * @brief Schedule \p skm's next peer connect step in \p delay
+ *        microseconds, see sockem_conn_timer().
+ */
+static void sockem_conn_arm (struct sockem_wrkr *wrkr, sockem_t *skm,
+                             int64_t delay) {
+        sockem_timer_start(&wrkr->wheel, &skm->ctmr, sockem_clock() + delay);
+}
+
+
+/**
+ * @brief Complete \p skm's peer connect with \p err (0 on success),
+ *        waking up a blocking sockem_connect() waiting for it, and
+ *        start forwarding if the app connection is already accepted.
+ *
+ * An app connection that completed ahead of a failed peer connect,
+ * as a non-blocking one does, is reset as the peer would.
+ *
+ * @returns 0 on success or -1 if the connect failed.
+ */
+static int sockem_conn_done (struct sockem_wrkr *wrkr, sockem_t *skm,
+                             int err) {
+        skm->conn = SOCKEM_CONN_NONE;
+
+        mtx_lock(&skm->lock);
+        skm->conn_err = err;
+        cnd_broadcast(&skm->cnd);
+        mtx_unlock(&skm->lock);
+
+        if (err) {
+                struct linger lin = { .l_onoff = 1, .l_linger = 0 };
+
+                if (skm->use.debug)
+                        fprintf(stderr, "%% sockem: peer connect failed: "
+                                "%s\n", strerror(err));
+                if (skm->cs != -1)
+                        setsockopt(skm->cs, SOL_SOCKET, SO_LINGER,
+                                   &lin, sizeof(lin));
+                return -1;
+        }
+
+        if (skm->cs == -1)
+                return 0; /* Attached by sockem_accept_app() */
+
+        return sockem_attach_dirs(wrkr, skm);
+}
+
+
+/**
+ * @brief The SYN reached the peer: start the real connect().
+ * @returns 0 on success or -1 if the connect failed.
+ */
+static int sockem_conn_syn (struct sockem_wrkr *wrkr, sockem_t *skm) {
+        struct epoll_event ev = { .events = EPOLLOUT,
+                                  .data.ptr = &skm->dir[SOCKEM_RX] };
+
+        if (sockem_connect0(skm->ps, (struct sockaddr *)&skm->paddr,
+                            skm->paddrlen) == 0) {
+                skm->conn = SOCKEM_CONN_ACK;
+                sockem_conn_arm(wrkr, skm,
+                                sockem_dir_delay(&skm->dir[SOCKEM_RX]));
+                return 0;
+        }
+
+        if (errno != EINPROGRESS)
+                return sockem_conn_done(wrkr, skm, errno);
+
+        if (epoll_ctl(wrkr->epfd, EPOLL_CTL_ADD, skm->ps, &ev) == -1) {
+                int err = errno;
+                fprintf(stderr, "%% sockem: epoll_ctl(%d) failed: %s\n",
+                        skm->ps, strerror(err));
+                return sockem_conn_done(wrkr, skm, err);
+        }
+
+        skm->conn = SOCKEM_CONN_WAIT;
+
+        return 0;
+}
+
+
+/**
+ * @brief The peer socket's connect() completed: the connection is
+ *        established, or refused, once the peer's answer has made
+ *        its way back.
+ * @returns 0 on success or -1 on failure.
+ */
+static int sockem_conn_serve (struct sockem_wrkr *wrkr, sockem_t *skm) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        /* Re-added for input by sockem_attach_dirs() */
+        epoll_ctl(wrkr->epfd, EPOLL_CTL_DEL, skm->ps, NULL);
+
+        if (getsockopt(skm->ps, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+                return sockem_conn_done(wrkr, skm, errno);
+
+        skm->conn = SOCKEM_CONN_ACK;
+        skm->conn_fail = err;
+        sockem_conn_arm(wrkr, skm, sockem_dir_delay(&skm->dir[SOCKEM_RX]));
+
+        return 0;
+}
+
+
+/**
+ * @brief Run \p skm's peer connect step that is due.
+ *
+ * The peer socket's connect() is started one tx delay after the
+ * sockem is attached, and the connection is considered established
+ * one rx delay after it completed, so that the handshake takes
+ * the emulated round-trip.
+ */
+static void sockem_conn_timer (struct sockem_wrkr *wrkr, sockem_t *skm) {
+        int r;
+
+        if (skm->dying ||
+            __atomic_load_n(&skm->run, __ATOMIC_ACQUIRE) != SOCKEM_RUN)
+                return;
+
+        if (skm->conn == SOCKEM_CONN_SYN)
+                r = sockem_conn_syn(wrkr, skm);
+        else
+                r = sockem_conn_done(wrkr, skm, skm->conn_fail);
+
+        if (r == -1)
+                sockem_term(wrkr, skm);
+}
+
+
+#ifdef WITH_IO_URING
+/**
+ * @brief Forward the data read by the current batch of READ_FIXEDs.
+ */
+static void sockem_uring_reads (struct sockem_wrkr *wrkr) {
+        struct sockem_uring *ur = wrkr->uring;
+        int cnt = ur->slot_cnt;
+        uint64_t ud;
+        int res;
+        int i;
+
+        if (!cnt)
+                return;
+
+        if (sockem_uring_submit(ur, 1) == -1)
+                fprintf(stderr, "%% sockem: io_uring_enter() failed: %s\n",
+                        strerror(errno));
+
+        /* The preceding flush reaped all sends, these are all reads. */
+        while (sockem_uring_cqe(ur, &ud, &res))
+                ur->slot_res[ud] = res;
+
+        for (i = 0 ; i < cnt ; i++) {
+                struct sockem_dir *dir = ur->slot_dir[i];
+                sockem_t *skm = dir->skm;
+                int r;
+
+                res = ur->slot_res[i];
+
+                if (skm->dying || res == -EAGAIN)
+                        continue;
+                else if (res < 0)
+                        r = -1;
+                else if (res == 0)
+                        r = sockem_dir_eof(dir);
+                else
+                        r = sockem_dir_input(dir,
+                                             ur->slots +
+                                             (i * SOCKEM_URING_SLOTSZ), res);
+
+                if (r == -1)
+                        sockem_term(wrkr, skm);
+        }
+}
+
+
+/**
+ * @brief Queue a READ_FIXED from \p dir's input socket into a registered
+ *        read buffer, processed by sockem_uring_reads().
+ */
+static void sockem_uring_recv (struct sockem_wrkr *wrkr,
+                               struct sockem_dir *dir) {
+        struct sockem_uring *ur = wrkr->uring;
+        struct io_uring_sqe *sqe;
+        size_t len = dir->skm->use.bufsz;
+        int slot;
+
+        if (sockem_dir_shaped(dir) && !sockem_mem_avail()) {
+                sockem_dir_starve(dir);
+                return;
+        }
+
+        if (ur->slot_cnt == SOCKEM_URING_SLOTS ||
+            !(sqe = sockem_uring_sqe(ur))) {
+                /* Forward the current batch to free up buffers */
+                sockem_uring_reads(wrkr);
+                sockem_uring_flush(wrkr);
+                sqe = sockem_uring_sqe(ur);
+        }
+
+        slot = ur->slot_cnt++;
+        ur->slot_dir[slot] = dir;
+        ur->slot_res[slot] = -EAGAIN;
+
+        if (len > SOCKEM_URING_SLOTSZ)
+                len = SOCKEM_URING_SLOTSZ;
+
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = dir->ifd;
+        sqe->addr = (uint64_t)(uintptr_t)(ur->slots +
+                                          (slot * SOCKEM_URING_SLOTSZ));
+        sqe->len = (unsigned)len;
+        sqe->off = 0;
+        sqe->buf_index = (uint16_t)slot;
+        sqe->rw_flags = RWF_NOWAIT;
+        sqe->user_data = (uint64_t)slot;
+}
+#endif
+
+
+/**
+ * @brief Update the forwarder's copy of \p skm's config if it changed.
+ *        Lock-free unless it did.
+ */
+static void sockem_conf_refresh (sockem_t *skm) {
+        unsigned int gen = __atomic_load_n(&skm->conf_gen, __ATOMIC_ACQUIRE);
+
+        if (gen == skm->use_gen)
+                return;
+
+        mtx_lock(&skm->lock);
+        skm->use = skm->conf;
+        skm->use_gen = skm->conf_gen;
+        mtx_unlock(&skm->lock);
+
+        sockem_dir_stages(skm);
+        skm->trace_next = 0; /* re-apply trace to the new .use */
+}
+
+
+/**
+ * @brief Move the data sent by the application on in-process \p skm to
+ *        the tx delay line, delayed from the time of each send.
+ *        A shutdown() is passed on once all of it has been sent.
+ */
+static void sockem_inproc_drain (struct sockem_wrkr *wrkr, sockem_t *skm) {
+        struct sockem_dir *dir = &skm->dir[SOCKEM_TX];
+        struct sockem_chunk_q q = TAILQ_HEAD_INITIALIZER(q);
+        struct sockem_chunk *chunk;
+        size_t moved = 0;
+        int eof, err = 0;
+
+        mtx_lock(&skm->lock);
+        TAILQ_CONCAT(&q, &skm->inq, link);
+        mtx_unlock(&skm->lock);
+
+        sockem_conf_refresh(skm);
+
+        while ((chunk = TAILQ_FIRST(&q))) {
+                TAILQ_REMOVE(&q, chunk, link);
+                moved += chunk->len;
+
+                if (err) {
+                        /* The stream is broken, see below */
+                        sockem_dir_stat_dropped(dir, chunk->len);
+                        sockem_chunk_free(chunk);
+                        continue;
+                }
+
+                SOCKEM_EV(RECV, recv, dir, chunk->len, 0);
+
+                if (sockem_dir_segmented(dir) &&
+                    chunk->len > (size_t)skm->use.segsz) {
+                        err = sockem_dir_enq_segs(dir, chunk->data,
+                                                  chunk->len,
+                                                  chunk->ts) == -1;
+                        sockem_chunk_free(chunk);
+                } else
+                        sockem_dir_enq(dir, chunk, chunk->ts,
+                                       sockem_dir_impair(
+                                               dir, chunk->data, chunk->len,
+                                               chunk->ts,
+                                               sockem_dir_delay(dir)));
+        }
+
+        /* Taken off .inqlen only once on the delay line, so that
+         * senders always account for it. End of input waits for
+         * data sent meanwhile. */
+        mtx_lock(&skm->lock);
+        skm->inqlen -= moved;
+        eof = skm->ineof && TAILQ_EMPTY(&skm->inq);
+        mtx_unlock(&skm->lock);
+
+        if (err) {
+                sockem_term(wrkr, skm);
+                return;
+        }
+
+        if (eof && !dir->eof) {
+                dir->eof = 1;
+                sockem_dir_sched(dir, wrkr->wheel.now);
+        }
+}
+
+
+/**
+ * @brief Wake up the send() overloads waiting for room on in-process
+ *        \p skm's delay line.
+ *
+ * A refused non-blocking send is told by poking the socket's write
+ * space callback: setting TCP_NOTSENT_LOWAT wakes up pollers of the
+ * application socket, giving edge-triggered epoll ones an EPOLLOUT
+ * edge to retry on.
+ */
+static void sockem_inproc_wake (sockem_t *skm) {
+        int full, lowat;
+        socklen_t len = sizeof(lowat);
+
+        /* Pairs with sockem_inproc_sendv(): either the sender sees
+         * the room released or it is seen waiting here. */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&skm->inwait, __ATOMIC_RELAXED) &&
+            !__atomic_load_n(&skm->infull, __ATOMIC_RELAXED))
+                return;
+
+        mtx_lock(&skm->lock);
+        if (skm->inwait)
+                cnd_broadcast(&skm->cnd);
+        full = skm->infull;
+        __atomic_store_n(&skm->infull, 0, __ATOMIC_RELAXED);
+        mtx_unlock(&skm->lock);
+
+        if (full &&
+            getsockopt(skm->ps, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                       &lowat, &len) == 0)
+                setsockopt(skm->ps, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                           &lowat, len);
+}
+
+
+/**
+ * @brief Serve socket events \p events on direction \p dir's input socket.
+ * @remark skm lock must NOT be held.
+ */
+static void sockem_serve (struct sockem_wrkr *wrkr, struct sockem_dir *dir,
+                          uint32_t events) {
+        sockem_t *skm = dir->skm;
+        int r = 0;
+
+        if (skm->dying)
+                return;
+
+        if (__atomic_load_n(&skm->run, __ATOMIC_ACQUIRE) != SOCKEM_RUN)
+                return; /* Termination is pending, let the worker
+                         * detach it. */
+
+        sockem_conf_refresh(skm);
+        if (skm->use.trace)
+                sockem_trace_step(skm, sockem_clock());
+
+        if (skm->conn == SOCKEM_CONN_WAIT && dir->idx == SOCKEM_RX)
+                r = sockem_conn_serve(wrkr, skm);
+        else if (skm->cs == -1 && !skm->inproc)
+                r = sockem_accept_app(wrkr, skm);
+        else if (skm->dgram)
+                r = sockem_dgram_serve(wrkr, skm, dir, events);
+        else if (events & (EPOLLHUP|EPOLLERR))
+                r = -1;
+        else {
+                /* The input socket is the opposite direction's output
+                 * socket: its pending output is sent by
+                 * sockem_wrkr_timers(). */
+                if (events & EPOLLOUT)
+                        sockem_dir_owait(&skm->dir[!dir->idx], 0);
+
+                if (events & EPOLLIN) {
+#ifdef WITH_IO_URING
+                        if (wrkr->uring) {
+                                sockem_uring_recv(wrkr, dir);
+                                return;
+                        }
+#endif
+                        r = sockem_recv_fwd(wrkr, skm, dir);
+                }
+        }
+
+        if (r == -1)
+                sockem_term(wrkr, skm);
+}
+
+
+/**
+ * @brief Release \p dir's due chunks and schedule its next release.
+ */
+static void sockem_dir_timer (struct sockem_wrkr *wrkr,
+                              struct sockem_dir *dir, sockem_ts_t now) {
+        sockem_ts_t due;
+
+        if (dir->skm->dying || dir->owait)
+                return; /* Resumed on EPOLLOUT */
+
+        sockem_conf_refresh(dir->skm);
+        sockem_trace_step(dir->skm, now);
+
+        due = sockem_dir_release(dir, now);
+
+        if (due == -1 || (due == 0 && dir->eof && !dir->owait)) {
+                if (due == 0 && dir->skm->inproc)
+                        /* Pass on the application's shutdown() */
+                        sockem_shutdown0(dir->ofd, SHUT_WR);
+                sockem_term(wrkr, dir->skm);
+        } else if (due > 0 && !dir->owait)
+                sockem_dir_sched(dir, due);
+
+        if (dir->skm->inproc)
+                sockem_inproc_wake(dir->skm);
+}
+
+
+/**
+ * @brief Run the worker's expired timers: release due delay lines
+ *        and take peer connect steps.
+ */
+static void sockem_wrkr_timers (struct sockem_wrkr *wrkr) {
+        struct sockem_wheel *w = &wrkr->wheel;
+        struct sockem_timer *tmr;
+        sockem_ts_t now = sockem_clock();
+
+        sockem_wheel_expire(w, now);
+
+        while ((tmr = LIST_FIRST(&w->due))) {
+                sockem_timer_stop(w, tmr);
+                if (tmr->kind == SOCKEM_TMR_RELEASE)
+                        sockem_dir_timer(wrkr, tmr->arg, now);
+                else
+                        sockem_conn_timer(wrkr, tmr->arg);
+        }
+}
+
+
+/**
+ * @brief Arm the worker's timerfd for the timing wheel's next step.
+ *
+ * @returns the epoll_wait() timeout: \p timeout, 0 if the step is due
+ *          already, or lowered to the step without a timerfd.
+ */
+static int sockem_wrkr_arm (struct sockem_wrkr *wrkr, int timeout) {
+        struct itimerspec its = { .it_interval = { 0, 0 } };
+        sockem_ts_t now;
+        sockem_ts_t next;
+        int lvl, slot;
+        int ms;
+
+        next = sockem_wheel_next(&wrkr->wheel, &lvl, &slot);
+        if (next == -1 || next == wrkr->tfd_due)
+                return timeout;
+
+        now = sockem_clock();
+        if (next <= now)
+                return 0;
+
+        if (wrkr->tfd != -1) {
+                its.it_value.tv_sec = next / 1000000;
+                its.it_value.tv_nsec = (next % 1000000) * 1000;
+                if (timerfd_settime(wrkr->tfd, TFD_TIMER_ABSTIME,
+                                    &its, NULL) == 0) {
+                        wrkr->tfd_due = next;
+                        return timeout;
+                }
+        }
+
+        /* Round up to not wake up before the step is due. */
+        ms = (int)((next - now + 999) / 1000);
+        if (timeout == -1 || timeout > ms)
+                timeout = ms;
+
+        return timeout;
+}
+
+
+/**
+ * @brief Resume input on starved directions if the pool has memory again.
+ *
+ * @returns \p timeout, lowered to retry starved directions shortly.
+ */
+static int sockem_wrkr_unstarve (struct sockem_wrkr *wrkr, int timeout) {
+        struct sockem_dir *dir, *next;
+
+        if (TAILQ_EMPTY(&wrkr->starved))
+                return timeout;
+
+        if (!sockem_mem_avail()) {
+                if (timeout == -1 || timeout > SOCKEM_STARVED_MS)
+                        timeout = SOCKEM_STARVED_MS;
+                return timeout;
+        }
+
+        for (dir = TAILQ_FIRST(&wrkr->starved) ; dir ; dir = next) {
+                next = TAILQ_NEXT(dir, slink);
+
+                if (sockem_dir_link_full(dir)) {
+                        if (timeout == -1 || timeout > SOCKEM_STARVED_MS)
+                                timeout = SOCKEM_STARVED_MS;
+                        continue;
+                }
+
+                TAILQ_REMOVE(&wrkr->starved, dir, slink);
+                dir->starved = 0;
+                sockem_dir_link_mark(dir, SOCKEM_LINK_WAIT, 0);
+                if (!dir->eof && !sockem_dir_input_full(dir))
+                        sockem_dir_set_events(dir, EPOLLIN);
+        }
+
+        return timeout;
+}
+
+
+/**
+ * @brief Attach newly assigned and detach closing sockems.
+ */
+static void sockem_wrkr_serve_pending (struct sockem_wrkr *wrkr) {
+        sockem_t *skm;
+
+        mtx_lock(&wrkr->lock);
+        while ((skm = TAILQ_FIRST(&wrkr->pending))) {
+                int drain;
+
+                TAILQ_REMOVE(&wrkr->pending, skm, plink);
+                skm->pending = 0;
+                mtx_unlock(&wrkr->lock);
+
+                mtx_lock(&skm->lock);
+                if (skm->run == SOCKEM_START)
+                        sockem_attach(wrkr, skm);
+                else if (skm->run == SOCKEM_TERM && !skm->attached) {
+                        /* Closed before it was attached */
+                        skm->attached = 1;
+                        LIST_INSERT_HEAD(&wrkr->sockems, skm, wlink);
+                }
+                if (skm->run == SOCKEM_TERM)
+                        sockem_detach(wrkr, skm);
+                /* In-process sends, see sockem_inproc_sendv() */
+                drain = skm->inproc && skm->run == SOCKEM_RUN && !skm->dying;
                 mtx_unlock(&skm->lock);
-                r = poll(pfd, 2, waittime);
 
-                if (r == -1)
+                if (drain)
+                        sockem_inproc_drain(wrkr, skm);
+
+                mtx_lock(&wrkr->lock);
+        }
+        mtx_unlock(&wrkr->lock);
+}
+
+
+/**
+ * @brief Set up or drop \p wrkr's event ring as the events key
+ *        was set or unset.
+ */
+static void sockem_wrkr_events (struct sockem_wrkr *wrkr) {
+        struct sockem_evring *ring = wrkr->ev;
+
+        if (ring) {
+                /* Dropped under the lock the drainer pins rings with */
+                mtx_lock(&sockem_gstats.lock);
+                __atomic_store_n(&wrkr->ev, NULL, __ATOMIC_RELAXED);
+                sockem_evring_free(ring);
+                mtx_unlock(&sockem_gstats.lock);
+                return;
+        }
+
+        /* Pages are only touched as the ring fills up */
+        if (!(ring = malloc(sizeof(*ring))))
+                return;
+        ring->head = ring->tail = 0;
+        ring->lost = ring->lost_seen = 0;
+        ring->pinned = ring->orphan = 0;
+
+        mtx_lock(&sockem_gstats.lock);
+        __atomic_store_n(&wrkr->ev, ring, __ATOMIC_RELAXED);
+        mtx_unlock(&sockem_gstats.lock);
+}
+
+
+/**
+ * @brief sockem internal forwarder worker thread
+ */
+static void *sockem_run (void *arg) {
+        struct sockem_wrkr *wrkr = arg;
+        struct epoll_event evs[64];
+        int timeout = -1;
+
+        /* Pinned first, for the pages of wrkr->buf and the io_uring
+         * this thread touches to be placed on its node */
+        if (wrkr->pinned) {
+                unsigned int cpu, node;
+                int err = pthread_setaffinity_np(pthread_self(),
+                                                 sizeof(wrkr->cpus),
+                                                 &wrkr->cpus);
+                if (err)
+                        fprintf(stderr, "%% sockem: failed to set forwarder "
+                                "CPU affinity: %s\n", strerror(err));
+                else if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+                        sockem_mem_node = (int)(node % SOCKEM_MEM_NODES);
+        }
+        sockem_mem_mag = &wrkr->mag;
+
+#ifdef WITH_IO_URING
+        /* Falls back on recv()/send() if io_uring is not available */
+        if (__atomic_load_n(&sockem_pool.io_uring, __ATOMIC_RELAXED))
+                wrkr->uring = sockem_uring_new();
+#endif
+
+        while (!wrkr->term) {
+                int r;
+                int i;
+
+                if (__builtin_expect(__atomic_load_n(&sockem_events.on,
+                                                     __ATOMIC_RELAXED) !=
+                                     !!wrkr->ev, 0))
+                        sockem_wrkr_events(wrkr);
+
+                r = epoll_wait(wrkr->epfd, evs, 64, timeout);
+                if (r == -1 && errno != EINTR)
+                        break;
+
+                for (i = 0 ; i < r ; i++) {
+                        if (!evs[i].data.ptr) {
+                                uint64_t cnt;
+                                /* Wakeup by sockem_wrkr_post() */
+                                while (read(wrkr->wakefd, &cnt,
+                                            sizeof(cnt)) == -1 &&
+                                       errno == EINTR)
+                                        ;
+                                continue;
+                        }
+
+                        if (evs[i].data.ptr == &wrkr->wheel) {
+                                uint64_t cnt;
+                                /* Wheel step, see sockem_wrkr_arm() */
+                                while (read(wrkr->tfd, &cnt,
+                                            sizeof(cnt)) == -1 &&
+                                       errno == EINTR)
+                                        ;
+                                wrkr->tfd_due = 0;
+                                continue;
+                        }
+
+                        sockem_serve(wrkr, evs[i].data.ptr, evs[i].events);
+                }
+
+#ifdef WITH_IO_URING
+                if (wrkr->uring)
+                        sockem_uring_reads(wrkr);
+#endif
+
+                sockem_wrkr_timers(wrkr);
+
+                timeout = sockem_wrkr_unstarve(wrkr, -1);
+
+#ifdef WITH_IO_URING
+                if (wrkr->uring)
+                        sockem_uring_flush(wrkr);
+#endif
+
+                sockem_wrkr_terms(wrkr);
+
+                sockem_wrkr_serve_pending(wrkr);
+
+                sockem_wrkr_reap(wrkr);
+
+                timeout = sockem_wrkr_arm(wrkr, timeout);
+
+                sockem_mag_flush(&wrkr->mag);
+        }
+
+        /* Chunks freed from here on go straight to the pool */
+        sockem_mem_mag = NULL;
+
+        return NULL;
+}
+
+
+/**
+ * @brief Add \p src counters to \p dst.
+ */
+static void sockem_dir_stats_add (struct sockem_dir_stats *dst,
+                                  const struct sockem_dir_stats *src) {
+        dst->bytes        += SOCKEM_STAT_GET(src->bytes);
+        dst->chunks       += SOCKEM_STAT_GET(src->chunks);
+        dst->queued       += SOCKEM_STAT_GET(src->queued);
+        dst->throttled_us += SOCKEM_STAT_GET(src->throttled_us);
+        dst->dropped      += SOCKEM_STAT_GET(src->dropped);
+        dst->lost         += SOCKEM_STAT_GET(src->lost);
+}
+
+
+/**
+ * @brief Destroy worker, its thread must have exited.
+ */
+static void sockem_wrkr_destroy (struct sockem_wrkr *wrkr) {
+        int i;
+
+        if (wrkr->ev)
+                sockem_events_drain(wrkr);
+
+        /* Retain the worker's totals for the process-wide stats */
+        mtx_lock(&sockem_gstats.lock);
+        LIST_REMOVE(wrkr, glink);
+        for (i = 0 ; i < 2 ; i++)
+                sockem_dir_stats_add(i == SOCKEM_TX ?
+                                     &sockem_gstats.retired.tx :
+                                     &sockem_gstats.retired.rx,
+                                     &wrkr->st[i]);
+        sockem_gstats.retired.closed += wrkr->closed;
+        if (wrkr->ev)
+                sockem_evring_free(wrkr->ev);
+        for (i = 0 ; i < 2 ; i++) {
+                int j;
+
+                if (!wrkr->hist[i])
+                        continue;
+                for (j = 0 ; j < SOCKEM_HIST__CNT ; j++)
+                        sockem_hist_merge(&sockem_hist_get(
+                                                  &sockem_gstats.
+                                                  retired_hist[i])[j],
+                                          &wrkr->hist[i][j]);
+                free(wrkr->hist[i]);
+        }
+        mtx_unlock(&sockem_gstats.lock);
+
+#ifdef WITH_IO_URING
+        if (wrkr->uring)
+                sockem_uring_destroy(wrkr->uring);
+#endif
+        if (wrkr->tfd != -1)
+                sockem_close0(wrkr->tfd);
+        sockem_close0(wrkr->wakefd);
+        sockem_close0(wrkr->epfd);
+        mtx_destroy(&wrkr->lock);
+        if (wrkr->dgram) {
+                free(wrkr->dgram->bufs);
+                free(wrkr->dgram);
+        }
+        munmap(wrkr->buf, SOCKEM_CHUNK_MAX);
+        free(wrkr);
+}
+
+
+/**
+ * @brief Create a new worker and start its thread, running on \p cpus
+ *        if not NULL.
+ * @returns the new worker or NULL on failure.
+ */
+static struct sockem_wrkr *sockem_wrkr_new (int dedicated,
+                                            const cpu_set_t *cpus) {
+        struct sockem_wrkr *wrkr;
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+
+        if (!(wrkr = calloc(1, sizeof(*wrkr))))
+                return NULL;
+
+        /* Mapped rather than malloc()ed for its pages to be first
+         * touched, and thus placed, on the worker's node once it has
+         * set its affinity, see sockem_run(). */
+        wrkr->buf = mmap(NULL, SOCKEM_CHUNK_MAX, PROT_READ|PROT_WRITE,
+                         MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (wrkr->buf == MAP_FAILED) {
+                free(wrkr);
+                return NULL;
+        }
+
+        wrkr->dedicated = dedicated;
+        if (cpus) {
+                wrkr->cpus = *cpus;
+                wrkr->pinned = 1;
+        }
+        mtx_init(&wrkr->lock);
+        TAILQ_INIT(&wrkr->pending);
+        LIST_INIT(&wrkr->sockems);
+        LIST_INIT(&wrkr->dying);
+        LIST_INIT(&wrkr->dead);
+        TAILQ_INIT(&wrkr->starved);
+        sockem_wheel_init(&wrkr->wheel, sockem_clock());
+
+        wrkr->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (wrkr->epfd == -1) {
+                mtx_destroy(&wrkr->lock);
+                munmap(wrkr->buf, SOCKEM_CHUNK_MAX);
+                free(wrkr);
+                return NULL;
+        }
+
+        wrkr->wakefd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (wrkr->wakefd == -1) {
+                sockem_close0(wrkr->epfd);
+                mtx_destroy(&wrkr->lock);
+                munmap(wrkr->buf, SOCKEM_CHUNK_MAX);
+                free(wrkr);
+                return NULL;
+        }
+
+        /* Without a timerfd the wheel is stepped at the millisecond
+         * granularity of the epoll_wait() timeout. */
+        wrkr->tfd = timerfd_create(CLOCK_MONOTONIC,
+                                   TFD_CLOEXEC|TFD_NONBLOCK);
+        ev.data.ptr = &wrkr->wheel;
+        if (wrkr->tfd != -1 &&
+            epoll_ctl(wrkr->epfd, EPOLL_CTL_ADD, wrkr->tfd, &ev) == -1) {
+                sockem_close0(wrkr->tfd);
+                wrkr->tfd = -1;
+        }
+        ev.data.ptr = NULL;
+
+        mtx_lock(&sockem_gstats.lock);
+        LIST_INSERT_HEAD(&sockem_gstats.wrkrs, wrkr, glink);
+        mtx_unlock(&sockem_gstats.lock);
+
+        if (epoll_ctl(wrkr->epfd, EPOLL_CTL_ADD, wrkr->wakefd, &ev) == -1 ||
+            thrd_create(&wrkr->thrd, sockem_run, wrkr) != 0) {
+                sockem_wrkr_destroy(wrkr);
+                return NULL;
+        }
+
+        return wrkr;
+}
+
+
+/**
+ * @brief Get the CPUs of the cpus key for pool worker \p idx, one of
+ *        them round-robin, or all of them if \p idx is -1.
+ * @returns \p set, or NULL if the key is not set.
+ * @remark sockem_pool.lock must be held.
+ */
+static cpu_set_t *sockem_pool_cpus (int idx, cpu_set_t *set) {
+        int cpu, n = 0;
+
+        if (!sockem_pool.cpu_cnt)
+                return NULL;
+
+        if (idx == -1) {
+                *set = sockem_pool.cpus;
+                return set;
+        }
+
+        idx %= sockem_pool.cpu_cnt;
+        CPU_ZERO(set);
+        for (cpu = 0 ; cpu < CPU_SETSIZE ; cpu++) {
+                if (CPU_ISSET(cpu, &sockem_pool.cpus) && n++ == idx) {
+                        CPU_SET(cpu, set);
+                        break;
+                }
+        }
+
+        return set;
+}
+
+
+/**
+ * @brief Confine helper thread \p thrd, such as the SOCKEM_STATS
+ *        thread, to the CPUs of the cpus key, if set.
+ */
+static __attribute__((unused)) void sockem_pool_confine (thrd_t thrd) {
+        cpu_set_t set;
+        int pin;
+
+        mtx_lock(&sockem_pool.lock);
+        pin = sockem_pool_cpus(-1, &set) != NULL;
+        mtx_unlock(&sockem_pool.lock);
+
+        if (pin)
+                pthread_setaffinity_np(thrd, sizeof(set), &set);
+}
+
+
+/**
+ * @brief Write \p len bytes at \p buf to the events file, dropping them
+ *        on error.
+ * @remark sockem_events.lock must be held.
+ */
+static void sockem_events_write (const void *buf, size_t len) {
+        while (len > 0) {
+                ssize_t r = write(sockem_events.fd, buf, len);
+
+                if (r == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return;
+                }
+                buf = (const char *)buf + r;
+                len -= (size_t)r;
+        }
+}
+
+
+/**
+ * @brief Move the events on \p ring to the events file, followed by
+ *        a SOCKEM_EV_LOST event if events were dropped meanwhile.
+ * @remark sockem_events.lock must be held and \p ring pinned.
+ */
+static void sockem_events_drain_ring (struct sockem_evring *ring) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+        uint64_t lost = __atomic_load_n(&ring->lost, __ATOMIC_RELAXED);
+
+        while (tail != head) {
+                size_t i = (size_t)(tail & (SOCKEM_EV_RING - 1));
+                size_t n = SOCKEM_MIN((size_t)(head - tail),
+                                      SOCKEM_EV_RING - i);
+
+                sockem_events_write(&ring->ev[i], n * sizeof(*ring->ev));
+                tail += n;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        if (lost != ring->lost_seen) {
+                struct sockem_event ev = {
+                        .ts = sockem_clock(),
+                        .fd = -1,
+                        .type = SOCKEM_EV_LOST,
+                        .len = lost - ring->lost_seen
+                };
+
+                sockem_events_write(&ev, sizeof(ev));
+                ring->lost_seen = lost;
+        }
+}
+
+
+/**
+ * @brief Pin \p ring, if not NULL, for draining on \p rings.
+ * @remark sockem_gstats.lock must be held.
+ */
+static void sockem_evring_pin (struct sockem_evring *ring,
+                               struct sockem_evring **rings) {
+        if (!ring)
+                return;
+        ring->pinned = 1;
+        ring->next = *rings;
+        *rings = ring;
+}
+
+
+/**
+ * @brief Free \p ring dropped by its worker, or leave that to the
+ *        drainer if pinned.
+ * @remark sockem_gstats.lock must be held.
+ */
+static void sockem_evring_free (struct sockem_evring *ring) {
+        if (ring->pinned)
+                ring->orphan = 1;
+        else
+                free(ring);
+}
+
+
+/**
+ * @brief Drain \p wrkr's event ring, or all workers' if NULL,
+ *        to the events file.
+ *
+ * The rings are pinned under sockem_gstats.lock and written out
+ * without it, not to hold up workers starting and stats readers
+ * on the disk.
+ *
+ * @remark sockem_events.lock must be held.
+ */
+static void sockem_events_drain0 (struct sockem_wrkr *wrkr) {
+        struct sockem_evring *ring, *rings = NULL;
+
+        mtx_lock(&sockem_gstats.lock);
+        if (wrkr)
+                sockem_evring_pin(__atomic_load_n(&wrkr->ev,
+                                                  __ATOMIC_RELAXED), &rings);
+        else
+                LIST_FOREACH(wrkr, &sockem_gstats.wrkrs, glink)
+                        sockem_evring_pin(__atomic_load_n(&wrkr->ev,
+                                                          __ATOMIC_RELAXED),
+                                          &rings);
+        mtx_unlock(&sockem_gstats.lock);
+
+        for (ring = rings ; ring ; ring = ring->next)
+                sockem_events_drain_ring(ring);
+
+        mtx_lock(&sockem_gstats.lock);
+        while ((ring = rings)) {
+                rings = ring->next;
+                ring->pinned = 0;
+                if (ring->orphan)
+                        free(ring);
+        }
+        mtx_unlock(&sockem_gstats.lock);
+}
+
+static void sockem_events_drain (struct sockem_wrkr *wrkr) {
+        mtx_lock(&sockem_events.lock);
+        if (sockem_events.fd != -1)
+                sockem_events_drain0(wrkr);
+        mtx_unlock(&sockem_events.lock);
+}
+
+static void sockem_events_flush (void) {
+        sockem_events_drain(NULL);
+}
+
+
+/**
+ * @brief Event ring drain thread, exits when tracing is stopped.
+ */
+static void *sockem_events_run (void *arg) {
+        (void)arg;
+
+        while (1) {
+                usleep(SOCKEM_EV_DRAIN_MS * 1000);
+
+                mtx_lock(&sockem_events.lock);
+                if (sockem_events.fd == -1) {
+                        sockem_events.running = 0;
+                        mtx_unlock(&sockem_events.lock);
+                        break;
+                }
+                sockem_events_drain0(NULL);
+                mtx_unlock(&sockem_events.lock);
+        }
+
+        return NULL;
+}
+
+
+/**
+ * @brief Create a new events file at \p path, truncated, for
+ *        sockem_events_set().
+ * @returns the file descriptor or -1 if the file cannot be created.
+ */
+static int sockem_events_open (const char *path) {
+        struct sockem_events_hdr hdr;
+        int fd;
+
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, SOCKEM_EVENTS_MAGIC, sizeof(hdr.magic));
+        hdr.version = SOCKEM_EVENTS_VERSION;
+        hdr.evsize = (uint32_t)sizeof(struct sockem_event);
+
+        if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,
+                       0644)) == -1)
+                return -1;
+        if (write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr)) {
+                sockem_close0(fd);
+                return -1;
+        }
+
+        return fd;
+}
+
+
+/**
+ * @brief Start tracing events to the file \p fd of sockem_events_open(),
+ *        or stop tracing if -1, see the events key.
+ *
+ * Events recorded for a previous file are written to it before
+ * it is closed.
+ */
+static void sockem_events_set (int fd) {
+        int start;
+        thrd_t thrd;
+
+        mtx_lock(&sockem_events.lock);
+        if (sockem_events.fd != -1) {
+                sockem_events_drain0(NULL);
+                sockem_close0(sockem_events.fd);
+        }
+        sockem_events.fd = fd;
+        __atomic_store_n(&sockem_events.on, fd != -1, __ATOMIC_RELAXED);
+
+        if ((start = fd != -1 && !sockem_events.running))
+                sockem_events.running = 1;
+        if (fd != -1 && !sockem_events.atexit) {
+                sockem_events.atexit = 1;
+                atexit(sockem_events_flush);
+        }
+        mtx_unlock(&sockem_events.lock);
+
+        /* Started without the lock since confining the thread takes
+         * sockem_pool.lock. */
+        if (start) {
+                if (thrd_create(&thrd, sockem_events_run, NULL) == 0) {
+                        sockem_pool_confine(thrd);
+                        pthread_detach(thrd);
+                } else {
+                        mtx_lock(&sockem_events.lock);
+                        sockem_events.running = 0;
+                        mtx_unlock(&sockem_events.lock);
+                }
+        }
+}
+
+
+/**
+ * @brief Start writeback of the whole pages of pcap records written since
+ *        the last flush and grow the file ahead of the writers.
+ *
+ * The page being written to is left alone: pages under writeback are
+ * kept stable, which would block the worker writing to it on the disk.
+ * The file is grown with allocated blocks so that workers never fault
+ * in blocks through the mapping, which raises SIGBUS if the file system
+ * is full. Records are dropped instead.
+ *
+ * @remark sockem_pcap.lock must be held.
+ */
+static void sockem_pcap_flush (void) {
+        size_t off = __atomic_load_n(&sockem_pcap.off, __ATOMIC_RELAXED);
+        size_t size = sockem_pcap.size;
+        size_t end = off & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+
+        if (end > sockem_pcap.synced) {
+                sync_file_range(sockem_pcap.fd, (off64_t)sockem_pcap.synced,
+                                (off64_t)(end - sockem_pcap.synced),
+                                SYNC_FILE_RANGE_WRITE);
+                sockem_pcap.synced = end;
+        }
+
+        if (size - off < SOCKEM_PCAP_GROW && size < SOCKEM_PCAP_VMAX) {
+                size_t nsize = SOCKEM_MIN(off + 2 * (size_t)SOCKEM_PCAP_GROW,
+                                          SOCKEM_PCAP_VMAX);
+                if (posix_fallocate(sockem_pcap.fd, (off_t)size,
+                                    (off_t)(nsize - size)) == 0)
+                        __atomic_store_n(&sockem_pcap.size, nsize,
+                                         __ATOMIC_RELEASE);
+        }
+}
+
+
+/**
+ * @brief Stop capturing and complete the pcap file.
+ * @remark sockem_pcap.lock must be held.
+ */
+static void sockem_pcap_stop0 (void) {
+        uint64_t dropped;
+
+        __atomic_store_n(&sockem_pcap.on, 0, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&sockem_pcap.writers, __ATOMIC_ACQUIRE))
+                sched_yield();
+
+        munmap(sockem_pcap.map, SOCKEM_PCAP_VMAX);
+        if (ftruncate(sockem_pcap.fd, (off_t)sockem_pcap.off) == -1)
+                fprintf(stderr, "%% sockem: pcap: failed to truncate "
+                        "file: %s\n", strerror(errno));
+        sockem_close0(sockem_pcap.fd);
+        sockem_pcap.fd = -1;
+
+        if ((dropped = __atomic_exchange_n(&sockem_pcap.dropped, 0,
+                                           __ATOMIC_RELAXED)))
+                fprintf(stderr, "%% sockem: pcap: %"PRIu64" packets not "
+                        "captured: writer fell behind or file full\n",
+                        dropped);
+}
+
+static void sockem_pcap_stop (void) {
+        mtx_lock(&sockem_pcap.lock);
+        if (sockem_pcap.fd != -1)
+                sockem_pcap_stop0();
+        mtx_unlock(&sockem_pcap.lock);
+}
+
+
+/**
+ * @brief pcap flush thread, exits when capture is stopped.
+ */
+static void *sockem_pcap_run (void *arg) {
+        (void)arg;
+
+        while (1) {
+                usleep(SOCKEM_PCAP_FLUSH_MS * 1000);
+
+                mtx_lock(&sockem_pcap.lock);
+                if (sockem_pcap.fd == -1) {
+                        sockem_pcap.running = 0;
+                        mtx_unlock(&sockem_pcap.lock);
+                        break;
+                }
+                sockem_pcap_flush();
+                mtx_unlock(&sockem_pcap.lock);
+        }
+
+        return NULL;
+}
+
+
+/**
+ * @brief Create a new pcap file at \p path, truncated, and map it
+ *        at \p *mapp for sockem_pcap_set().
+ * @returns the file descriptor or -1 if the file cannot be set up.
+ */
+static int sockem_pcap_open (const char *path, char **mapp) {
+        int fd;
+
+        if ((fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) == -1)
+                return -1;
+
+        /* Allocated, see sockem_pcap_flush() */
+        if ((errno = posix_fallocate(fd, 0, 2 * (off_t)SOCKEM_PCAP_GROW)) ||
+            (*mapp = mmap(NULL, SOCKEM_PCAP_VMAX, PROT_READ|PROT_WRITE,
+                          MAP_SHARED|MAP_NORESERVE, fd, 0)) == MAP_FAILED) {
+                sockem_close0(fd);
+                return -1;
+        }
+
+        return fd;
+}
+
+
+/**
+ * @brief Start capturing to the pcap file \p fd mapped at \p map of
+ *        sockem_pcap_open(), or stop capturing if -1, see the pcap key.
+ *
+ * A previous capture is completed first.
+ */
+static void sockem_pcap_set (int fd, char *map) {
+        struct timespec ts;
+        uint8_t *hdr;
+        uint32_t v32;
+        uint16_t v16;
+        int start;
+        thrd_t thrd;
+
+        mtx_lock(&sockem_pcap.lock);
+        if (sockem_pcap.fd != -1)
+                sockem_pcap_stop0();
+
+        if (fd == -1) {
+                mtx_unlock(&sockem_pcap.lock);
+                return;
+        }
+
+        sockem_pcap.fd = fd;
+        sockem_pcap.map = map;
+        sockem_pcap.size = 2 * (size_t)SOCKEM_PCAP_GROW;
+
+        sockem_pcap.snap = __atomic_load_n(&sockem_pcap.snaplen,
+                                           __ATOMIC_RELAXED);
+        if (!sockem_pcap.snap)
+                sockem_pcap.snap = SOCKEM_PCAP_SNAPLEN;
+
+        /* pcap file header, in host byte order */
+        hdr = (uint8_t *)sockem_pcap.map;
+        v32 = 0xa1b2c3d4; /* microsecond timestamps */
+        memcpy(hdr, &v32, 4);
+        v16 = 2;
+        memcpy(hdr + 4, &v16, 2);
+        v16 = 4;
+        memcpy(hdr + 6, &v16, 2);
+        memset(hdr + 8, 0, 8);   /* thiszone, sigfigs */
+        v32 = (uint32_t)sockem_pcap.snap;
+        memcpy(hdr + 16, &v32, 4);
+        v32 = SOCKEM_PCAP_LINKTYPE;
+        memcpy(hdr + 20, &v32, 4);
+
+        sockem_pcap.off = 24;
+        sockem_pcap.synced = 0;
+        sockem_pcap.gen++;
+        if (!sockem_pcap.gen)
+                sockem_pcap.gen++; /* 0 = no flow */
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        sockem_pcap.t0 = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 -
+                sockem_clock();
+
+        __atomic_store_n(&sockem_pcap.on, 1, __ATOMIC_SEQ_CST);
+
+        if ((start = !sockem_pcap.running))
+                sockem_pcap.running = 1;
+        if (!sockem_pcap.atexit) {
+                sockem_pcap.atexit = 1;
+                atexit(sockem_pcap_stop);
+        }
+        mtx_unlock(&sockem_pcap.lock);
+
+        /* See sockem_events_set() */
+        if (start) {
+                if (thrd_create(&thrd, sockem_pcap_run, NULL) == 0) {
+                        sockem_pool_confine(thrd);
+                        pthread_detach(thrd);
+                } else {
+                        mtx_lock(&sockem_pcap.lock);
+                        sockem_pcap.running = 0;
+                        mtx_unlock(&sockem_pcap.lock);
+                }
+        }
+}
+
+
+/**
+ * @brief Assign \p skm to a forwarder worker: a new dedicated one
+ *        or the least loaded one in the shared pool, by number of
+ *        sockems served.
+ * @returns 0 on success or -1 on failure.
+ */
+static int sockem_wrkr_assign (sockem_t *skm) {
+        struct sockem_wrkr *wrkr = NULL;
+        cpu_set_t set;
+
+        mtx_lock(&sockem_pool.lock);
+        if (!sockem_pool.workers) {
+                const cpu_set_t *cpus = sockem_pool_cpus(-1, &set);
+
+                mtx_unlock(&sockem_pool.lock);
+                if (!(wrkr = sockem_wrkr_new(1, cpus)))
+                        return -1;
+                mtx_lock(&wrkr->lock);
+
+        } else {
+                int i;
+
+                if (!sockem_pool.wrkrs) {
+                        /* Start the pool on first use */
+                        sockem_pool.wrkrs = calloc(sockem_pool.workers,
+                                                   sizeof(*sockem_pool.wrkrs));
+                        for (i = 0 ; i < sockem_pool.workers ; i++) {
+                                if (!(sockem_pool.wrkrs[i] =
+                                      sockem_wrkr_new(0, sockem_pool_cpus(
+                                                              i, &set))))
+                                        break;
+                        }
+                        sockem_pool.wrkr_cnt = i;
+                }
+
+                for (i = 0 ; i < sockem_pool.wrkr_cnt ; i++) {
+                        struct sockem_wrkr *w = sockem_pool.wrkrs[
+                                (sockem_pool.next + i) %
+                                sockem_pool.wrkr_cnt];
+
+                        if (!wrkr ||
+                            __atomic_load_n(&w->cnt, __ATOMIC_RELAXED) <
+                            __atomic_load_n(&wrkr->cnt, __ATOMIC_RELAXED))
+                                wrkr = w;
+                }
+
+                if (wrkr) {
+                        sockem_pool.next++;
+                        mtx_lock(&wrkr->lock);
+                }
+                mtx_unlock(&sockem_pool.lock);
+
+                if (!wrkr)
+                        return -1;
+        }
+
+        wrkr->cnt++;
+        mtx_unlock(&wrkr->lock);
+
+        skm->wrkr = wrkr;
+
+        return 0;
+}
+
+
+
+/**
+ * @brief Connect socket \p s to \p addr
+ */
+static int sockem_do_connect (int s, const struct sockaddr *addr,
+                              socklen_t addrlen) {
+        int r;
+
+        r = sockem_connect0(s, addr, addrlen);
+        if (r == SOCKET_ERROR) {
+                int serr = socket_errno();
+                if (serr != EINPROGRESS
+#ifdef _MSC_VER
+                    && serr != WSAEWOULDBLOCK
+#endif
+                        ) {
+#ifndef _MSC_VER
+                        errno = serr;
+#endif
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+
+/**
+ * @returns the sockem_fdtab slot for \p fd, allocating its page if
+ *          \p create is true, or NULL if the page does not exist or
+ *          \p fd is beyond the table.
+ */
+static struct sockem_fdent *sockem_fdtab_slot (int fd, int create) {
+        struct sockem_fdent *page;
+        int pi = fd / SOCKEM_FDTAB_PAGESZ;
+
+        if (fd < 0 || pi >= SOCKEM_FDTAB_PAGES)
+                return NULL;
+
+        page = __atomic_load_n(&sockem_fdtab[pi], __ATOMIC_ACQUIRE);
+        if (!page && create) {
+                struct sockem_fdent *expected = NULL;
+
+                page = calloc(SOCKEM_FDTAB_PAGESZ, sizeof(*page));
+                /* Lost race with a concurrent sockem_connect() */
+                if (!__atomic_compare_exchange_n(&sockem_fdtab[pi],
+                                                 &expected, page, 0,
+                                                 __ATOMIC_ACQ_REL,
+                                                 __ATOMIC_ACQUIRE)) {
+                        free(page);
+                        page = expected;
+                }
+        }
+
+        return page ? &page[fd % SOCKEM_FDTAB_PAGESZ] : NULL;
+}
+
+
+#ifdef LIBSOCKEM_PRELOAD
+/**
+ * @brief Set or clear \p fd's bit in \p map, sockem_fdmap or
+ *        sockem_inmap.
+ */
+static void sockem_fdmap_set (unsigned long *map, int fd, int on) {
+        unsigned long bit;
+
+        if (fd < 0 || fd >= SOCKEM_FDMAP_BITS)
+                return;
+
+        bit = 1UL << (fd % (8*sizeof(long)));
+        if (on)
+                __atomic_fetch_or(&map[fd / (8*sizeof(long))],
+                                  bit, __ATOMIC_RELEASE);
+        else
+                __atomic_fetch_and(&map[fd / (8*sizeof(long))],
+                                   ~bit, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * @returns true if \p fd may be a sockem application socket.
+ */
+static int sockem_fdmap_test (int fd) {
+        if (fd < 0)
+                return 0;
+        if (fd >= SOCKEM_FDMAP_BITS)
+                return 1;
+        return !!(__atomic_load_n(&sockem_fdmap[fd / (8*sizeof(long))],
+                                  __ATOMIC_ACQUIRE) &
+                  (1UL << (fd % (8*sizeof(long)))));
+}
+
+
+/**
+ * @returns true if \p fd may be an in-process sockem's application
+ *          socket.
+ */
+static int sockem_inmap_test (int fd) {
+        if (fd < 0 || fd >= SOCKEM_FDMAP_BITS)
+                return 0;
+        return !!(__atomic_load_n(&sockem_inmap[fd / (8*sizeof(long))],
+                                  __ATOMIC_ACQUIRE) &
+                  (1UL << (fd % (8*sizeof(long)))));
+}
+#endif
+
+
+/**
+ * @brief Make \p skm findable by sockem_find().
+ * @remark LIBSOCKEM_PRELOAD: sockem_lock must be held.
+ */
+static void sockem_link (sockem_t *skm) {
+        struct sockem_fdent *slot = sockem_fdtab_slot(skm->as, 1);
+
+        if (slot)
+                __atomic_store_n(&slot->skm, skm, __ATOMIC_RELEASE);
+        else
+                LIST_INSERT_HEAD(&sockems, skm, link);
+
+#ifdef LIBSOCKEM_PRELOAD
+        sockem_fdmap_set(sockem_fdmap, skm->as, 1);
+        if (skm->inproc)
+                sockem_fdmap_set(sockem_inmap, skm->as, 1);
+#endif
+}
+
+
+/**
+ * @brief Undo sockem_link().
+ * @remark LIBSOCKEM_PRELOAD: sockem_lock must be held.
+ */
+static void sockem_unlink (sockem_t *skm) {
+        struct sockem_fdent *slot = sockem_fdtab_slot(skm->as, 0);
+
+        if (slot)
+                __atomic_store_n(&slot->skm, NULL, __ATOMIC_RELEASE);
+        else
+                LIST_REMOVE(skm, link);
+
+#ifdef LIBSOCKEM_PRELOAD
+        sockem_fdmap_set(sockem_fdmap, skm->as, 0);
+        sockem_fdmap_set(sockem_inmap, skm->as, 0);
+#endif
+}
+
+
+/**
+ * @brief Replace application socket \p sockfd with socket \p s by
+ *        dup2():ing it over \p sockfd, preserving the O_NONBLOCK and
+ *        FD_CLOEXEC flags. \p s is closed.
+ *
+ * @returns 0 on success or -1 on error.
+ */
+static int sockem_dup2_app (int s, int sockfd) {
+        int fl, fdfl;
+
+        if ((fl = fcntl(sockfd, F_GETFL)) == -1 ||
+            (fdfl = fcntl(sockfd, F_GETFD)) == -1 ||
+            dup2(s, sockfd) == -1) {
+                sockem_close0(s);
+                return -1;
+        }
+        sockem_close0(s);
+
+        fcntl(sockfd, F_SETFL, fl & O_NONBLOCK);
+        fcntl(sockfd, F_SETFD, fdfl);
+
+        return 0;
+}
+
+
+/**
+ * @brief Connect application socket \p sockfd to the forwarder through a
+ *        socketpair() by dup2():ing one end over it.
+ *
+ * This avoids the loopback TCP listen, connect and accept, but the
+ * application socket becomes an AF_UNIX socket.
+ *
+ * @returns 0 on success or -1 on error.
+ */
+static int sockem_socketpair (sockem_t *skm, int sockfd) {
+        int sv[2];
+
+        if (socketpair(AF_UNIX, (skm->dgram ? SOCK_DGRAM : SOCK_STREAM)|
+                       SOCK_NONBLOCK|SOCK_CLOEXEC, 0, sv) == -1)
+                return -1;
+
+        if (sockem_dup2_app(sv[0], sockfd) == -1) {
+                sockem_close0(sv[1]);
+                return -1;
+        }
+
+        skm->cs = sv[1];
+
+        return 0;
+}
+
+
+/**
+ * @brief Connect datagram application socket \p skm->as to a new
+ *        loopback UDP socket \p skm->cs of \p family, and it back to
+ *        the application socket, so they only exchange datagrams with
+ *        each other.
+ *
+ * @returns 0 on success or -1 on error.
+ */
+static int sockem_dgram_app (sockem_t *skm, int family) {
+        struct sockaddr_in6 sin6 = { sin6_family: family };
+        socklen_t addrlen = family == AF_INET ?
+                sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+        int rcvbuf = SOCKEM_DGRAM_BATCH * SOCKEM_DGRAM_MAX;
+
+        skm->cs = socket(family, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC,
+                         IPPROTO_UDP);
+        if (skm->cs == -1 ||
+            bind(skm->cs, (struct sockaddr *)&sin6, addrlen) == -1 ||
+            getsockname(skm->cs, (struct sockaddr *)&sin6, &addrlen) == -1 ||
+            sockem_do_connect(skm->as, (struct sockaddr *)&sin6,
+                              addrlen) == -1 ||
+            getsockname(skm->as, (struct sockaddr *)&sin6, &addrlen) == -1 ||
+            sockem_do_connect(skm->cs, (struct sockaddr *)&sin6,
+                              addrlen) == -1)
+                return -1;
+
+        /* Best effort: fit the application's bursts on the extra
+         * loopback hop, in the order of a full recvmmsg() batch. */
+        setsockopt(skm->cs, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+        return 0;
+}
+
+
+/**
+ * @brief Create a sockem for application socket \p sockfd with
+ *        config template \p conf, or the default config if NULL,
+ *        and va-arg list \p ap.
+ *
+ * @returns the sockem, or NULL with errno EINVAL on invalid config.
+ */
+static sockem_t *sockem_new (int sockfd, const struct sockem_conf *conf,
+                             va_list ap) {
+        sockem_t *skm;
+        int type;
+        socklen_t len = sizeof(type);
+        int i;
+
+        /* Create sockem handle */
+        skm = calloc(1, sizeof(*skm));
+        skm->as = sockfd;
+        skm->dgram = getsockopt(sockfd, SOL_SOCKET, SO_TYPE,
+                                &type, &len) == 0 && type == SOCK_DGRAM;
+        skm->ls = -1;
+        skm->cs = -1;
+        skm->ps = -1;
+        skm->dir[SOCKEM_TX].skm = skm->dir[SOCKEM_RX].skm = skm;
+        skm->dir[SOCKEM_TX].idx = SOCKEM_TX;
+        skm->dir[SOCKEM_RX].idx = SOCKEM_RX;
+        sockem_timer_init(&skm->dir[SOCKEM_TX].tmr, SOCKEM_TMR_RELEASE,
+                          &skm->dir[SOCKEM_TX]);
+        sockem_timer_init(&skm->dir[SOCKEM_RX].tmr, SOCKEM_TMR_RELEASE,
+                          &skm->dir[SOCKEM_RX]);
+        sockem_timer_init(&skm->ctmr, SOCKEM_TMR_CONNECT, skm);
+        for (i = 0 ; i < 2 ; i++) {
+                TAILQ_INIT(&skm->dir[i].q);
+                skm->dir[i].pfd[0] = skm->dir[i].pfd[1] = -1;
+        }
+        TAILQ_INIT(&skm->inq);
+        mtx_init(&skm->lock);
+        cnd_init(&skm->cnd);
+
+        if (conf)
+                skm->conf = *conf;
+        else {
+                /* Default config */
+                mtx_lock(&sockem_defconf_lock);
+                skm->conf = sockem_defconf;
+                mtx_unlock(&sockem_defconf_lock);
+        }
+
+        /* Apply passed configuration */
+        if (sockem_vset(skm, ap) == -1) {
+                sockem_close(skm);
+                errno = EINVAL;
+                return NULL;
+        }
+
+        return skm;
+}
+
+
+/**
+ * @brief Wait for the forwarder to connect \p skm's peer socket.
+ * @returns 0 once connected, else -1 with errno set to the reason.
+ */
+static int sockem_conn_wait (sockem_t *skm) {
+        int err;
+
+        mtx_lock(&skm->lock);
+        while (skm->conn_err == -1 && skm->run != SOCKEM_DONE)
+                cnd_wait(&skm->cnd, &skm->lock);
+        err = skm->conn_err == -1 ? ECONNABORTED : skm->conn_err;
+        mtx_unlock(&skm->lock);
+
+        if (!err)
+                return 0;
+
+        errno = err;
+        return -1;
+}
+
+
+/**
+ * @brief Connect application socket \p skm->as to the forwarder and
+ *        start forwarding to the peer socket \p skm->ps, which is
+ *        connected already or by the forwarder.
+ *
+ * If \p wrap is true the application socket is already connected and
+ * is replaced with a new socket connected to the forwarder, else the
+ * application socket itself is connected to the forwarder.
+ * \p family is the address family of the peer.
+ *
+ * @returns 0 on success, or -1 on error in which case \p skm is
+ *          destroyed.
+ */
+static int sockem_start (sockem_t *skm, int family, int wrap) {
+        int sockfd = skm->as;
+        struct sockaddr_in6 sin6 = { sin6_family: family };
+        socklen_t addrlen = family == AF_INET ?
+                sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+        socklen_t addrlen2 = addrlen;
+        int fl = fcntl(sockfd, F_GETFL);
+        /* .conn is the worker's once it is started */
+        int conn = skm->conn != SOCKEM_CONN_NONE;
+
+        if (skm->inproc) {
+                ; /* Connected to the peer already */
+
+        } else if (skm->conf.socketpair) {
+                /* Replace the application socket with one end of a
+                 * connected socketpair, the other end is served by the
+                 * forwarder. */
+                if (sockem_socketpair(skm, sockfd) == -1) {
+                        sockem_close(skm);
+                        return -1;
+                }
+
+        } else if (skm->dgram) {
+                if (sockem_dgram_app(skm, family) == -1) {
+                        sockem_close(skm);
+                        return -1;
+                }
+
+        } else {
+                /* Create internal app listener socket */
+                skm->ls = socket(family, SOCK_STREAM, IPPROTO_TCP);
+                if (skm->ls == -1 ||
+                    bind(skm->ls, (struct sockaddr *)&sin6, addrlen) == -1 ||
+                    /* Get bound address */
+                    getsockname(skm->ls, (struct sockaddr *)&sin6,
+                                &addrlen2) == -1 ||
+                    listen(skm->ls, 1) == -1) {
+                        sockem_close(skm);
+                        return -1;
+                }
+        }
+
+        pthread_once(&sockem_dist_once, sockem_dist_init);
+
+        /* Hand over to forwarder worker */
+        if (sockem_wrkr_assign(skm) == -1) {
+                sockem_close(skm);
+                return -1;
+        }
+
+        mtx_lock(&skm->lock);
+        skm->run = SOCKEM_START;
+        sockem_wrkr_post(skm);
+        mtx_unlock(&skm->lock);
+
+        /* A blocking connect returns once the emulated handshake with
+         * the peer completed, a non-blocking one right away: the app
+         * connection to the forwarder can not be held back, instead
+         * its data waits for the peer connect. */
+        if (conn && fl != -1 && !(fl & O_NONBLOCK) &&
+            sockem_conn_wait(skm) == -1) {
+                int err = errno;
+                sockem_close(skm);
+                errno = err;
+                return -1;
+        }
+
+        /* In-process the handshake is not forwarded, only
+         * its round-trip is waited for. */
+        if (skm->inproc && fl != -1 && !(fl & O_NONBLOCK) &&
+            skm->conf.delay > 0)
+                usleep((useconds_t)skm->conf.delay * 2000);
+
+        if (!skm->conf.socketpair && !skm->dgram && !skm->inproc) {
+                /* Connect application socket to listen socket, for an
+                 * already connected one through a new socket replacing
+                 * it. The connect completes through the listen backlog
+                 * before the forwarder accepts it. */
+                int s = wrap ? socket(family, SOCK_STREAM|SOCK_CLOEXEC,
+                                      IPPROTO_TCP) : sockfd;
+
+                if (s == -1 ||
+                    sockem_do_connect(s, (struct sockaddr *)&sin6,
+                                      addrlen2) == -1) {
+                        if (wrap && s != -1)
+                                sockem_close0(s);
+                        sockem_close(skm);
+                        return -1;
+                }
+
+                /* Closes s, also on failure */
+                if (wrap && sockem_dup2_app(s, sockfd) == -1) {
+                        sockem_close(skm);
+                        return -1;
+                }
+        }
+
+        mtx_lock(&skm->lock);
+        skm->linked = 1;
+        mtx_unlock(&skm->lock);
+
+#ifdef LIBSOCKEM_PRELOAD
+        mtx_lock(&sockem_lock);
+        sockem_link(skm);
+        mtx_unlock(&sockem_lock);
+#else
+        sockem_link(skm);
+#endif
+
+        __atomic_fetch_add(&sockem_gstats.connects, 1, __ATOMIC_RELAXED);
+
+        return 0;
+}
+
+
+/**
+ * @brief sockem_connect() with config template \p conf, or the default
+ *        config if NULL, and va-arg list \p ap.
+ */
+static sockem_t *sockem_vconnect (int sockfd, const struct sockaddr *addr,
+                                  socklen_t addrlen,
+                                  const struct sockem_conf *conf,
+                                  va_list ap) {
+        sockem_t *skm;
+
+        if (!(skm = sockem_new(sockfd, conf, ap)))
+                return NULL;
+
+#ifdef LIBSOCKEM_PRELOAD
+        /* Features that take an intermediary need the proxy */
+        skm->inproc = skm->conf.inproc && !skm->dgram &&
+                !skm->conf.rx_thruput && !skm->conf.trace &&
+                !skm->conf.link && !skm->conf.socketpair &&
+                sockfd < SOCKEM_FDMAP_BITS;
+#endif
+
+        if (skm->inproc) {
+                /* The application socket is connected to the peer
+                 * itself, the forwarder sends on a dup() of it. */
+                if (sockem_do_connect(sockfd, addr, addrlen) == -1 ||
+                    (skm->ps = fcntl(sockfd, F_DUPFD_CLOEXEC, 0)) == -1) {
+                        int err = errno;
+                        sockem_close(skm);
+                        errno = err;
+                        return NULL;
+                }
+
+                if (sockem_start(skm, addr->sa_family, 0) == -1)
+                        return NULL;
+
+                return skm;
+        }
+
+        /* Create internal peer socket and connect to peer, a TCP peer
+         * is connected by the forwarder, see sockem_conn_timer(). */
+        skm->ps = socket(addr->sa_family,
+                         (skm->dgram ? SOCK_DGRAM : SOCK_STREAM)|
+                         SOCK_NONBLOCK,
+                         skm->dgram ? IPPROTO_UDP : IPPROTO_TCP);
+        if (skm->ps == -1 ||
+            (skm->dgram && sockem_do_connect(skm->ps, addr, addrlen) == -1)) {
+                sockem_close(skm);
+                return NULL;
+        }
+
+        if (!skm->dgram) {
+                if (addrlen > sizeof(skm->paddr))
+                        addrlen = sizeof(skm->paddr);
+                memcpy(&skm->paddr, addr, addrlen);
+                skm->paddrlen = addrlen;
+                skm->conn = SOCKEM_CONN_SYN;
+                skm->conn_err = -1;
+        }
+
+        if (sockem_start(skm, addr->sa_family, 0) == -1)
+                return NULL;
+
+        return skm;
+}
+
+
+/**
+ * @brief sockem_wrap() with config template \p conf, or the default
+ *        config if NULL, and va-arg list \p ap.
+ */
+static sockem_t *sockem_vwrap (int sockfd, const struct sockem_conf *conf,
+                               va_list ap) {
+        struct sockaddr_in6 sin6;
+        socklen_t len = sizeof(sin6);
+        sockem_t *skm;
+        int fl;
+
+        if (getsockname(sockfd, (struct sockaddr *)&sin6, &len) == -1)
+                return NULL;
+        if (sin6.sin6_family != AF_INET && sin6.sin6_family != AF_INET6) {
+                errno = EAFNOSUPPORT;
+                return NULL;
+        }
+
+        if (!(skm = sockem_new(sockfd, conf, ap)))
+                return NULL;
+
+        if (skm->dgram) {
+                sockem_close(skm);
+                errno = EOPNOTSUPP;
+                return NULL;
+        }
+
+        /* The connected socket becomes the peer socket */
+        skm->ps = fcntl(sockfd, F_DUPFD_CLOEXEC, 0);
+        if (skm->ps == -1) {
+                sockem_close(skm);
+                return NULL;
+        }
+
+        if (sockem_start(skm, sin6.sin6_family, 1) == -1)
+                return NULL;
+
+        /* Non-blocking once sockfd no longer shares its file status
+         * flags. Until then the forwarder's sends may block.
+         * The lock guards against the forwarder closing ps. */
+        mtx_lock(&skm->lock);
+        if (skm->ps != -1 && (fl = fcntl(skm->ps, F_GETFL)) != -1)
+                fcntl(skm->ps, F_SETFL, fl | O_NONBLOCK);
+        mtx_unlock(&skm->lock);
+
+        return skm;
+}
+
+
+sockem_t *sockem_wrap (int sockfd, ...) {
+        sockem_t *skm;
+        va_list ap;
+
+        va_start(ap, sockfd);
+        skm = sockem_vwrap(sockfd, NULL, ap);
+        va_end(ap);
+
+        return skm;
+}
+
+
+sockem_t *sockem_connect (int sockfd, const struct sockaddr *addr,
+                          socklen_t addrlen, ...) {
+        sockem_t *skm;
+        va_list ap;
+
+        va_start(ap, addrlen);
+        skm = sockem_vconnect(sockfd, addr, addrlen, NULL, ap);
+        va_end(ap);
+
+        return skm;
+}
+
+/**
+ * @returns true if \p skm holds data not yet sent on: on its delay lines
+ *          or, in-process, queued by the application.
+ * @remark skm lock must be held.
+ */
+static int sockem_pending (sockem_t *skm) {
+        return skm->inqlen > 0 ||
+                __atomic_load_n(&skm->dir[SOCKEM_TX].qlen,
+                                __ATOMIC_RELAXED) > 0 ||
+                __atomic_load_n(&skm->dir[SOCKEM_RX].qlen,
+                                __ATOMIC_RELAXED) > 0;
+}
+
+void sockem_close (sockem_t *skm) {
+        struct sockem_wrkr *wrkr;
+        int i;
+
+        mtx_lock(&skm->lock);
+
+        wrkr = skm->wrkr;
+
+        if (skm->run == SOCKEM_START ||
+            skm->run == SOCKEM_RUN) {
+                /* If forwarder is running let it close the sockets
+                 * to avoid race condition. */
+                __atomic_store_n(&skm->run, SOCKEM_TERM, __ATOMIC_RELEASE);
+                if (skm->linked && sockem_pending(skm)) {
+                        skm->forced = 1;
+                        __atomic_fetch_add(&sockem_gstats.forced, 1,
+                                           __ATOMIC_RELAXED);
+                }
+                /* In-process: close the connection as the proxy would,
+                 * as if by the peer. */
+                if (skm->inproc)
+                        sockem_shutdown0(skm->as, SHUT_RDWR);
+                sockem_wrkr_post(skm);
+        } else if (skm->run != SOCKEM_DONE)
+                sockem_close_all(skm);
+
+        /* LIBSOCKEM_PRELOAD: caller must hold sockem_lock. */
+        if (skm->linked) {
+                sockem_unlink(skm);
+#ifdef LIBSOCKEM_PRELOAD
+                /* Let sockem_inproc_get() lookups of the fd that found
+                 * the sockem before it was unlinked take their
+                 * reference: only a few instructions, and lookups
+                 * of other fds are not waited for. */
+                if (skm->inproc) {
+                        struct sockem_fdent *slot =
+                                sockem_fdtab_slot(skm->as, 0);
+
+                        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                        while (__atomic_load_n(&slot->pins,
+                                               __ATOMIC_ACQUIRE))
+                                sched_yield();
+                }
+#endif
+        }
+
+        if (skm->wrkr) {
+                /* Wait for the worker, and in-process senders,
+                 * to let go of the sockem. */
+                while (skm->run != SOCKEM_DONE ||
+                       __atomic_load_n(&skm->insenders, __ATOMIC_ACQUIRE))
+                        cnd_wait(&skm->cnd, &skm->lock);
+        }
+
+        mtx_unlock(&skm->lock);
+
+        if (wrkr && wrkr->dedicated) {
+                thrd_join(wrkr->thrd, NULL);
+                sockem_wrkr_destroy(wrkr);
+        }
+
+        mtx_destroy(&skm->lock);
+        cnd_destroy(&skm->cnd);
+
+        for (i = 0 ; i < SOCKEM_STAGE_MAX ; i++) {
+                free(skm->dir[SOCKEM_TX].stage_state[i]);
+                free(skm->dir[SOCKEM_RX].stage_state[i]);
+        }
+        free(skm->dir[SOCKEM_TX].hist);
+        free(skm->dir[SOCKEM_RX].hist);
+        free(skm);
+}
+
+
+/**
+ * @brief Set forwarder worker pool size.
+ *        Has no effect once the pool has been started.
+ */
+static void sockem_pool_set_workers (int workers) {
+        mtx_lock(&sockem_pool.lock);
+        if (!sockem_pool.wrkrs && workers >= 0)
+                sockem_pool.workers = workers;
+        mtx_unlock(&sockem_pool.lock);
+}
+
+
+/**
+ * @brief Parse list \p str of CPU numbers and ranges, e.g., "2-3,6",
+ *        into \p set, empty if \p str is.
+ * @returns 0 on success or -1 on an invalid list.
+ */
+static int sockem_cpus_parse (const char *str, cpu_set_t *set) {
+        const char *s = str;
+
+        CPU_ZERO(set);
+
+        while (*s) {
+                char *end;
+                long lo, hi;
+
+                lo = hi = strtol(s, &end, 10);
+                if (end == s || lo < 0)
+                        return -1;
+                if (*end == '-') {
+                        s = end + 1;
+                        hi = strtol(s, &end, 10);
+                        if (end == s || hi < lo)
+                                return -1;
+                }
+                if (hi >= CPU_SETSIZE)
+                        return -1;
+                for ( ; lo <= hi ; lo++)
+                        CPU_SET((int)lo, set);
+
+                if (*end == ',')
+                        end++;
+                else if (*end)
+                        return -1;
+                s = end;
+        }
+
+        return 0;
+}
+
+
+/**
+ * @brief Set the forwarder CPUs to \p set, or unset them if empty.
+ *        Applies to forwarder threads started afterwards.
+ */
+static void sockem_pool_set_cpus (const cpu_set_t *set) {
+        mtx_lock(&sockem_pool.lock);
+        sockem_pool.cpus = *set;
+        sockem_pool.cpu_cnt = CPU_COUNT(set);
+        mtx_unlock(&sockem_pool.lock);
+}
+
+
+/**
+ * Configuration key names, including aliases.
+ */
+static const struct {
+        const char *name;
+        sockem_key_t key;
+} sockem_keys[] = {
+        { "rx.thruput",    SOCKEM_K_RX_THRUPUT },
+        { "rx.throughput", SOCKEM_K_RX_THRUPUT },
+        { "tx.thruput",    SOCKEM_K_TX_THRUPUT },
+        { "tx.throughput", SOCKEM_K_TX_THRUPUT },
+        { "rx.burst",      SOCKEM_K_RX_BURST },
+        { "tx.burst",      SOCKEM_K_TX_BURST },
+        { "delay",         SOCKEM_K_DELAY },
+        { "jitter",        SOCKEM_K_JITTER },
+        { "jitter.dist",   SOCKEM_K_JITTER_DIST },
+        { "seed",          SOCKEM_K_SEED },
+        { "loss",          SOCKEM_K_LOSS },
+        { "reorder",       SOCKEM_K_REORDER },
+        { "segsz",         SOCKEM_K_SEGSZ },
+        { "rx.bufsz",      SOCKEM_K_RX_BUFSZ },
+        { "qmax",          SOCKEM_K_QMAX },
+        { "splice",        SOCKEM_K_SPLICE },
+        { "socketpair",    SOCKEM_K_SOCKETPAIR },
+        { "accept",        SOCKEM_K_ACCEPT },
+        { "udp",           SOCKEM_K_UDP },
+        { "inproc",        SOCKEM_K_INPROC },
+        { "debug",         SOCKEM_K_DEBUG },
+        { "workers",       SOCKEM_K_WORKERS },
+        { "io_uring",      SOCKEM_K_IO_URING },
+        { "mem.max",       SOCKEM_K_MEM_MAX },
+        { "pcap.snaplen",  SOCKEM_K_PCAP_SNAPLEN },
+        { "link.rx.thruput",    SOCKEM_K_LINK_RX_THRUPUT },
+        { "link.rx.throughput", SOCKEM_K_LINK_RX_THRUPUT },
+        { "link.tx.thruput",    SOCKEM_K_LINK_TX_THRUPUT },
+        { "link.tx.throughput", SOCKEM_K_LINK_TX_THRUPUT },
+        { "link.qmax",          SOCKEM_K_LINK_QMAX },
+};
+
+
+/**
+ * @returns the key id for \p name, or -1 if unknown.
+ */
+static int sockem_key_find (const char *name) {
+        int cnt = __atomic_load_n(&sockem_stagetab.cnt, __ATOMIC_ACQUIRE);
+        size_t i;
+
+        for (i = 0 ; i < sizeof(sockem_keys) / sizeof(*sockem_keys) ; i++)
+                if (!strcmp(sockem_keys[i].name, name))
+                        return (int)sockem_keys[i].key;
+
+        for (i = 0 ; i < (size_t)cnt ; i++)
+                if (!strcmp(sockem_stagetab.stages[i]->name, name))
+                        return SOCKEM_K_STAGE + (int)i;
+
+        return -1;
+}
+
+
+int sockem_stage_register (const sockem_stage_t *stage) {
+        int idx = -1;
+
+        if (!stage->name || !stage->chunk)
+                return -1;
+
+        mtx_lock(&sockem_stagetab.lock);
+        if (sockem_key_find(stage->name) == -1 &&
+            sockem_stagetab.cnt < SOCKEM_STAGE_MAX) {
+                idx = sockem_stagetab.cnt;
+                sockem_stagetab.stages[idx] = stage;
+                __atomic_store_n(&sockem_stagetab.cnt, idx + 1,
+                                 __ATOMIC_RELEASE);
+        }
+        mtx_unlock(&sockem_stagetab.lock);
+
+        return idx == -1 ? -1 : SOCKEM_K_STAGE + idx;
+}
+
+
+/**
+ * @brief Check value \p val for key \p key, for a config in a link
+ *        group if \p linked is true.
+ * @returns 0 if it may be set or -1 if the key or value is invalid.
+ */
+static int sockem_key_check (sockem_key_t key, int val, int linked) {
+        if (val < 0)
+                return -1;
+
+        switch (key)
+        {
+        case SOCKEM_K_JITTER_DIST:
+                return val < SOCKEM_DIST__CNT ? 0 : -1;
+        case SOCKEM_K_LOSS:
+        case SOCKEM_K_REORDER:
+                return val <= 1000 ? 0 : -1;
+        case SOCKEM_K_SEGSZ:
+                /* Tiny segments would take a chunk per few bytes */
+                return !val || val >= SOCKEM_SEGSZ_MIN ? 0 : -1;
+        case SOCKEM_K_RX_BUFSZ:
+                return val ? 0 : -1;
+        case SOCKEM_K_PCAP_SNAPLEN:
+                return val <= SOCKEM_PCAP_SNAPLEN ? 0 : -1;
+        case SOCKEM_K_LINK_RX_THRUPUT:
+        case SOCKEM_K_LINK_TX_THRUPUT:
+        case SOCKEM_K_LINK_QMAX:
+                return linked ? 0 : -1;
+        default:
+                /* Stage keys must have been registered */
+                if ((int)key >= SOCKEM_K__CNT &&
+                    ((int)key < SOCKEM_K_STAGE ||
+                     (int)key >= SOCKEM_K_STAGE +
+                     __atomic_load_n(&sockem_stagetab.cnt,
+                                     __ATOMIC_ACQUIRE)))
+                        return -1;
+                return 0;
+        }
+}
+
+
+/**
+ * @brief Set key \p key to \p val in \p conf, or the global setting
+ *        for global keys.
+ *
+ * @remark The lock protecting \p conf must be held.
+ * @returns 0 on success or -1 if the key or value is invalid.
+ */
+static int sockem_conf_set (struct sockem_conf *conf, sockem_key_t key,
+                            int val) {
+        if (sockem_key_check(key, val, conf->link != NULL) == -1)
+                return -1;
+
+        switch (key)
+        {
+        case SOCKEM_K_RX_THRUPUT:
+                conf->rx_thruput = val;
+                break;
+        case SOCKEM_K_TX_THRUPUT:
+                conf->tx_thruput = val;
+                break;
+        case SOCKEM_K_RX_BURST:
+                conf->rx_burst = val;
+                break;
+        case SOCKEM_K_TX_BURST:
+                conf->tx_burst = val;
+                break;
+        case SOCKEM_K_DELAY:
+                conf->delay = val;
+                break;
+        case SOCKEM_K_JITTER:
+                conf->jitter = val;
+                break;
+        case SOCKEM_K_JITTER_DIST:
+                conf->jitter_dist = val;
+                break;
+        case SOCKEM_K_SEED:
+                conf->seed = val;
+                break;
+        case SOCKEM_K_LOSS:
+                conf->loss = val;
+                break;
+        case SOCKEM_K_REORDER:
+                conf->reorder = val;
+                break;
+        case SOCKEM_K_SEGSZ:
+                conf->segsz = val;
+                break;
+        case SOCKEM_K_RX_BUFSZ:
+                conf->bufsz = val;
+                break;
+        case SOCKEM_K_QMAX:
+                conf->qmax = val;
+                break;
+        case SOCKEM_K_SPLICE:
+                conf->splice = val;
+                break;
+        case SOCKEM_K_SOCKETPAIR:
+                conf->socketpair = val;
+                break;
+        case SOCKEM_K_ACCEPT:
+                conf->accept = val;
+                break;
+        case SOCKEM_K_UDP:
+                conf->udp = val;
+                break;
+        case SOCKEM_K_INPROC:
+                conf->inproc = val;
+                break;
+        case SOCKEM_K_DEBUG:
+                conf->debug = val;
+                break;
+        case SOCKEM_K_WORKERS:
+                sockem_pool_set_workers(val);
+                break;
+        case SOCKEM_K_IO_URING:
+                /* Read by workers starting in parallel, ignored if not
+                 * built in */
+                __atomic_store_n(&sockem_pool.io_uring, val,
+                                 __ATOMIC_RELAXED);
+                break;
+        case SOCKEM_K_MEM_MAX:
+                mtx_lock(&sockem_mem.lock);
+                sockem_mem.max = (size_t)val;
+                mtx_unlock(&sockem_mem.lock);
+                break;
+        case SOCKEM_K_PCAP_SNAPLEN:
+                __atomic_store_n(&sockem_pcap.snaplen, val,
+                                 __ATOMIC_RELAXED);
+                break;
+        case SOCKEM_K_LINK_RX_THRUPUT:
+        case SOCKEM_K_LINK_TX_THRUPUT:
+                __atomic_store_n(&conf->link->dir[key ==
+                                                  SOCKEM_K_LINK_TX_THRUPUT ?
+                                                  SOCKEM_TX : SOCKEM_RX].rate,
+                                 val, __ATOMIC_RELAXED);
+                break;
+        case SOCKEM_K_LINK_QMAX:
+                __atomic_store_n(&conf->link->dir[SOCKEM_TX].qmax,
+                                 (size_t)val, __ATOMIC_RELAXED);
+                __atomic_store_n(&conf->link->dir[SOCKEM_RX].qmax,
+                                 (size_t)val, __ATOMIC_RELAXED);
+                break;
+        default:
+                conf->stage[key - SOCKEM_K_STAGE] = val;
+                break;
+        }
+
+        return 0;
+}
+
+
+/**
+ * Process-wide side effects of CSV lists: the lists are checked, the
+ * traces they name loaded and their side effects collected by
+ * sockem_conf_prep(), and the files they name created by
+ * sockem_conf_fx_open(), before the config lock is taken. The side
+ * effects are only applied by sockem_conf_fx_done() once the whole
+ * list was.
+ */
+struct sockem_conf_fx {
+        int       linked;    /* config in a link group, so far */
+        int       cpus;      /* cpus key given, to .cpuset */
+        cpu_set_t cpuset;
+        char     *events;    /* events key's path, empty to stop */
+        int       events_fd;
+        char     *pcap;      /* pcap key's path, empty to stop */
+        int       pcap_fd;
+        char     *pcap_map;  /* .pcap_fd's mapping */
+};
+
+#define SOCKEM_CONF_FX_INITIALIZER { .events_fd = -1, .pcap_fd = -1 }
+
+
+/**
+ * @brief Create the files of the side effects collected on \p fx.
+ * @returns 0 on success or -1 if a file cannot be created.
+ */
+static int sockem_conf_fx_open (struct sockem_conf_fx *fx) {
+        if (fx->events && *fx->events &&
+            (fx->events_fd = sockem_events_open(fx->events)) == -1)
+                return -1;
+        if (fx->pcap && *fx->pcap &&
+            (fx->pcap_fd = sockem_pcap_open(fx->pcap,
+                                            &fx->pcap_map)) == -1)
+                return -1;
+
+        return 0;
+}
+
+
+/**
+ * @brief Apply the side effects prepared on \p fx if \p ok is true,
+ *        the list they were prepared for applied, else drop them.
+ *        \p fx is reset for reuse.
+ * @remark Must not be called with a config lock held.
+ */
+static void sockem_conf_fx_done (struct sockem_conf_fx *fx, int ok) {
+        if (ok) {
+                /* CPUs first, the events and pcap threads are confined
+                 * to them */
+                if (fx->cpus)
+                        sockem_pool_set_cpus(&fx->cpuset);
+                if (fx->events)
+                        sockem_events_set(fx->events_fd);
+                if (fx->pcap)
+                        sockem_pcap_set(fx->pcap_fd, fx->pcap_map);
+        } else {
+                if (fx->events_fd != -1)
+                        sockem_close0(fx->events_fd);
+                if (fx->pcap_fd != -1) {
+                        munmap(fx->pcap_map, SOCKEM_PCAP_VMAX);
+                        sockem_close0(fx->pcap_fd);
+                }
+        }
+
+        free(fx->events);
+        free(fx->pcap);
+        fx->events = fx->pcap = NULL;
+        fx->events_fd = fx->pcap_fd = -1;
+        fx->cpus = 0;
+}
+
+
+/**
+ * @brief Check key \p name, not a CSV list, with value \p val for the
+ *        config \p fx is prepared for.
+ * @returns 0 if it may be set or -1 if the key or value is invalid.
+ */
+static int sockem_conf_check (const struct sockem_conf_fx *fx,
+                              const char *name, int val) {
+        int key;
+
+        if (!strcmp(name, "true"))
+                return 0; /* dummy key */
+        if ((key = sockem_key_find(name)) == -1)
+                return -1;
+
+        return sockem_key_check((sockem_key_t)key, val, fx->linked);
+}
+
+
+/**
+ * @brief Parse and apply a "key=val,key2=val2" CSV list to \p conf.
+ *        A key without a value is set to 1.
+ *
+ * The trace key only takes traces loaded by sockem_conf_prep(), and
+ * the cpus, events and pcap keys are left to it, which passes a NULL
+ * \p conf to only check the list and collect them on \p fx.
+ *
+ * @remark The lock protecting \p conf must be held.
+ * @returns 0 on success or -1 on unknown key or invalid value.
+ */
+static int sockem_conf_parse (struct sockem_conf *conf,
+                              struct sockem_conf_fx *fx, const char *str) {
+        char *s = strdupa(str);
+
+        while (*s) {
+                char *t = strchr(s, ',');
+                char *d;
+                char *end;
+                long val = 1;
+                int key;
+
+                if (t)
+                        *t = '\0';
+
+                if ((d = strchr(s, '='))) {
+                        *(d++) = '\0';
+                        if (!strcmp(s, "trace")) {
+                                /* String value: trace file path */
+                                if (!conf) {
+                                        if (*d && !sockem_trace_get(d, 1))
+                                                return -1;
+                                } else if (sockem_conf_set_trace(conf,
+                                                                 d) == -1)
+                                        return -1;
+                                goto next;
+                        } else if (!strcmp(s, "link")) {
+                                /* String value: link group name */
+                                if (conf)
+                                        sockem_conf_set_link(conf, d);
+                                else
+                                        fx->linked = !!*d;
+                                goto next;
+                        } else if (!strcmp(s, "cpus")) {
+                                /* String value: CPU list, the commas of
+                                 * which are followed by a digit, unlike
+                                 * those separating keys. */
+                                while (t && isdigit((unsigned char)t[1])) {
+                                        *t = ',';
+                                        if ((t = strchr(t + 1, ',')))
+                                                *t = '\0';
+                                }
+                                if (!conf) {
+                                        if (sockem_cpus_parse(
+                                                    d, &fx->cpuset) == -1)
+                                                return -1;
+                                        fx->cpus = 1;
+                                }
+                                goto next;
+                        } else if (!strcmp(s, "events")) {
+                                /* String value: events file path */
+                                if (!conf) {
+                                        free(fx->events);
+                                        if (!(fx->events = strdup(d)))
+                                                return -1;
+                                }
+                                goto next;
+                        } else if (!strcmp(s, "pcap")) {
+                                /* String value: pcap file path */
+                                if (!conf) {
+                                        free(fx->pcap);
+                                        if (!(fx->pcap = strdup(d)))
+                                                return -1;
+                                }
+                                goto next;
+                        } else if (!strcmp(s, "jitter.dist") &&
+                            (val = sockem_dist_find(d)) != -1)
+                                ; /* distribution by name */
+                        else {
+                                val = strtol(d, &end, 0);
+                                if (end == d || *end || val < 0 ||
+                                    val > INT_MAX)
+                                        return -1;
+                        }
+                }
+
+                if (!strcmp(s, "true") || !*s)
+                        ; /* dummy key for allowing non-empty but
+                           * default config */
+                else if (!conf) {
+                        if (sockem_conf_check(fx, s, (int)val) == -1)
+                                return -1;
+                } else if ((key = sockem_key_find(s)) == -1 ||
+                         sockem_conf_set(conf, (sockem_key_t)key,
+                                         (int)val) == -1)
+                        return -1;
+
+ next:
+                if (!t)
+                        break;
+                s = t + 1;
+        }
+
+        return 0;
+}
+
+
+/**
+ * @brief Check CSV list \p str and collect its side effects on \p fx,
+ *        see sockem_conf_fx, before taking the config lock to apply it.
+ * @returns 0 on success or -1 on unknown key or invalid value.
+ */
+static int sockem_conf_prep (struct sockem_conf_fx *fx, const char *str) {
+        return sockem_conf_parse(NULL, fx, str);
+}
+
+
+/**
+ * @returns true if key \p name is a CSV list, see sockem_set0().
+ */
+static int sockem_key_csv (const char *name) {
+        return strchr(name, '=') || strchr(name, ',');
+}
+
+
+/**
+ * @brief Set single conf key by name, which may also be a CSV list
+ *        prepared with sockem_conf_prep().
+ *
+ * @remark The lock protecting \p conf must be held.
+ * @returns 0 on success or -1 if key is unknown
+ */
+static int sockem_set0 (struct sockem_conf *conf, const char *name, int val) {
+        int key;
+
+        if (sockem_key_csv(name))
+                return sockem_conf_parse(conf, NULL, name);
+        else if (!strcmp(name, "true"))
+                return 0; /* dummy key for allowing non-empty but
+                           * default config */
+        else if ((key = sockem_key_find(name)) == -1)
+                return -1;
+
+        return sockem_conf_set(conf, (sockem_key_t)key, val);
+}
+
+
+/**
+ * @brief Lock and return \p skm's config, or the default config for
+ *        new sockems if \p skm is NULL.
+ */
+static struct sockem_conf *sockem_conf_lock (sockem_t *skm) {
+        if (!skm) {
+                mtx_lock(&sockem_defconf_lock);
+                return &sockem_defconf;
+        }
+
+        mtx_lock(&skm->lock);
+        return &skm->conf;
+}
+
+static void sockem_conf_unlock (sockem_t *skm) {
+        if (!skm) {
+                mtx_unlock(&sockem_defconf_lock);
+                return;
+        }
+
+        /* Have the forwarder pick up the change */
+        __atomic_add_fetch(&skm->conf_gen, 1, __ATOMIC_RELEASE);
+        mtx_unlock(&skm->lock);
+}
+
+
+/**
+ * @returns true if \p skm's config, or the default config if \p skm is
+ *          NULL, is in a link group, for checking lists without the lock.
+ */
+static int sockem_conf_linked (sockem_t *skm) {
+        mtx_t *lock = skm ? &skm->lock : &sockem_defconf_lock;
+        int linked;
+
+        mtx_lock(lock);
+        linked = (skm ? skm->conf.link : sockem_defconf.link) != NULL;
+        mtx_unlock(lock);
+
+        return linked;
+}
+
+
+/**
+ * @brief Set sockem config parameters
+ */
+static int sockem_vset (sockem_t *skm, va_list ap) {
+        struct sockem_conf_fx fx = SOCKEM_CONF_FX_INITIALIZER;
+        struct sockem_conf *conf;
+        const char *key;
+        va_list ap2;
+        int val;
+        int r = 0;
+
+        /* Checked, and the files of the CSV lists created, first,
+         * without the lock */
+        fx.linked = sockem_conf_linked(skm);
+        va_copy(ap2, ap);
+        while ((key = va_arg(ap2, const char *))) {
+                val = va_arg(ap2, int);
+                if (sockem_key_csv(key) ? sockem_conf_prep(&fx, key) :
+                    sockem_conf_check(&fx, key, val)) {
+                        r = -1;
+                        break;
+                }
+        }
+        va_end(ap2);
+
+        if (r == -1 || sockem_conf_fx_open(&fx) == -1) {
+                sockem_conf_fx_done(&fx, 0);
+                return -1;
+        }
+
+        conf = sockem_conf_lock(skm);
+        while ((key = va_arg(ap, const char *))) {
+                val = va_arg(ap, int);
+                if (sockem_set0(conf, key, val) == -1) {
+                        r = -1;
+                        break;
+                }
+        }
+        sockem_conf_unlock(skm);
+
+        sockem_conf_fx_done(&fx, r == 0);
+
+        return r;
+}
+
+int sockem_set (sockem_t *skm, ...) {
+        va_list ap;
+        int r;
+
+        va_start(ap, skm);
+        r = sockem_vset(skm, ap);
+        va_end(ap);
+
+        return r;
+}
+
+int sockem_set_key (sockem_t *skm, sockem_key_t key, int val) {
+        struct sockem_conf *conf;
+        int r;
+
+        conf = sockem_conf_lock(skm);
+        r = sockem_conf_set(conf, key, val);
+        sockem_conf_unlock(skm);
+
+        return r;
+}
+
+
+/**
+ * @brief Summarize the \p hists histograms into \p dst.
+ */
+static void sockem_dir_stats_hist (struct sockem_dir_stats *dst,
+                                   const struct sockem_hist *hists) {
+        sockem_hist_summary(&hists[SOCKEM_HIST_TARGET], &dst->target);
+        sockem_hist_summary(&hists[SOCKEM_HIST_ACHIEVED], &dst->achieved);
+        sockem_hist_summary(&hists[SOCKEM_HIST_LATE], &dst->late);
+}
+
+
+/**
+ * @brief Add histograms \p src, if any, to \p dst.
+ */
+static void sockem_hists_merge (struct sockem_hist *dst,
+                                const struct sockem_hist *src) {
+        int i;
+
+        if (!src)
+                return;
+
+        for (i = 0 ; i < SOCKEM_HIST__CNT ; i++)
+                sockem_hist_merge(&dst[i], &src[i]);
+}
+
+
+int sockem_stats (sockem_t *skm, struct sockem_stats *stats) {
+        struct sockem_wrkr *wrkr;
+        struct sockem_hist hists[2][SOCKEM_HIST__CNT];
+        int i;
+
+        memset(stats, 0, sizeof(*stats));
+        memset(hists, 0, sizeof(hists));
+
+        if (skm) {
+                for (i = 0 ; i < 2 ; i++) {
+                        struct sockem_dir *dir = &skm->dir[i];
+                        struct sockem_dir_stats *dst =
+                                i == SOCKEM_TX ? &stats->tx : &stats->rx;
+
+                        sockem_dir_stats_add(dst, &dir->st);
+                        dst->queued = __atomic_load_n(&dir->qlen,
+                                                      __ATOMIC_RELAXED);
+                        sockem_hists_merge(hists[i],
+                                           __atomic_load_n(&dir->hist,
+                                                           __ATOMIC_ACQUIRE));
+                        sockem_dir_stats_hist(dst, hists[i]);
+                }
+                stats->connects = 1;
+                stats->closed = __atomic_load_n(&skm->closed,
+                                                __ATOMIC_RELAXED);
+                stats->forced = skm->forced;
+                return 0;
+        }
+
+        mtx_lock(&sockem_gstats.lock);
+        *stats = sockem_gstats.retired;
+        for (i = 0 ; i < 2 ; i++)
+                sockem_hists_merge(hists[i], sockem_gstats.retired_hist[i]);
+        LIST_FOREACH(wrkr, &sockem_gstats.wrkrs, glink) {
+                sockem_dir_stats_add(&stats->tx, &wrkr->st[SOCKEM_TX]);
+                sockem_dir_stats_add(&stats->rx, &wrkr->st[SOCKEM_RX]);
+                stats->closed += SOCKEM_STAT_GET(wrkr->closed);
+                for (i = 0 ; i < 2 ; i++)
+                        sockem_hists_merge(hists[i],
+                                           __atomic_load_n(&wrkr->hist[i],
+                                                           __ATOMIC_ACQUIRE));
+        }
+        mtx_unlock(&sockem_gstats.lock);
+
+        sockem_dir_stats_hist(&stats->tx, hists[SOCKEM_TX]);
+        sockem_dir_stats_hist(&stats->rx, hists[SOCKEM_RX]);
+
+        stats->connects = __atomic_load_n(&sockem_gstats.connects,
+                                          __ATOMIC_RELAXED);
+        stats->forced = __atomic_load_n(&sockem_gstats.forced,
+                                        __ATOMIC_RELAXED);
+
+        return 0;
+}
+
+
+sockem_t *sockem_find (int sockfd) {
+        struct sockem_fdent *slot;
+        sockem_t *skm;
+
+        if (sockfd >= 0 &&
+            sockfd < SOCKEM_FDTAB_PAGES * SOCKEM_FDTAB_PAGESZ) {
+                if (!(slot = sockem_fdtab_slot(sockfd, 0)))
+                        return NULL;
+                return __atomic_load_n(&slot->skm, __ATOMIC_ACQUIRE);
+        }
+
+        LIST_FOREACH(skm, &sockems, link)
+                if (skm->as == sockfd)
+                        return skm;
+
+        return NULL;
+}
+
+
+#ifdef LIBSOCKEM_PRELOAD
+/**
+ * Provide overloading socket APIs and conf bootstrapping from env vars.
+ *
+ */
+
+/**
+ * @brief Write \p st as a JSON object named \p name.
+ */
+static void sockem_hist_stats_print (FILE *fp, const char *name,
+                                     const struct sockem_hist_stats *hs) {
+        fprintf(fp, ",\"%s\":{\"cnt\":%"PRIu64",\"min\":%"PRIu64","
+                "\"avg\":%"PRIu64",\"p50\":%"PRIu64",\"p90\":%"PRIu64","
+                "\"p99\":%"PRIu64",\"p999\":%"PRIu64",\"max\":%"PRIu64"}",
+                name, hs->cnt, hs->min, hs->avg, hs->p50, hs->p90, hs->p99,
+                hs->p999, hs->max);
+}
+
+static void sockem_dir_stats_print (FILE *fp, const char *name,
+                                    const struct sockem_dir_stats *st) {
+        fprintf(fp, "\"%s\":{\"bytes\":%"PRIu64",\"chunks\":%"PRIu64","
+                "\"queued\":%"PRIu64",\"throttled_us\":%"PRIu64","
+                "\"dropped\":%"PRIu64",\"lost\":%"PRIu64,
+                name, st->bytes, st->chunks, st->queued, st->throttled_us,
+                st->dropped, st->lost);
+        sockem_hist_stats_print(fp, "target_us", &st->target);
+        sockem_hist_stats_print(fp, "achieved_us", &st->achieved);
+        sockem_hist_stats_print(fp, "late_us", &st->late);
+        fprintf(fp, "}");
+}
+
+
+/**
+ * @brief Write the process-wide stats as a JSON line to \p fp.
+ */
+static void sockem_stats_fprint (FILE *fp) {
+        struct sockem_stats st;
+
+        sockem_stats(NULL, &st);
+
+        fprintf(fp, "{\"ts\":%"PRId64",\"connects\":%"PRIu64","
+                "\"closed\":%"PRIu64",\"forced\":%"PRIu64",",
+                sockem_clock(), st.connects, st.closed, st.forced);
+        sockem_dir_stats_print(fp, "tx", &st.tx);
+        fprintf(fp, ",");
+        sockem_dir_stats_print(fp, "rx", &st.rx);
+        fprintf(fp, "}\n");
+        fflush(fp);
+}
+
+
+/**
+ * @brief Write the process-wide stats to SOCKEM_STATS.
+ */
+static void sockem_stats_print (void) {
+        sockem_stats_fprint(sockem_stats_fp);
+}
+
+
+/**
+ * @brief SOCKEM_STATS dump thread.
+ */
+static void *sockem_stats_run (void *arg) {
+        (void)arg;
+
+        while (1) {
+                usleep(sockem_stats_intvl * 1000);
+                sockem_stats_print();
+        }
+
+        return NULL;
+}
+
+
+/**
+ * @brief Set up periodic stats dumps from a SOCKEM_STATS value of
+ *        "<interval_ms>" (to stderr), "<path>" or "<path>:<interval_ms>".
+ *        The default interval is 1000 ms. Stats are also dumped at exit.
+ */
+static void sockem_stats_init (const char *str) {
+        char *path = strdupa(str);
+        char *t;
+        thrd_t thrd;
+
+        sockem_stats_intvl = 1000;
+
+        if ((t = strrchr(path, ':'))) {
+                *(t++) = '\0';
+                sockem_stats_intvl = atoi(t);
+        } else if (strspn(path, "0123456789") == strlen(path)) {
+                sockem_stats_intvl = atoi(path);
+                path = NULL;
+        }
+
+        if (sockem_stats_intvl <= 0)
+                sockem_stats_intvl = 1000;
+
+        if (!path) {
+                sockem_stats_fp = stderr;
+        } else if (!(sockem_stats_fp = fopen(path, "ae"))) {
+                fprintf(stderr, "%% libsockem: SOCKEM_STATS: "
+                        "failed to open %s: %s\n", path, strerror(errno));
+                return;
+        }
+
+        atexit(sockem_stats_print);
+
+        if (thrd_create(&thrd, sockem_stats_run, NULL) == 0) {
+                sockem_pool_confine(thrd);
+                pthread_detach(thrd);
+        }
+}
+
+
+/**
+ * SOCKEM_CTL control socket: a line based text protocol for inspecting
+ * and reconfiguring the process' sockems from another process, e.g.:
+ *
+ *   echo "set * delay=200" | socat - UNIX-CONNECT:/tmp/app.ctl
+ *
+ * Commands, each answered by "ok" or "error: <reason>" on a line of
+ * its own:
+ *   list                  - one JSON line per sockem: application fd,
+ *                           peer, main config and forwarding stats.
+ *   stats                 - the process-wide stats as a JSON line.
+ *   set <target> <conf>   - apply "key=val,.." CSV list <conf>.
+ *   close <target>        - sockem_close(): the application sees the
+ *                           peer close the connection.
+ * A <target> is an application fd, "*" for all sockems or, for set,
+ * "default" for the config of new connections that match no rule.
+ *
+ * Config changes are picked up by the forwarders through the same
+ * config generation check as sockem_set().
+ */
+static char *sockem_ctl_path;
+
+
+/**
+ * @brief Call \p cb for each linked sockem, which may sockem_close() it.
+ * @remark sockem_lock must be held.
+ */
+static void sockem_foreach (void (*cb) (sockem_t *skm, void *opaque),
+                            void *opaque) {
+        sockem_t *skm, *next;
+        size_t i;
+
+        for (i = 0 ; i < sizeof(sockem_fdmap) / sizeof(*sockem_fdmap) ; i++) {
+                unsigned long bits = __atomic_load_n(&sockem_fdmap[i],
+                                                     __ATOMIC_ACQUIRE);
+
+                while (bits) {
+                        int b = __builtin_ctzl(bits);
+                        int fd = (int)(i * 8 * sizeof(long)) + b;
+
+                        bits &= bits - 1;
+                        if ((skm = sockem_find(fd)))
+                                cb(skm, opaque);
+                }
+        }
+
+        /* Beyond sockem_fdtab */
+        for (skm = LIST_FIRST(&sockems) ; skm ; skm = next) {
+                next = LIST_NEXT(skm, link);
+                cb(skm, opaque);
+        }
+}
+
+
+/**
+ * @brief Format \p skm's peer address into \p buf of \p size bytes.
+ */
+static const char *sockem_ctl_peer (sockem_t *skm, char *buf, size_t size) {
+        struct sockaddr_in6 sin6;
+        socklen_t len = sizeof(sin6);
+        char addr[INET6_ADDRSTRLEN];
+        int ps = __atomic_load_n(&skm->ps, __ATOMIC_RELAXED);
+
+        *buf = '\0';
+
+        if (ps == -1 ||
+            getpeername(ps, (struct sockaddr *)&sin6, &len) == -1)
+                return buf;
+
+        if (sin6.sin6_family == AF_INET) {
+                const struct sockaddr_in *sin = (const void *)&sin6;
+                inet_ntop(AF_INET, &sin->sin_addr, addr, sizeof(addr));
+                snprintf(buf, size, "%s:%d", addr, ntohs(sin->sin_port));
+        } else if (sin6.sin6_family == AF_INET6) {
+                inet_ntop(AF_INET6, &sin6.sin6_addr, addr, sizeof(addr));
+                snprintf(buf, size, "[%s]:%d", addr, ntohs(sin6.sin6_port));
+        }
+
+        return buf;
+}
+
+
+/**
+ * @brief Write \p skm as a JSON line to the FILE \p opaque.
+ */
+static void sockem_ctl_list (sockem_t *skm, void *opaque) {
+        FILE *fp = opaque;
+        struct sockem_conf conf;
+        struct sockem_stats st;
+        char peer[INET6_ADDRSTRLEN + 16];
+
+        mtx_lock(&skm->lock);
+        conf = skm->conf;
+        mtx_unlock(&skm->lock);
+
+        sockem_stats(skm, &st);
+
+        fprintf(fp, "{\"fd\":%d,\"proto\":\"%s\",\"peer\":\"%s\","
+                "\"closed\":%"PRIu64",\"delay\":%d,\"jitter\":%d,"
+                "\"rx.thruput\":%d,\"tx.thruput\":%d,\"loss\":%d,",
+                skm->as, skm->dgram ? "udp" : "tcp",
+                sockem_ctl_peer(skm, peer, sizeof(peer)), st.closed,
+                conf.delay, conf.jitter, conf.rx_thruput, conf.tx_thruput,
+                conf.loss);
+        sockem_dir_stats_print(fp, "tx", &st.tx);
+        fprintf(fp, ",");
+        sockem_dir_stats_print(fp, "rx", &st.rx);
+        fprintf(fp, "}\n");
+}
+
+
+struct sockem_ctl_set {
+        const char *conf;  /* CSV list to apply */
+        int err;           /* set if it failed on any sockem */
+        int cnt;           /* sockems it was applied to */
+        int targets;       /* sockems to apply it to */
+        int linked;        /* all targets are in a link group */
+};
+
+/**
+ * @brief Count \p skm as a target of the sockem_ctl_set \p opaque,
+ *        for checking the config before it is applied.
+ */
+static void sockem_ctl_target (sockem_t *skm, void *opaque) {
+        struct sockem_ctl_set *set = opaque;
+
+        set->targets++;
+        set->linked &= sockem_conf_linked(skm);
+}
+
+/**
+ * @brief Apply the config of the sockem_ctl_set \p opaque to \p skm.
+ */
+static void sockem_ctl_set (sockem_t *skm, void *opaque) {
+        struct sockem_ctl_set *set = opaque;
+        struct sockem_conf *conf;
+
+        conf = sockem_conf_lock(skm);
+        if (sockem_conf_parse(conf, NULL, set->conf) == -1)
+                set->err = 1;
+        else
+                set->cnt++;
+        sockem_conf_unlock(skm);
+}
+
+
+/**
+ * @brief sockem_foreach() adapter for sockem_close().
+ */
+static void sockem_ctl_close (sockem_t *skm, void *opaque) {
+        (void)opaque;
+        sockem_close(skm);
+}
+
+
+/**
+ * @brief Run control command \p line, writing the reply to \p fp.
+ * @returns an error string, or NULL on success.
+ */
+static const char *sockem_ctl_cmd (FILE *fp, char *line) {
+        char *save;
+        char *cmd = strtok_r(line, " \t\r\n", &save);
+        char *target = strtok_r(NULL, " \t\r\n", &save);
+        char *arg = strtok_r(NULL, " \t\r\n", &save);
+        void (*cb) (sockem_t *skm, void *opaque);
+        struct sockem_ctl_set set = { .conf = arg, .linked = 1 };
+        struct sockem_conf_fx fx = SOCKEM_CONF_FX_INITIALIZER;
+        void *opaque = NULL;
+        sockem_t *skm = NULL;
+        FILE *mfp = NULL;
+        char *mbuf = NULL;
+        size_t msize = 0;
+        char *end;
+        long fd = -1;
+
+        if (!cmd)
+                return NULL;
+
+        if (!strcmp(cmd, "stats")) {
+                sockem_stats_fprint(fp);
+                return NULL;
+        } else if (!strcmp(cmd, "list")) {
+                /* Buffered to not block on the client with
+                 * sockem_lock held */
+                if (!(mfp = open_memstream(&mbuf, &msize)))
+                        return strerror(errno);
+                cb = sockem_ctl_list;
+                opaque = mfp;
+                target = "*";
+        } else if (!strcmp(cmd, "set")) {
+                if (!arg)
+                        return "usage: set <fd|*|default> <key=val,..>";
+                cb = sockem_ctl_set;
+                opaque = &set;
+        } else if (!strcmp(cmd, "close")) {
+                if (!target)
+                        return "usage: close <fd|*>";
+                cb = sockem_ctl_close;
+        } else
+                return "unknown command";
+
+        if (cb == sockem_ctl_set && !strcmp(target, "default")) {
+                struct sockem_conf *conf;
+                int r;
+
+                fx.linked = sockem_conf_linked(NULL);
+                if (sockem_conf_prep(&fx, arg) == -1 ||
+                    sockem_conf_fx_open(&fx) == -1) {
+                        sockem_conf_fx_done(&fx, 0);
+                        return "invalid config";
+                }
+                conf = sockem_conf_lock(NULL);
+                r = sockem_conf_parse(conf, NULL, arg);
+                sockem_conf_unlock(NULL);
+                sockem_conf_fx_done(&fx, r == 0);
+                return r == -1 ? "invalid config" : NULL;
+        }
+
+        if (strcmp(target, "*")) {
+                fd = strtol(target, &end, 10);
+                if (end == target || *end || fd < 0 || fd > INT_MAX)
+                        return "invalid target";
+        }
+
+        if (cb == sockem_ctl_set) {
+                mtx_lock(&sockem_lock);
+                if (fd == -1)
+                        sockem_foreach(sockem_ctl_target, &set);
+                else if ((skm = sockem_find((int)fd)))
+                        sockem_ctl_target(skm, &set);
+                mtx_unlock(&sockem_lock);
+
+                /* Nothing is created for a list without targets */
+                fx.linked = set.linked;
+                if (sockem_conf_prep(&fx, arg) == -1 ||
+                    (set.targets && sockem_conf_fx_open(&fx) == -1)) {
+                        sockem_conf_fx_done(&fx, 0);
+                        return "invalid config";
+                }
+        }
+
+        mtx_lock(&sockem_lock);
+        if (fd == -1)
+                sockem_foreach(cb, opaque);
+        else if ((skm = sockem_find((int)fd)))
+                cb(skm, opaque);
+        mtx_unlock(&sockem_lock);
+
+        /* Process-wide keys only take once applied to a sockem */
+        sockem_conf_fx_done(&fx, set.cnt > 0 && !set.err);
+
+        if (mfp) {
+                fclose(mfp);
+                fwrite(mbuf, 1, msize, fp);
+                free(mbuf);
+        }
+
+        if (fd != -1 && !skm)
+                return "no such sockem";
+        if (set.err)
+                return "invalid config";
+
+        return NULL;
+}
+
+
+/**
+ * @brief Serve control connection \p fd until it is closed.
+ */
+static void sockem_ctl_serve (int fd) {
+        FILE *in, *out;
+        char *line = NULL;
+        size_t size = 0;
+        int fd2;
+
+        if ((fd2 = dup(fd)) == -1) {
+                sockem_close0(fd);
+                return;
+        }
+
+        if (!(in = fdopen(fd, "r")) || !(out = fdopen(fd2, "w"))) {
+                if (in)
+                        fclose(in);
+                else
+                        sockem_close0(fd);
+                sockem_close0(fd2);
+                return;
+        }
+
+        while (getline(&line, &size, in) != -1) {
+                const char *err = sockem_ctl_cmd(out, line);
+
+                if (err)
+                        fprintf(out, "error: %s\n", err);
+                else
+                        fprintf(out, "ok\n");
+                if (fflush(out) == EOF)
+                        break;
+        }
+
+        free(line);
+        fclose(in);
+        fclose(out);
+}
+
+
+/**
+ * @brief SOCKEM_CTL thread: serves one control connection at a time.
+ */
+static void *sockem_ctl_run (void *arg) {
+        int lfd = (int)(intptr_t)arg;
+
+        while (1) {
+                int fd = sockem_accept0(lfd, NULL, NULL, SOCK_CLOEXEC);
+
+                if (fd == -1) {
+                        if (errno == EINTR || errno == ECONNABORTED)
+                                continue;
+                        fprintf(stderr, "%% libsockem: SOCKEM_CTL: "
+                                "accept failed: %s\n", strerror(errno));
+                        break;
+                }
+
+                sockem_ctl_serve(fd);
+        }
+
+        return NULL;
+}
+
+
+static void sockem_ctl_unlink (void) {
+        unlink(sockem_ctl_path);
+}
+
+
+/**
+ * @brief Listen for control connections on SOCKEM_CTL Unix socket path
+ *        \p str, in which "%p" is replaced by the process id.
+ */
+static void sockem_ctl_init (const char *str) {
+        struct sockaddr_un sun = { .sun_family = AF_UNIX };
+        const char *p = strstr(str, "%p");
+        int lfd;
+        int n;
+        thrd_t thrd;
+
+        if (p)
+                n = snprintf(sun.sun_path, sizeof(sun.sun_path), "%.*s%d%s",
+                             (int)(p - str), str, (int)getpid(), p + 2);
+        else
+                n = snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", str);
+
+        if (n < 0 || (size_t)n >= sizeof(sun.sun_path)) {
+                fprintf(stderr, "%% libsockem: SOCKEM_CTL: path too long\n");
+                return;
+        }
+
+        /* Replace a stale socket of a previous run */
+        unlink(sun.sun_path);
+
+        if ((lfd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) == -1 ||
+            bind(lfd, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+            listen(lfd, 4) == -1) {
+                fprintf(stderr, "%% libsockem: SOCKEM_CTL: "
+                        "failed to listen on %s: %s\n",
+                        sun.sun_path, strerror(errno));
+                if (lfd != -1)
+                        sockem_close0(lfd);
+                return;
+        }
+
+        sockem_ctl_path = strdup(sun.sun_path);
+        atexit(sockem_ctl_unlink);
+
+        if (thrd_create(&thrd, sockem_ctl_run, (void *)(intptr_t)lfd) == 0) {
+                sockem_pool_confine(thrd);
+                pthread_detach(thrd);
+        }
+}
+
+
+/**
+ * Destination rules from SOCKEM_CONF, see sockem_rules_parse().
+ * Kept sorted by specificity: longest prefix first, a specific port
+ * before any port, then in configuration order, so the first match
+ * is the most specific one.
+ */
+struct sockem_rule {
+        int     family;      /* AF_INET, AF_INET6 or AF_UNSPEC for any */
+        uint8_t addr[16];    /* network address */
+        int     plen;        /* prefix length in bits */
+        int     port;        /* port, -1 for any */
+        int     bypass;      /* pass matching connects through */
+        int     idx;         /* configuration order */
+        struct sockem_conf conf; /* profile of matching connects */
+};
+
+static struct sockem_rule *sockem_rules;
+static int sockem_rule_cnt;
+
+
+/**
+ * @brief Parse destination \p str: an IPv4 or IPv6 address or "*",
+ *        with an optional "/<prefixlen>" and ":<port>" suffix,
+ *        IPv6 addresses with a port within brackets.
+ *
+ * E.g.: "10.0.0.0/8", "10.1.2.3:9092", "*:53", "[fd00::/8]:443", "::1"
+ *
+ * @returns 0 on success or -1 on parse error.
+ */
+static int sockem_rule_parse_dst (struct sockem_rule *rule, char *str) {
+        char *port = NULL, *plen;
+        char *end;
+        long v;
+        int max;
+
+        rule->port = -1;
+
+        if (*str == '[') {
+                char *e = strchr(str, ']');
+                if (!e)
+                        return -1;
+                *e = '\0';
+                str++;
+                if (e[1] == ':')
+                        port = e + 2;
+                else if (e[1])
+                        return -1;
+        } else if (strchr(str, '.') || *str == '*') {
+                if ((port = strrchr(str, ':')))
+                        *(port++) = '\0';
+        }
+
+        if (port && strcmp(port, "*")) {
+                v = strtol(port, &end, 10);
+                if (end == port || *end || v < 0 || v > 65535)
+                        return -1;
+                rule->port = (int)v;
+        }
+
+        if ((plen = strchr(str, '/')))
+                *(plen++) = '\0';
+
+        if (!strcmp(str, "*")) {
+                rule->family = AF_UNSPEC;
+                rule->plen = 0;
+                return plen ? -1 : 0;
+        } else if (inet_pton(AF_INET, str, rule->addr) == 1) {
+                rule->family = AF_INET;
+                max = 32;
+        } else if (inet_pton(AF_INET6, str, rule->addr) == 1) {
+                rule->family = AF_INET6;
+                max = 128;
+        } else
+                return -1;
+
+        rule->plen = max;
+        if (plen) {
+                v = strtol(plen, &end, 10);
+                if (end == plen || *end || v < 0 || v > max)
+                        return -1;
+                rule->plen = (int)v;
+        }
+
+        if (rule->family == AF_INET6 && rule->plen >= 96 &&
+            IN6_IS_ADDR_V4MAPPED((struct in6_addr *)rule->addr)) {
+                /* IPv4-mapped connects are matched as IPv4 */
+                memmove(rule->addr, rule->addr + 12, 4);
+                rule->family = AF_INET;
+                rule->plen -= 96;
+        }
+
+        return 0;
+}
+
+
+static int sockem_rule_cmp (const void *_a, const void *_b) {
+        const struct sockem_rule *a = _a, *b = _b;
+
+        if (a->plen != b->plen)
+                return b->plen - a->plen;
+        if ((a->port == -1) != (b->port == -1))
+                return a->port == -1 ? 1 : -1;
+        return a->idx - b->idx;
+}
+
+
+/**
+ * @brief Parse SOCKEM_CONF \p str: a default config CSV list optionally
+ *        followed by ';'-separated destination rules, each a
+ *        "dst=<destination>" followed by the rule's config keys,
+ *        applied on top of the default config, or "bypass".
+ *
+ * E.g.: "delay=10;dst=10.0.0.0/8:9092,delay=100;dst=*:53,bypass"
+ *
+ * With a non-NULL \p fx \p str is only checked and its side effects
+ * collected on \p fx, see sockem_conf_prep().
+ *
+ * @remark sockem_defconf_lock must be held to apply \p str.
+ * @returns 0 on success or -1 on parse error.
+ */
+static int sockem_rules_parse (struct sockem_conf_fx *fx, const char *str) {
+        char *s = strdupa(str);
+        char *t;
+        int linked = fx && fx->linked;
+        int i;
+
+        for (i = 0 ; s ; s = t, i++) {
+                struct sockem_rule *rule, tmp;
+                char *keys, *tok, *tt;
+                char *rest;
+
+                if ((t = strchr(s, ';')))
+                        *(t++) = '\0';
+
+                if (strncmp(s, "dst=", 4)) {
+                        /* Default config, only first */
+                        if (i > 0 ||
+                            sockem_conf_parse(fx ? NULL : &sockem_defconf,
+                                              fx, s) == -1)
+                                return -1;
+                        if (fx)
+                                linked = fx->linked;
+                        continue;
+                }
+
+                if (fx) {
+                        /* On top of the default config */
+                        rule = &tmp;
+                        memset(rule, 0, sizeof(*rule));
+                        fx->linked = linked;
+                } else {
+                        sockem_rules = realloc(sockem_rules,
+                                               (sockem_rule_cnt + 1) *
+                                               sizeof(*sockem_rules));
+                        rule = &sockem_rules[sockem_rule_cnt];
+                        memset(rule, 0, sizeof(*rule));
+                        rule->idx = sockem_rule_cnt++;
+                        rule->conf = sockem_defconf;
+                }
+
+                if ((keys = strchr(s + 4, ',')))
+                        *(keys++) = '\0';
+
+                if (sockem_rule_parse_dst(rule, s + 4) == -1)
+                        return -1;
+
+                if (!keys)
+                        continue;
+
+                /* Rule's keys, except for bypass */
+                rest = alloca(strlen(keys) + 1);
+                *rest = '\0';
+                for (tok = keys ; tok ; tok = tt) {
+                        if ((tt = strchr(tok, ',')))
+                                *(tt++) = '\0';
+                        if (!strcmp(tok, "bypass"))
+                                rule->bypass = 1;
+                        else {
+                                if (*rest)
+                                        strcat(rest, ",");
+                                strcat(rest, tok);
+                        }
+                }
+
+                if (sockem_conf_parse(fx ? NULL : &rule->conf, fx,
+                                      rest) == -1)
+                        return -1;
+        }
+
+        if (fx)
+                return 0;
+
+        qsort(sockem_rules, sockem_rule_cnt, sizeof(*sockem_rules),
+              sockem_rule_cmp);
+
+        return 0;
+}
+
+
+/**
+ * @returns true if \p rule matches \p addr of \p family and \p port.
+ */
+static int sockem_rule_match (const struct sockem_rule *rule, int family,
+                              const uint8_t *addr, int port) {
+        int bytes = rule->plen / 8, bits = rule->plen % 8;
+
+        if (rule->port != -1 && rule->port != port)
+                return 0;
+        if (rule->family == AF_UNSPEC)
+                return 1;
+        if (rule->family != family || memcmp(rule->addr, addr, bytes))
+                return 0;
+
+        return !bits || !((rule->addr[bytes] ^ addr[bytes]) &
+                          (0xff << (8 - bits)));
+}
+
+
+/**
+ * @brief Classify a connect() of \p sockfd to \p addr, or an accepted
+ *        \p sockfd from client \p addr if \p lport is not -1: only TCP
+ *        connections to (or from) IPv4 and IPv6 addresses matching a
+ *        rule, or any address if there are no rules, are proxied.
+ *
+ * Accepted connections are matched by the client address and the local
+ * port \p lport, and only proxied if the profile has the accept key set.
+ * Likewise UDP connects are only proxied if the profile has the udp key
+ * set.
+ *
+ * @returns true if the connection is to be proxied with the profile in
+ *          \p *confp, NULL for the default config.
+ */
+static int sockem_classify (int sockfd, const struct sockaddr *addr,
+                            socklen_t addrlen, int lport,
+                            const struct sockem_conf **confp) {
+        const struct sockem_conf *conf = &sockem_defconf;
+        const uint8_t *a;
+        int family;
+        int port;
+        int type;
+        int dgram;
+        socklen_t len = sizeof(type);
+        int i;
+
+        if (!addr)
+                return 0;
+
+        if (addr->sa_family == AF_INET &&
+            addrlen >= sizeof(struct sockaddr_in)) {
+                const struct sockaddr_in *sin = (const void *)addr;
+                a = (const uint8_t *)&sin->sin_addr;
+                port = ntohs(sin->sin_port);
+                family = AF_INET;
+
+        } else if (addr->sa_family == AF_INET6 &&
+                   addrlen >= sizeof(struct sockaddr_in6)) {
+                const struct sockaddr_in6 *sin6 = (const void *)addr;
+                a = sin6->sin6_addr.s6_addr;
+                port = ntohs(sin6->sin6_port);
+                family = AF_INET6;
+                if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+                        /* Match IPv4 rules */
+                        a += 12;
+                        family = AF_INET;
+                }
+
+        } else
+                return 0;
+
+        if (getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &type, &len) == -1 ||
+            (type != SOCK_STREAM && type != SOCK_DGRAM))
+                return 0;
+        dgram = type == SOCK_DGRAM;
+#ifdef SO_PROTOCOL
+        len = sizeof(type);
+        if (getsockopt(sockfd, SOL_SOCKET, SO_PROTOCOL, &type, &len) == 0 &&
+            type != (dgram ? IPPROTO_UDP : IPPROTO_TCP))
+                return 0;
+#endif
+
+        if (lport != -1)
+                port = lport;
+
+        *confp = NULL;
+        for (i = 0 ; i < sockem_rule_cnt ; i++) {
+                if (!sockem_rule_match(&sockem_rules[i], family, a, port))
+                        continue;
+                if (sockem_rules[i].bypass)
+                        return 0;
+                conf = *confp = &sockem_rules[i].conf;
+                break;
+        }
+
+        if (sockem_rule_cnt && i == sockem_rule_cnt)
+                return 0;
+
+        return (lport == -1 || conf->accept) && (!dgram || conf->udp);
+}
+
+
+/**
+ * @brief sockem_connect() with config template \p conf.
+ */
+static sockem_t *sockem_connect_conf (int sockfd,
+                                      const struct sockaddr *addr,
+                                      socklen_t addrlen,
+                                      const struct sockem_conf *conf, ...) {
+        sockem_t *skm;
+        va_list ap;
+
+        va_start(ap, conf);
+        skm = sockem_vconnect(sockfd, addr, addrlen, conf, ap);
+        va_end(ap);
+
+        return skm;
+}
+
+
+/**
+ * @brief sockem_wrap() with config template \p conf.
+ */
+static sockem_t *sockem_wrap_conf (int sockfd,
+                                   const struct sockem_conf *conf, ...) {
+        sockem_t *skm;
+        va_list ap;
+
+        va_start(ap, conf);
+        skm = sockem_vwrap(sockfd, conf, ap);
+        va_end(ap);
+
+        return skm;
+}
+
+
+/**
+ * @brief Initialize preloadable libsockem once.
+ */
+static void sockem_init (void) {
+        struct sockem_conf_fx fx = SOCKEM_CONF_FX_INITIALIZER;
+        const char *conf_str;
+
+        mtx_init(&sockem_lock);
+
+        /* Resolved first: parsing SOCKEM_CONF may load trace files,
+         * and the write() of error messages is overloaded. */
+        sockem_orig_connect = dlsym(RTLD_NEXT, "connect");
+        sockem_orig_accept4 = dlsym(RTLD_NEXT, "accept4");
+        sockem_orig_shutdown = dlsym(RTLD_NEXT, "shutdown");
+        sockem_orig_send = dlsym(RTLD_NEXT, "send");
+        sockem_orig_sendto = dlsym(RTLD_NEXT, "sendto");
+        sockem_orig_sendmsg = dlsym(RTLD_NEXT, "sendmsg");
+        sockem_orig_writev = dlsym(RTLD_NEXT, "writev");
+        sockem_orig_sendfile = dlsym(RTLD_NEXT, "sendfile");
+        __atomic_store_n(&sockem_orig_write, dlsym(RTLD_NEXT, "write"),
+                         __ATOMIC_RELEASE);
+        __atomic_store_n(&sockem_orig_close, dlsym(RTLD_NEXT, "close"),
+                         __ATOMIC_RELEASE);
+
+        conf_str = getenv("SOCKEM_CONF");
+        if (!conf_str)
+                conf_str = "";
+
+        /* Parse once into the template copied by each sockem_connect()
+         * and the destination rules */
+        fx.linked = sockem_conf_linked(NULL);
+        if (sockem_rules_parse(&fx, conf_str) == -1 ||
+            sockem_conf_fx_open(&fx) == -1)
+                sockem_conf_invalid = 1;
+        mtx_lock(&sockem_defconf_lock);
+        if (sockem_conf_invalid || sockem_rules_parse(NULL, conf_str) == -1) {
+                fprintf(stderr, "%% libsockem: invalid SOCKEM_CONF \"%s\": "
+                        "connections will fail\n", conf_str);
+                sockem_conf_invalid = 1;
+        }
+        mtx_unlock(&sockem_defconf_lock);
+        sockem_conf_fx_done(&fx, !sockem_conf_invalid);
+
+        if (sockem_defconf.debug)
+                fprintf(stderr, "%% libsockem pre-loaded (%s), "
+                        "%d destination rule(s)\n",
+                        conf_str, sockem_rule_cnt);
+
+        if ((conf_str = getenv("SOCKEM_STATS")) && *conf_str)
+                sockem_stats_init(conf_str);
+
+        if ((conf_str = getenv("SOCKEM_CTL")) && *conf_str)
+                sockem_ctl_init(conf_str);
+}
+
+
+static void sockem_inproc_put (sockem_t *skm);
+
+/**
+ * @returns \p fd's in-process sockem, referenced by the calling send()
+ *          overload until sockem_inproc_put(), or NULL if \p fd is not
+ *          forwarded in-process (anymore) and its sends go straight
+ *          to the socket.
+ */
+static sockem_t *sockem_inproc_get (int fd) {
+        struct sockem_fdent *slot;
+        sockem_t *skm;
+        int run;
+
+        /* Fast path for all other fds, e.g., files. */
+        if (!sockem_inmap_test(fd) &&
+            __atomic_load_n(&sockem_orig_write, __ATOMIC_ACQUIRE))
+                return NULL;
+
+        pthread_once(&sockem_once, sockem_init);
+
+        /* In-process sockems are all in sockem_fdtab */
+        if (!sockem_inmap_test(fd) || !(slot = sockem_fdtab_slot(fd, 0)))
+                return NULL;
+
+        /* Lock-free: sockem_close() unlinks the sockem and then waits
+         * for the fd's lookups, which it may have raced, to take their
+         * reference or give up. */
+        __atomic_add_fetch(&slot->pins, 1, __ATOMIC_SEQ_CST);
+        if ((skm = __atomic_load_n(&slot->skm, __ATOMIC_SEQ_CST)))
+                __atomic_add_fetch(&skm->insenders, 1, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&slot->pins, 1, __ATOMIC_RELEASE);
+
+        if (!skm)
+                return NULL;
+
+        run = __atomic_load_n(&skm->run, __ATOMIC_ACQUIRE);
+        if (!skm->inproc || (run != SOCKEM_START && run != SOCKEM_RUN)) {
+                sockem_inproc_put(skm);
+                return NULL;
+        }
+
+        return skm;
+}
+
+
+/**
+ * @brief Release the reference of sockem_inproc_get(), letting a
+ *        waiting sockem_close() proceed.
+ */
+static void sockem_inproc_put (sockem_t *skm) {
+        mtx_lock(&skm->lock);
+        if (!__atomic_sub_fetch(&skm->insenders, 1, __ATOMIC_RELEASE))
+                cnd_broadcast(&skm->cnd);
+        mtx_unlock(&skm->lock);
+}
+
+
+/**
+ * @returns the bytes in-process \p skm may take on before its tx delay
+ *          line is at qmax.
+ * @remark skm lock must be held.
+ */
+static size_t sockem_inproc_room (sockem_t *skm) {
+        size_t used;
+
+        if (!skm->conf.qmax)
+                return SIZE_MAX; /* unlimited */
+
+        used = skm->inqlen +
+                __atomic_load_n(&skm->dir[SOCKEM_TX].qlen, __ATOMIC_SEQ_CST);
+
+        return used < skm->conf.qmax ? skm->conf.qmax - used : 0;
+}
+
+
+/**
+ * @brief Copy the \p len bytes gathered from the buffers at \p iov,
+ *        following \p skip bytes already taken, to in-process
+ *        \p skm's inbox for sockem_inproc_drain(), and wake up the
+ *        forwarder if the inbox was empty.
+ * @returns the number of bytes taken, short of \p len if out of memory.
+ * @remark skm lock must be held.
+ */
+static size_t sockem_inproc_enq (sockem_t *skm, const struct iovec *iov,
+                                 size_t skip, size_t len) {
+        sockem_ts_t now = sockem_clock();
+        int wake = TAILQ_EMPTY(&skm->inq);
+        size_t taken = 0;
+        int i = 0;
+
+        while (len > 0) {
+                /* Past the pool's cap if need be: qmax bounds the
+                 * inbox and delay line instead. */
+                struct sockem_chunk *chunk = sockem_chunk_new(len, 1);
+                size_t n = len;
+
+                if (!chunk)
                         break;
 
-                for (i = 0 ; r > 0 && i < 2 ; i++) {
-                        if (pfd[i].revents & (POLLHUP|POLLERR)) {
-                                skm->run = SOCKEM_TERM;
+                if (chunk->cls != -1 && n > sockem_chunk_cap(chunk->cls))
+                        n = sockem_chunk_cap(chunk->cls);
+                chunk->len = n;
+                chunk->ts = now;
+                len -= n;
+                taken += n;
 
-                        } else if (pfd[i].revents & POLLIN) {
-                                if (sockem_recv_fwd(skm,
-                                                    pfd[i].fd,
-                                                    pfd[i^1].fd) == -1) {
-                                        skm->run = SOCKEM_TERM;
-                                        break;
-                                }
+                while (n > 0) {
+                        size_t m;
+
+                        while (skip >= iov[i].iov_len) {
+                                skip -= iov[i].iov_len;
+                                i++;
                         }
+
+                        m = SOCKEM_MIN(n, iov[i].iov_len - skip);
+                        memcpy(chunk->data + (chunk->len - n),
+                               (const char *)iov[i].iov_base + skip, m);
+                        skip += m;
+                        n -= m;
                 }
 
-                mtx_lock(&skm->lock);
-                skm->use = skm->conf;
+                TAILQ_INSERT_TAIL(&skm->inq, chunk, link);
         }
- done:
-        if (cs != -1)
-                sockem_close0(cs);
-        sockem_close_all(skm);
 
-        mtx_unlock(&skm->lock);
-        free(skm->buf);
+        skm->inqlen += taken;
 
+        if (wake && taken > 0)
+                sockem_wrkr_post(skm);
 
-        return NULL;
+        return taken;
 }
 
 
-
 /**
- * @brief Connect socket \p s to \p addr
+ * @brief Send the buffers \p iov on in-process \p skm with send()
+ *        flags \p flags: queue them for the forwarder, which shapes
+ *        and sends them on the application socket.
+ *
+ * Blocks, unless the socket is non-blocking or MSG_DONTWAIT is set,
+ * while the inbox and tx delay line hold qmax bytes, see
+ * sockem_inproc_wake().
+ *
+ * @returns the number of bytes taken, or -1 with errno set on error.
  */
-static int sockem_do_connect (int s, const struct sockaddr *addr,
-                              socklen_t addrlen) {
-        int r;
+static ssize_t sockem_inproc_sendv (sockem_t *skm, const struct iovec *iov,
+                                    int iovcnt, int flags) {
+        size_t len = 0, sent = 0;
+        int nonblock = -1;
+        int err = 0;
+        int i;
 
-        r = sockem_connect0(s, addr, addrlen);
-        if (r == SOCKET_ERROR) {
-                int serr = socket_errno();
-                if (serr != EINPROGRESS
-#ifdef _MSC_VER
-                    && serr != WSAEWOULDBLOCK
-#endif
-                        ) {
-#ifndef _MSC_VER
-                        errno = serr;
-#endif
-                        return -1;
-                }
+        for (i = 0 ; i < iovcnt ; i++)
+                len += iov[i].iov_len;
+
+        /* Urgent data would have to overtake the delay line. */
+        if (flags & MSG_OOB) {
+                errno = EOPNOTSUPP;
+                return -1;
         }
 
-        return 0;
-}
+        if (!len)
+                return 0;
 
+        mtx_lock(&skm->lock);
+        while (sent < len) {
+                size_t room;
 
-sockem_t *sockem_connect (int sockfd, const struct sockaddr *addr,
-                          socklen_t addrlen, ...) {
-        sockem_t *skm;
-        int ls, ps;
-        struct sockaddr_in6 sin6 = { sin6_family: addr->sa_family };
-        socklen_t addrlen2 = addrlen;
-        va_list ap;
+                if (skm->ineof ||
+                    (skm->run != SOCKEM_START && skm->run != SOCKEM_RUN)) {
+                        err = EPIPE;
+                        break;
+                }
 
-        /* Create internal app listener socket */
-        ls = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
-        if (ls == -1)
-                return NULL;
+                if ((room = sockem_inproc_room(skm)) > 0) {
+                        size_t n = SOCKEM_MIN(room, len - sent);
+                        size_t taken = sockem_inproc_enq(skm, iov, sent, n);
 
-        if (bind(ls, (struct sockaddr *)&sin6, addrlen) == -1) {
-                sockem_close0(ls);
-                return NULL;
-        }
+                        sent += taken;
+                        if (taken < n) {
+                                err = ENOBUFS;
+                                break;
+                        }
+                        continue;
+                }
 
-        /* Get bound address */
-        if (getsockname(ls, (struct sockaddr *)&sin6, &addrlen2) == -1) {
-                sockem_close0(ls);
-                return NULL;
-        }
+                if (nonblock == -1)
+                        nonblock = (flags & MSG_DONTWAIT) ||
+                                (fcntl(skm->as, F_GETFL) & O_NONBLOCK);
 
-        if (listen(ls, 1) == -1) {
-                sockem_close0(ls);
-                return NULL;
-        }
+                if (nonblock) {
+                        /* Checked again once the forwarder can tell,
+                         * see sockem_inproc_wake() */
+                        __atomic_store_n(&skm->infull, 1, __ATOMIC_SEQ_CST);
+                        if (sockem_inproc_room(skm) > 0)
+                                continue;
+                        if (!sent)
+                                err = EAGAIN;
+                        break;
+                }
 
-        /* Create internal peer socket */
-        ps = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
-        if (ps == -1) {
-                sockem_close0(ls);
-                return NULL;
+                __atomic_add_fetch(&skm->inwait, 1, __ATOMIC_SEQ_CST);
+                if (!sockem_inproc_room(skm))
+                        cnd_wait(&skm->cnd, &skm->lock);
+                __atomic_sub_fetch(&skm->inwait, 1, __ATOMIC_RELAXED);
         }
+        mtx_unlock(&skm->lock);
 
-        /* Connect to peer */
-        if (sockem_do_connect(ps, addr, addrlen) == -1) {
-                sockem_close0(ls);
-                sockem_close0(ps);
-                return NULL;
-        }
+        if (sent)
+                return (ssize_t)sent;
 
-        /* Create sockem handle */
-        skm = calloc(1, sizeof(*skm));
-        skm->as = sockfd;
-        skm->ls = ls;
-        skm->ps = ps;
-        mtx_init(&skm->lock);
+        if (err == EPIPE && !(flags & MSG_NOSIGNAL))
+                raise(SIGPIPE);
+        errno = err;
+        return -1;
+}
 
-        /* Default config*/
-        skm->conf.rx_thruput = 1 << 30;
-        skm->conf.tx_thruput = 1 << 30;
-        skm->conf.delay = 0;
-        skm->conf.jitter = 0;
-        skm->conf.bufsz = 1024*1024;
 
-        /* Apply passed configuration */
-        va_start(ap, addrlen);
-        if (sockem_vset(skm, ap) == -1) {
-                va_end(ap);
-                sockem_close(skm);
-                return NULL;
-        }
-        va_end(ap);
+/**
+ * @brief connect(2) overload
+ */
+int connect (int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+        const struct sockem_conf *conf;
+        sockem_t *skm;
 
-        mtx_lock(&skm->lock);
-        skm->run = SOCKEM_START;
+        pthread_once(&sockem_once, sockem_init);
 
-        /* Create pipe thread */
-        if (thrd_create(&skm->thrd, sockem_run, skm) != 0) {
-                mtx_unlock(&skm->lock);
-                sockem_close(skm);
-                return NULL;
+        if (sockem_conf_invalid) {
+                errno = EINVAL;
+                return -1;
         }
-        mtx_unlock(&skm->lock);
 
-        /* Connect application socket to listen socket */
-        if (sockem_do_connect(sockfd,
-                              (struct sockaddr *)&sin6, addrlen2) == -1) {
-                sockem_close(skm);
-                return NULL;
-        }
+        if (sockem_fdmap_test(sockfd)) {
+                int err = 0;
 
-        mtx_lock(&skm->lock);
-        skm->linked = 1;
-        mtx_unlock(&skm->lock);
+                /* UDP sockets may be connected again, or dissolved with
+                 * AF_UNSPEC: stop forwarding to the previous peer.
+                 * TCP sockets are connected already, or still
+                 * completing the emulated handshake. */
+                mtx_lock(&sockem_lock);
+                if ((skm = sockem_find(sockfd)) && skm->dgram) {
+                        sockem_close(skm);
+                } else if (skm) {
+                        mtx_lock(&skm->lock);
+                        if (skm->conn_err == -1)
+                                err = EALREADY;
+                        else
+                                err = skm->conn_err ? skm->conn_err : EISCONN;
+                        mtx_unlock(&skm->lock);
+                }
+                mtx_unlock(&sockem_lock);
 
-#ifdef LIBSOCKEM_PRELOAD
-        mtx_lock(&sockem_lock);
-        LIST_INSERT_HEAD(&sockems, skm, link);
-        mtx_unlock(&sockem_lock);
-#else
-        LIST_INSERT_HEAD(&sockems, skm, link);
-#endif
+                if (err) {
+                        errno = err;
+                        return -1;
+                }
+        }
 
-        return skm;
-}
+        if (!sockem_classify(sockfd, addr, addrlen, -1, &conf))
+                return sockem_orig_connect(sockfd, addr, addrlen);
 
-void sockem_close (sockem_t *skm) {
+        skm = sockem_connect_conf(sockfd, addr, addrlen, conf, NULL);
+        if (!skm)
+                return -1;
 
-        mtx_lock(&skm->lock);
+        if (!skm->dgram && (fcntl(sockfd, F_GETFL) & O_NONBLOCK)) {
+                /* The peer connect completes in the background,
+                 * as a non-blocking connect() does. */
+                errno = EINPROGRESS;
+                return -1;
+        }
 
-        /* If thread is running let it close the sockets
-         * to avoid race condition. */
-        if (skm->run == SOCKEM_START ||
-            skm->run == SOCKEM_RUN)
-                skm->run = SOCKEM_TERM;
-        else
-                sockem_close_all(skm);
+        return 0;
+}
 
-        /* LIBSOCKEM_PRELOAD: caller must hold sockem_lock. */
-        if (skm->linked)
-                LIST_REMOVE(skm, link);
+/**
+ * @brief accept4(2) overload
+ */
+int accept4 (int sockfd, struct sockaddr *addr, socklen_t *addrlen,
+             int flags) {
+        const struct sockem_conf *conf;
+        struct sockaddr_in6 peer, local;
+        socklen_t plen = sizeof(peer), llen = sizeof(local);
+        int fd;
+        int err;
 
-        mtx_unlock(&skm->lock);
+        pthread_once(&sockem_once, sockem_init);
 
-        thrd_join(skm->thrd, NULL);
+        if ((fd = sockem_orig_accept4(sockfd, addr, addrlen, flags)) == -1)
+                return -1;
 
-        mtx_destroy(&skm->lock);
+        /* The caller's addr may be NULL or truncated.
+         * sin_port and sin6_port share their offset. */
+        if (sockem_conf_invalid ||
+            getpeername(fd, (struct sockaddr *)&peer, &plen) == -1 ||
+            getsockname(fd, (struct sockaddr *)&local, &llen) == -1 ||
+            peer.sin6_family != local.sin6_family ||
+            !sockem_classify(fd, (struct sockaddr *)&peer, plen,
+                             ntohs(local.sin6_port), &conf))
+                return fd;
 
+        if (!sockem_wrap_conf(fd, conf, NULL)) {
+                err = errno;
+                sockem_close0(fd);
+                errno = err;
+                return -1;
+        }
 
-        free(skm);
+        return fd;
 }
 
+/**
+ * @brief accept(2) overload
+ */
+int accept (int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+        return accept4(sockfd, addr, addrlen, 0);
+}
 
 /**
- * @brief Set single conf key.
- * @remark lock must be held.
- * @returns 0 on success or -1 if key is unknown
+ * @brief close(2) overload
  */
-static int sockem_set0 (sockem_t *skm, const char *key, int val) {
-        if (!strcmp(key, "rx.thruput") ||
-            !strcmp(key, "rx.throughput"))
-                skm->conf.rx_thruput = val;
-        else if (!strcmp(key, "tx.thruput") ||
-                 !strcmp(key, "tx.throughput"))
-                skm->conf.tx_thruput = val;
-        else if (!strcmp(key, "delay"))
-                skm->conf.delay = val;
-        else if (!strcmp(key, "jitter"))
-                skm->conf.jitter = val;
-        else if (!strcmp(key, "rx.bufsz"))
-                skm->conf.bufsz = val;
-        else if (!strcmp(key, "debug"))
-                skm->conf.debug = val;
-        else if (!strcmp(key, "true"))
-                ; /* dummy key for allowing non-empty but default config */
-        else if (!strchr(key, ',')) {
-                char *s = strdupa(key);
-                while (*s) {
-                        char *t = strchr(s, ',');
-                        char *d = strchr(s, '=');
-                        if (t)
-                                *t = '\0';
-                        if (!d)
-                                return -1;
-                        *(d++) = '\0';
+int close (int fd) {
+        sockem_t *skm;
+        int (*orig_close) (int);
 
-                        if (sockem_set0(skm, s, atoi(d)) == -1)
-                                return -1;
+        /* Fast path for fds not managed by sockem, e.g., files. */
+        if (!sockem_fdmap_test(fd) &&
+            (orig_close = __atomic_load_n(&sockem_orig_close,
+                                          __ATOMIC_ACQUIRE)))
+                return orig_close(fd);
 
-                        if (!t)
-                                break;
-                        s += 1;
-                }
-        } else
-                return -1;
-        return 0;
-}
+        pthread_once(&sockem_once, sockem_init);
+
+        mtx_lock(&sockem_lock);
+        skm = sockem_find(fd);
+
+        if (skm)
+                sockem_close(skm);
+        mtx_unlock(&sockem_lock);
 
+        return sockem_close0(fd);
+}
 
 /**
- * @brief Set sockem config parameters
+ * @brief shutdown(2) overload: in-process the sending side is shut down
+ *        once the data sent before has left the delay line.
  */
-static int sockem_vset (sockem_t *skm, va_list ap) {
-        const char *key;
-        int val;
+int shutdown (int sockfd, int how) {
+        sockem_t *skm;
+        int r = 0;
 
-        mtx_lock(&skm->lock);
-        while ((key = va_arg(ap, const char *))) {
-                val = va_arg(ap, int);
-                if (sockem_set0(skm, key, val) == -1) {
-                        mtx_unlock(&skm->lock);
-                        return -1;
+        if (!(skm = sockem_inproc_get(sockfd)))
+                return sockem_orig_shutdown(sockfd, how);
+
+        if (how == SHUT_RD || how == SHUT_RDWR)
+                r = sockem_orig_shutdown(sockfd, SHUT_RD);
+
+        if (how == SHUT_WR || how == SHUT_RDWR) {
+                mtx_lock(&skm->lock);
+                if (!skm->ineof) {
+                        skm->ineof = 1;
+                        sockem_wrkr_post(skm);
                 }
+                mtx_unlock(&skm->lock);
         }
-        mtx_unlock(&skm->lock);
 
-        return 0;
+        sockem_inproc_put(skm);
+
+        return r;
 }
 
-int sockem_set (sockem_t *skm, ...) {
-        va_list ap;
-        int r;
+/**
+ * @brief send(2) overload
+ */
+ssize_t send (int sockfd, const void *buf, size_t len, int flags) {
+        struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+        sockem_t *skm;
+        ssize_t r;
 
-        va_start(ap, skm);
-        r = sockem_vset(skm, ap);
-        va_end(ap);
+        if (!(skm = sockem_inproc_get(sockfd)))
+                return sockem_orig_send(sockfd, buf, len, flags);
+
+        r = sockem_inproc_sendv(skm, &iov, 1, flags);
+        sockem_inproc_put(skm);
 
         return r;
 }
 
-
-sockem_t *sockem_find (int sockfd) {
+/**
+ * @brief sendto(2) overload, the address is ignored as for any
+ *        connected TCP socket.
+ */
+ssize_t sendto (int sockfd, const void *buf, size_t len, int flags,
+                const struct sockaddr *addr, socklen_t addrlen) {
+        struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
         sockem_t *skm;
+        ssize_t r;
 
-        LIST_FOREACH(skm, &sockems, link)
-                if (skm->as == sockfd)
-                        return skm;
+        if (!(skm = sockem_inproc_get(sockfd)))
+                return sockem_orig_sendto(sockfd, buf, len, flags,
+                                          addr, addrlen);
 
-        return NULL;
-}
+        r = sockem_inproc_sendv(skm, &iov, 1, flags);
+        sockem_inproc_put(skm);
 
+        return r;
+}
 
-#ifdef LIBSOCKEM_PRELOAD
 /**
- * Provide overloading socket APIs and conf bootstrapping from env vars.
- *
+ * @brief sendmsg(2) overload, control messages are ignored.
  */
+ssize_t sendmsg (int sockfd, const struct msghdr *msg, int flags) {
+        sockem_t *skm;
+        ssize_t r;
+
+        if (!(skm = sockem_inproc_get(sockfd)))
+                return sockem_orig_sendmsg(sockfd, msg, flags);
+
+        r = sockem_inproc_sendv(skm, msg->msg_iov, (int)msg->msg_iovlen,
+                                flags);
+        sockem_inproc_put(skm);
+
+        return r;
+}
 
 /**
- * @brief Initialize preloadable libsockem once.
+ * @brief write(2) overload
  */
-static void sockem_init (void) {
-        mtx_init(&sockem_lock);
-        sockem_conf_str = getenv("SOCKEM_CONF");
-        if (!sockem_conf_str)
-                sockem_conf_str = "";
-        if (strstr(sockem_conf_str, "debug"))
-                fprintf(stderr, "%% libsockem pre-loaded (%s)\n",
-                        sockem_conf_str);
-        sockem_orig_connect = dlsym(RTLD_NEXT, "connect");
-        sockem_orig_close = dlsym(RTLD_NEXT, "close");
-}
+ssize_t write (int fd, const void *buf, size_t count) {
+        struct iovec iov = { .iov_base = (void *)buf, .iov_len = count };
+        sockem_t *skm;
+        ssize_t r;
+
+        if (!(skm = sockem_inproc_get(fd)))
+                return sockem_orig_write(fd, buf, count);
+
+        r = sockem_inproc_sendv(skm, &iov, 1, 0);
+        sockem_inproc_put(skm);
 
+        return r;
+}
 
 /**
- * @brief connect(2) overload
+ * @brief writev(2) overload
  */
-int connect (int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+ssize_t writev (int fd, const struct iovec *iov, int iovcnt) {
         sockem_t *skm;
+        ssize_t r;
 
-        pthread_once(&sockem_once, sockem_init);
+        if (!(skm = sockem_inproc_get(fd)))
+                return sockem_orig_writev(fd, iov, iovcnt);
 
-        skm = sockem_connect(sockfd, addr, addrlen, sockem_conf_str, 0, NULL);
-        if (!skm)
-                return -1;
+        r = sockem_inproc_sendv(skm, iov, iovcnt, 0);
+        sockem_inproc_put(skm);
 
-        return 0;
+        return r;
 }
 
 /**
- * @brief close(2) overload
+ * @brief sendfile(2) overload: in-process the file data is read and sent
+ *        as with write(), up to 64 KB per call.
  */
-int close (int fd) {
+ssize_t sendfile (int out_fd, int in_fd, off_t *offset, size_t count) {
+        struct iovec iov;
         sockem_t *skm;
+        ssize_t r;
 
-        pthread_once(&sockem_once, sockem_init);
+        if (!(skm = sockem_inproc_get(out_fd)))
+                return sockem_orig_sendfile(out_fd, in_fd, offset, count);
 
-        mtx_lock(&sockem_lock);
-        skm = sockem_find(fd);
+        if (!count) {
+                sockem_inproc_put(skm);
+                return 0;
+        }
 
-        if (skm)
-                sockem_close(skm);
-        mtx_unlock(&sockem_lock);
+        if (!(iov.iov_base = malloc(SOCKEM_MIN(count, SOCKEM_CHUNK_MAX)))) {
+                sockem_inproc_put(skm);
+                errno = ENOMEM;
+                return -1;
+        }
 
-        return sockem_close0(fd);
+        r = offset ?
+                pread(in_fd, iov.iov_base, SOCKEM_MIN(count, SOCKEM_CHUNK_MAX),
+                      *offset) :
+                read(in_fd, iov.iov_base, SOCKEM_MIN(count, SOCKEM_CHUNK_MAX));
+
+        if (r > 0) {
+                ssize_t rd = r;
+
+                iov.iov_len = (size_t)rd;
+                r = sockem_inproc_sendv(skm, &iov, 1, 0);
+
+                /* Only what was sent is consumed from the file */
+                if (offset)
+                        *offset += r > 0 ? r : 0;
+                else if (r < rd)
+                        lseek(in_fd, (off_t)(r > 0 ? r : 0) - rd, SEEK_CUR);
+        }
+
+        free(iov.iov_base);
+        sockem_inproc_put(skm);
+
+        return r;
 }
 
 #endif
@@ -28,6 +28,7 @@
 
 #pragma once
 
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
@@ -39,6 +40,18 @@ typedef struct sockem_s sockem_t;
 /**
  * @brief Connect to \p addr
  *
+ * \p sockfd may be a TCP socket or a UDP socket, in which case sockem
+ * forwards its datagrams to and from \p addr whole, one at a time
+ * on the delay line, and they may be lost or reordered, see the loss,
+ * reorder and jitter keys. Datagrams of up to 64 KB are supported.
+ *
+ * A TCP peer is connected by the forwarder with the delay applied to
+ * the handshake. If \p sockfd is blocking this returns once the peer
+ * answered, or NULL with errno set, e.g., to ECONNREFUSED. Else it
+ * returns right away with \p sockfd connected to sockem: data written
+ * is forwarded once the peer is connected, or the connection is reset
+ * if that fails.
+ *
  * See sockem_set for the va-arg list definition.
  *
  * @returns a sockem handle on success or NULL on failure.
@@ -46,6 +59,21 @@ typedef struct sockem_s sockem_t;
 sockem_t *sockem_connect (int sockfd, const struct sockaddr *addr,
                           socklen_t addrlen, ...);
 
+/**
+ * @brief Emulate on the already connected TCP socket \p sockfd, e.g.,
+ *        as returned by accept(), to shape a server's connections.
+ *
+ * The connection is moved to sockem's peer side and \p sockfd is
+ * replaced in place by a socket connected to sockem, preserving its
+ * O_NONBLOCK and FD_CLOEXEC flags. As with sockem_connect(),
+ * getpeername() on \p sockfd then returns a loopback address.
+ *
+ * See sockem_set for the va-arg list definition.
+ *
+ * @returns a sockem handle on success or NULL on failure.
+ */
+sockem_t *sockem_wrap (int sockfd, ...);
+
 /**
  * @brief Close the connection and destroy the sockem.
  */
@@ -57,15 +85,162 @@ void sockem_close (sockem_t *skm);
  * @brief Set sockem parameters by `char *key, int val` tuples.
  *
  * Keys:
- *   rx.thruput
- *   tx.thruput
- *   delay
- *   jitter
- *   rx.bufsz
+ *   rx.thruput - peer->app throughput limit in bytes/second,
+ *                0 = unlimited (default).
+ *   tx.thruput - app->peer throughput limit in bytes/second,
+ *                0 = unlimited (default).
+ *   rx.burst  - peer->app token bucket size in bytes, by default 10 ms
+ *               worth of rx.thruput but at least 1460 bytes.
+ *   tx.burst  - app->peer token bucket size in bytes, see rx.burst.
+ *   delay     - added latency in milliseconds, per direction.
+ *   jitter    - latency variation in milliseconds, sampled per chunk
+ *               from jitter.dist and added to delay. Chunks are never
+ *               reordered: a chunk sampled to be due before its
+ *               predecessor is held back until the predecessor is sent.
+ *   jitter.dist - jitter distribution, see sockem_dist_t (default
+ *               uniform). May be given by name in CSV lists, e.g.,
+ *               "jitter.dist=pareto".
+ *   seed      - jitter random generator seed, 0 = random (default).
+ *               Only effective at sockem_connect() and sockem_wrap().
+ *   loss      - datagram loss probability in per mille, 0-1000
+ *               (default 0), per direction.
+ *   reorder   - per mille of datagrams sent right away, skipping the
+ *               delay and overtaking the datagrams on the delay line,
+ *               0-1000 (default 0). Datagrams are also reordered by
+ *               jitter.
+ *   segsz     - emulated segment size in bytes, e.g., 1448 for TCP over
+ *               Ethernet, at least 64, 0 = off (default). The
+ *               throughput shapers release the byte stream in whole
+ *               segments, provided a segment fits the token bucket, and
+ *               jitter is sampled per segment rather than per read.
+ *               Segments due together are still sent with a single
+ *               writev().
+ *   rx.bufsz  - upper bound for a single read from the input socket,
+ *               buffers are drawn from a shared pool in chunks of
+ *               at most 64 KB.
+ *   qmax      - delay line capacity in bytes per direction, reading from
+ *               the input socket is paused while full (default 16 MB,
+ *               0 = unlimited).
+ *   splice    - forward with zero-copy splice() while delay, jitter and
+ *               throughput are unset (default 1).
+ *   socketpair - connect the application socket to sockem through a
+ *               socketpair() dup2():ed over it instead of a loopback TCP
+ *               connection (default 0). Faster to set up, but the socket
+ *               becomes AF_UNIX so TCP socket options and peer address
+ *               lookups fail on it. Only effective at sockem_connect()
+ *               and sockem_wrap(). For UDP sockets datagrams beyond
+ *               net.unix.max_dgram_qlen not yet read by the application
+ *               are lost.
+ *   accept    - preload: also proxy sockets returned by accept() and
+ *               accept4() with this config (default 0), see the README.
+ *   udp       - preload: also proxy connect()ed UDP sockets with this
+ *               config (default 0).
+ *   inproc    - preload: shape TCP connects in-process (default 0):
+ *               the application socket is connected to the peer and
+ *               its sends are queued by the send(), write() and
+ *               sendfile() overloads for the forwarder, which sends
+ *               them on the socket once due. The rx delay is added to
+ *               the sends, data from the peer is not shaped. Connects
+ *               with rx.thruput, trace, link or socketpair set are
+ *               proxied instead. Only effective at connect().
+ *   trace     - replay a recorded link: a time series of delay and
+ *               rx/tx throughput that overrides the delay and thruput
+ *               keys, starting when the connection is set up. The value
+ *               is a file path and may only be given in CSV lists,
+ *               e.g., "trace=/path/to/lte.trace", empty to unset.
+ *               Each trace file is loaded once and shared by all
+ *               connections replaying it.
+ *
+ *               Text traces have one "<ts_ms> <delay_ms> <rx_thruput>
+ *               <tx_thruput>" entry per line, with ts_ms counting
+ *               from the start of the trace, and '#' comment lines.
+ *               They repeat after the last entry plus the interval
+ *               between the last two entries.
+ *
+ *               Binary traces are memory-mapped as is: a 24 byte
+ *               header of "SOCKEMTR", then uint32s version (1),
+ *               entry count, repeat period in ms (0 = hold the last
+ *               entry) and a reserved 0, followed by the entries as
+ *               four uint32s each, in host byte order.
+ *   corrupt   - per mille of chunks, i.e., reads, segsz segments or
+ *               datagrams, with a bit flipped at random, e.g., to test
+ *               application checksums (default 0).
+ *   stall     - stall for this many ms once a second (default 0): data
+ *               read during a stall is held until it ends, as over
+ *               a radio link during handovers. Stalls start at a random
+ *               phase per connection and direction.
+ *   <stage>   - custom impairment stages, see sockem_stage_register().
  *   true (dummy, ignored)
  *
- * The key may also be a CSV-list of "key=val,key2=val2" pairs in which case
- * val must be 0 and the sentinel NULL.
+ * If \p skm is NULL the above keys set the default configuration copied
+ * by subsequently created sockems.
+ *
+ * Global keys, \p skm may be NULL:
+ *   workers   - number of shared forwarder worker threads, each serving
+ *               many sockems, assigned to the worker serving the fewest.
+ *               0 (default) runs a dedicated forwarder thread per sockem.
+ *               Must be set prior to the first sockem_connect().
+ *   cpus      - CPUs to run the forwarder threads on, as a list of CPU
+ *               numbers and ranges that may only be given in CSV lists,
+ *               e.g., "cpus=2-3,6", empty for any CPU (default). Pool
+ *               workers are pinned to one CPU each, round-robin, and
+ *               allocate their buffers on its NUMA node, dedicated
+ *               forwarder threads may run on any of the CPUs.
+ *               Applies to threads started afterwards, so should be set
+ *               prior to the first sockem_connect().
+ *   io_uring  - forward with batched io_uring reads and sends instead
+ *               of recv()/send()/splice() (default 1). Only effective
+ *               when built with WITH_IO_URING, falls back on the
+ *               standard path if io_uring is not supported by the
+ *               kernel. Must be set prior to the first sockem_connect().
+ *   mem.max   - memory cap in bytes for the shared forwarding buffer
+ *               pool (default 256 MB, 0 = unlimited). Directions that
+ *               need buffers stop reading their input socket while the
+ *               pool is exhausted.
+ *   events    - trace forwarder events to this file, truncated, see
+ *               struct sockem_event. The value is a path and may only
+ *               be given in CSV lists, e.g., "events=/tmp/app.events",
+ *               empty to stop tracing (default).
+ *   pcap      - capture the forwarded data to this pcap file, truncated,
+ *               as it is sent, timestamped with the emulated arrival.
+ *               Streams are written as synthesized TCP/IP connections,
+ *               with a handshake when first captured and a FIN
+ *               exchange at close, and datagrams as UDP/IP packets,
+ *               between the local and peer addresses. The value is a
+ *               path and may only be given in CSV lists, e.g.,
+ *               "pcap=/tmp/app.pcap", empty to stop capturing (default).
+ *               The file is memory-mapped and written back in the
+ *               background, it is completed when capture is stopped
+ *               or at exit. Packets are dropped, and counted on
+ *               stderr, if the writer falls behind or the file reaches
+ *               64 GB. While capturing data is not forwarded with
+ *               splice() or io_uring sends.
+ *   pcap.snaplen - bytes captured per packet, including the 40 or 60
+ *               byte headers, 0 = 65535 (default). Applies to pcap
+ *               files opened afterwards.
+ *
+ * Link group keys, setting up the shared bottleneck link of the
+ * sockems that joined the same link group with the link key:
+ *   link      - join the named link group, created on first use. The
+ *               value is a name and may only be given in CSV lists,
+ *               e.g., "link=uplink", empty to leave the group.
+ *               On top of their own thruput limits, members with data
+ *               queued take from the group's shared throughput, each
+ *               limited to an equal share of it, at most 16 KB ahead,
+ *               and those with input to an equal share of link.qmax.
+ *               Idle members' shares go to the others.
+ *   link.rx.thruput - group's peer->app throughput limit in
+ *               bytes/second, 0 = unlimited (default).
+ *   link.tx.thruput - group's app->peer throughput limit.
+ *   link.qmax - group's queue limit in bytes per direction: members
+ *               stop reading their input sockets while their delay
+ *               lines hold this many bytes in total,
+ *               0 = unlimited (default).
+ * These apply to the group joined by a preceding link key, in the same
+ * or an earlier call, and fail if there is none.
+ *
+ * The key may also be a CSV-list of "key=val,key2=val2" pairs, where a key
+ * without "=val" is set to 1, in which case val must be 0.
  *
  * The va-arg list must be terminated with a NULL sentinel
  *
@@ -74,9 +249,237 @@ void sockem_close (sockem_t *skm);
 int sockem_set (sockem_t *skm, ...);
 
 
+/**
+ * Jitter distributions for the jitter.dist key, as in netem.
+ * The normal, pareto and paretonormal distributions are scaled so that
+ * jitter is their standard deviation, a uniform jitter is drawn from
+ * [-jitter, jitter]. Resulting negative delays are rounded up to 0.
+ */
+typedef enum {
+        SOCKEM_DIST_UNIFORM,
+        SOCKEM_DIST_NORMAL,
+        SOCKEM_DIST_PARETO,        /* alpha 3, long tail of late chunks */
+        SOCKEM_DIST_PARETONORMAL,  /* 1/4 normal + 3/4 pareto */
+        SOCKEM_DIST__CNT
+} sockem_dist_t;
+
+
+/**
+ * Key ids for sockem_set_key(), see sockem_set() for descriptions.
+ */
+typedef enum {
+        SOCKEM_K_RX_THRUPUT,
+        SOCKEM_K_TX_THRUPUT,
+        SOCKEM_K_RX_BURST,
+        SOCKEM_K_TX_BURST,
+        SOCKEM_K_DELAY,
+        SOCKEM_K_JITTER,
+        SOCKEM_K_JITTER_DIST,
+        SOCKEM_K_SEED,
+        SOCKEM_K_LOSS,
+        SOCKEM_K_REORDER,
+        SOCKEM_K_SEGSZ,
+        SOCKEM_K_RX_BUFSZ,
+        SOCKEM_K_QMAX,
+        SOCKEM_K_SPLICE,
+        SOCKEM_K_SOCKETPAIR,
+        SOCKEM_K_ACCEPT,
+        SOCKEM_K_UDP,
+        SOCKEM_K_INPROC,
+        SOCKEM_K_DEBUG,
+        /* Global keys */
+        SOCKEM_K_WORKERS,
+        SOCKEM_K_IO_URING,
+        SOCKEM_K_MEM_MAX,
+        SOCKEM_K_PCAP_SNAPLEN,
+        /* Link group keys */
+        SOCKEM_K_LINK_RX_THRUPUT,
+        SOCKEM_K_LINK_TX_THRUPUT,
+        SOCKEM_K_LINK_QMAX,
+        SOCKEM_K__CNT,
+        /* Impairment stage keys, see sockem_stage_register() */
+        SOCKEM_K_STAGE = 64,
+        SOCKEM_K_CORRUPT = SOCKEM_K_STAGE,
+        SOCKEM_K_STALL
+} sockem_key_t;
+
+
+/**
+ * @brief Set a single sockem parameter by key id, without any string
+ *        parsing, e.g., for frequent runtime updates.
+ *
+ * @returns 0 on success or -1 if the key or value is invalid.
+ */
+int sockem_set_key (sockem_t *skm, sockem_key_t key, int val);
+
+
+
+/**
+ * Impairment stage, applied by the forwarder to each chunk of data put
+ * on a delay line: a read from the input socket, a segment of the segsz
+ * key or a datagram. A stage is enabled per connection and direction by
+ * setting its key, the stage name, to a non-zero value.
+ */
+typedef struct sockem_stage_s {
+        const char *name;  /* config key */
+        size_t size;       /* per connection and direction state,
+                            * zeroed when first enabled and freed
+                            * with the sockem, 0 for none */
+        /**
+         * Impair the \p len bytes at \p buf read at \p now (sockem's
+         * monotonic microsecond clock) on direction \p dir, 0 for
+         * app->peer and 1 for peer->app, with the key value \p val.
+         * The data may be modified in place and \p *delayp, the delay
+         * in microseconds the chunk would be released after, changed.
+         *
+         * Called from the forwarder thread, which must not block.
+         *
+         * @returns 0 to forward the chunk or -1 to drop it, which is
+         *          ignored for TCP: the byte stream is never cut.
+         */
+        int (*chunk) (sockem_t *skm, int dir, void *state, int val,
+                      char *buf, size_t len, int64_t now, int64_t *delayp);
+} sockem_stage_t;
+
+
+/**
+ * @brief Add impairment stage \p stage, which must remain valid.
+ *
+ * Stages run in the order added, following the built-in corrupt and
+ * stall stages, with the delay from the delay, jitter and trace keys.
+ * Throughput shaping applies to their output. Directions without
+ * stages enabled are not slowed down by them.
+ *
+ * Up to 14 stages may be added, their keys may then be used like any
+ * other, e.g., in SOCKEM_CONF with a constructor of a preloaded
+ * library adding the stage.
+ *
+ * @returns the stage's key id for sockem_set_key(), or -1 if the name
+ *          is taken or there are too many stages.
+ */
+int sockem_stage_register (const sockem_stage_t *stage);
+
+
+
+/**
+ * Summary of a latency histogram, in microseconds.
+ * Percentiles have a precision of about 6%.
+ */
+struct sockem_hist_stats {
+        uint64_t cnt;
+        uint64_t min;
+        uint64_t avg;
+        uint64_t p50;
+        uint64_t p90;
+        uint64_t p99;
+        uint64_t p999;
+        uint64_t max;
+};
+
+/**
+ * Per-direction forwarding statistics.
+ */
+struct sockem_dir_stats {
+        uint64_t bytes;        /* bytes forwarded */
+        uint64_t chunks;       /* writes to the output socket */
+        uint64_t queued;       /* bytes currently on the delay line */
+        uint64_t throttled_us; /* time spent throttled by the thruput
+                                * shaper, in microseconds */
+        uint64_t dropped;      /* queued bytes discarded on close, or
+                                * read but not queued for lack of
+                                * memory, breaking the connection */
+        uint64_t lost;         /* datagrams dropped by the loss key or
+                                * a stage, rejected by the output
+                                * socket, or not queued for lack of
+                                * memory */
+
+        /* Emulation accuracy, per chunk on the delay line */
+        struct sockem_hist_stats target;   /* configured delay */
+        struct sockem_hist_stats achieved; /* read to last byte sent */
+        struct sockem_hist_stats late;     /* scheduler lateness: due to
+                                            * first byte sent, excluding
+                                            * throttled directions */
+};
+
+struct sockem_stats {
+        struct sockem_dir_stats tx;  /* app->peer */
+        struct sockem_dir_stats rx;  /* peer->app */
+        uint64_t connects;     /* sockems created */
+        uint64_t closed;       /* connections torn down by sockem on
+                                * EOF or error */
+        uint64_t forced;       /* connections closed by sockem_close()
+                                * while data was still on their delay
+                                * lines or queued in-process, i.e.,
+                                * discarded */
+};
+
+/**
+ * @brief Get statistics for \p skm, or the process-wide totals of all
+ *        sockems, including closed ones, if \p skm is NULL.
+ *
+ * Counters are maintained lock-free by the forwarders and may be read at
+ * any time, but the values of the different counters are not captured
+ * atomically as a set.
+ *
+ * @returns 0 on success.
+ */
+int sockem_stats (sockem_t *skm, struct sockem_stats *stats);
+
+
+
+/**
+ * Forwarder event types, see struct sockem_event.
+ */
+typedef enum {
+        SOCKEM_EV_RECV,      /* read from the input socket or, inproc,
+                              * taken from the application's sends,
+                              * one event per datagram */
+        SOCKEM_EV_ENQUEUE,   /* chunk put on the delay line,
+                              * arg = time it is due */
+        SOCKEM_EV_RELEASE,   /* chunk sent in full and removed from the
+                              * delay line, arg = achieved delay in us */
+        SOCKEM_EV_SEND,      /* write to the output socket */
+        SOCKEM_EV_THROTTLE,  /* thruput shaper or link group started
+                              * holding back data, len = bytes held,
+                              * arg = time sending may resume */
+        SOCKEM_EV_CLOSE,     /* sockem detached from its forwarder,
+                              * arg = 1 if torn down on EOF or error */
+        SOCKEM_EV_LOST       /* len events of a forwarder were dropped,
+                              * fd = -1 */
+} sockem_event_type_t;
+
+/**
+ * Forwarder event, as traced with the events key.
+ *
+ * Each forwarder thread records its events on a lock-free ring that is
+ * drained every 10 ms to the events file: a 16 byte header of
+ * "SOCKEMEV", then uint32s version (1) and sizeof(struct sockem_event),
+ * followed by the events in host byte order. Events are ordered per
+ * forwarder thread only, and dropped, as told by SOCKEM_EV_LOST events,
+ * when the drain falls behind.
+ *
+ * When built with WITH_SDT (./configure --enable-sdt) the events are
+ * also USDT probes sockem:recv, enqueue, release, send, throttle and
+ * close with the arguments fd, dir, len and arg, which are no-ops
+ * unless a tracer is attached.
+ */
+struct sockem_event {
+        int64_t  ts;        /* CLOCK_MONOTONIC time in microseconds,
+                             * as are times in .arg */
+        int32_t  fd;        /* application socket */
+        uint8_t  type;      /* sockem_event_type_t */
+        uint8_t  dir;       /* 0 = app->peer, 1 = peer->app */
+        uint16_t reserved;
+        uint64_t len;       /* bytes */
+        int64_t  arg;       /* see sockem_event_type_t */
+};
+
+
 
 /**
  * @brief Find sockem by (application) socket.
- * @remark Application is responsible for locking.
+ *
+ * The lookup is lock-free and O(1), but the application is responsible
+ * for not closing the returned sockem concurrently.
  */
 sockem_t *sockem_find (int sockfd);